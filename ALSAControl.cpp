@@ -54,6 +54,7 @@ ALSAControl::~ALSAControl()
 status_t ALSAControl::get(const char *name, unsigned int &value, int index)
 {
     struct mixer_ctl *ctl;
+    Mutex::Autolock lock(mLock);
 
     if (!mHandle) {
         LOGE("Control not initialized");
@@ -72,7 +73,9 @@ status_t ALSAControl::set(const char *name, unsigned int value, int index)
 {
     struct mixer_ctl *ctl;
     int ret = 0;
-    LOGD("set:: name %s value %d index %d", name, value, index);
+    ALSA_TRACE_SCOPE("mixer_set");
+    LOGD_RATELIMIT("set:: name %s value %d index %d", name, value, index);
+    Mutex::Autolock lock(mLock);
     if (!mHandle) {
         LOGE("Control not initialized");
         return NO_INIT;
@@ -92,7 +95,9 @@ status_t ALSAControl::set(const char *name, const char *value)
 {
     struct mixer_ctl *ctl;
     int ret = 0;
-    LOGD("set:: name %s value %s", name, value);
+    ALSA_TRACE_SCOPE("mixer_set");
+    LOGD_RATELIMIT("set:: name %s value %s", name, value);
+    Mutex::Autolock lock(mLock);
 
     if (!mHandle) {
         LOGE("Control not initialized");
@@ -0,0 +1,197 @@
+/* ALSAEchoReference.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+
+#define LOG_TAG "ALSAEchoReference"
+//#define LOG_NDEBUG 0
+#define LOG_NDDEBUG 0
+#include <utils/Log.h>
+#include <utils/String8.h>
+
+#include <cutils/atomic.h>
+
+#include "AudioHardwareALSA.h"
+
+namespace android_audio_legacy
+{
+
+// ----------------------------------------------------------------------------
+
+volatile int32_t ALSAEchoReference::sNextToken = 0;
+
+ALSAEchoReference::ALSAEchoReference() :
+    mReaders(0),
+    mOwner(0),
+    mWritten(0),
+    mAnchorSeq(0),
+    mDelayErrors(0),
+    mMisses(0)
+{
+    memset(mAnchors, 0, sizeof(mAnchors));
+}
+
+int32_t ALSAEchoReference::newToken()
+{
+    return android_atomic_inc(&sNextToken) + 1;
+}
+
+void ALSAEchoReference::start()
+{
+    android_atomic_inc(&mReaders);
+}
+
+void ALSAEchoReference::stop()
+{
+    android_atomic_dec(&mReaders);
+}
+
+void ALSAEchoReference::release(int32_t token)
+{
+    android_atomic_release_cas(token, 0, &mOwner);
+}
+
+void ALSAEchoReference::write(int32_t token, struct pcm *pcm, const void *buffer,
+                              size_t bytes, uint32_t channels, uint32_t rate)
+{
+    if (!active() || !rate || !channels)
+        return;
+    if (android_atomic_acquire_load(&mOwner) != token &&
+        android_atomic_acquire_cas(0, token, &mOwner))
+        return;
+
+    const int16_t *in = (const int16_t *)buffer;
+    size_t frames = bytes / (channels * sizeof(int16_t));
+    uint32_t pos = (uint32_t)mWritten;      // only this thread stores it
+
+    if (frames > ECHO_REF_FRAMES - ECHO_REF_GUARD) {
+        in += (frames - (ECHO_REF_FRAMES - ECHO_REF_GUARD)) * channels;
+        frames = ECHO_REF_FRAMES - ECHO_REF_GUARD;
+    }
+    // Readers stay ECHO_REF_GUARD frames behind mWritten, so never run
+    // further ahead of it than that
+    for (size_t done = 0; done < frames; ) {
+        size_t chunk = frames - done < ECHO_REF_GUARD ? frames - done : ECHO_REF_GUARD;
+
+        for (size_t i = done; i < done + chunk; i++, in += channels) {
+            int32_t sample = (channels == 1) ? in[0] : (in[0] + in[1]) / 2;
+            mRing[(pos + i) & (ECHO_REF_FRAMES - 1)] = (int16_t)sample;
+        }
+        done += chunk;
+        if (done < frames)
+            android_atomic_release_store((int32_t)(pos + done), &mWritten);
+    }
+
+    // Everything still queued ahead of this period plays first
+    nsecs_t now = systemTime();
+    snd_pcm_sframes_t delay = frames;
+    if (!pcm || ioctl(pcm->fd, SNDRV_PCM_IOCTL_DELAY, &delay)) {
+        android_atomic_inc(&mDelayErrors);
+        delay = frames;
+    }
+
+    int32_t seq = mAnchorSeq;
+    Anchor *anchor = &mAnchors[seq & (ECHO_REF_ANCHORS - 1)];
+    anchor->frame = pos;
+    anchor->time = now + ((nsecs_t)delay - (nsecs_t)frames) * 1000000000LL / rate;
+    anchor->rate = rate;
+    android_atomic_release_store(seq + 1, &mAnchorSeq);
+    android_atomic_release_store((int32_t)(pos + frames), &mWritten);
+}
+
+/*
+ * The writer only reuses an anchor slot ECHO_REF_ANCHORS periods later,
+ * so a copy is good as long as the sequence did not move that far while
+ * it was taken.
+ */
+bool ALSAEchoReference::latestAnchor(Anchor *anchor)
+{
+    for (int retry = 0; retry < 3; retry++) {
+        int32_t seq = android_atomic_acquire_load(&mAnchorSeq);
+
+        if (seq == 0)
+            return false;
+        *anchor = mAnchors[(seq - 1) & (ECHO_REF_ANCHORS - 1)];
+        if (android_atomic_acquire_load(&mAnchorSeq) - seq < ECHO_REF_ANCHORS - 1)
+            return true;
+    }
+    return false;
+}
+
+size_t ALSAEchoReference::read(int16_t *out, size_t frames, uint32_t rate, nsecs_t captureTime)
+{
+    Anchor anchor;
+    size_t found = 0;
+
+    memset(out, 0, frames * sizeof(int16_t));
+    if (!rate || !latestAnchor(&anchor)) {
+        android_atomic_inc(&mMisses);
+        return 0;
+    }
+
+    uint32_t written = (uint32_t)android_atomic_acquire_load(&mWritten);
+    double pos = (double)(captureTime - anchor.time) * anchor.rate / 1000000000.0;
+    double step = (double)anchor.rate / rate;
+    uint32_t oldest = written;
+
+    for (size_t i = 0; i < frames; i++, pos += step) {
+        double base = floor(pos);
+        uint32_t frame = anchor.frame + (int32_t)base;
+        int32_t ahead = (int32_t)(written - frame);
+
+        // Need this frame and the next one, both clear of the writer
+        if (ahead < 2 || ahead > ECHO_REF_FRAMES - ECHO_REF_GUARD)
+            continue;
+
+        int32_t a = mRing[frame & (ECHO_REF_FRAMES - 1)];
+        int32_t b = mRing[(frame + 1) & (ECHO_REF_FRAMES - 1)];
+        out[i] = (int16_t)(a + (b - a) * (pos - base));
+        if ((int32_t)(oldest - frame) > 0)
+            oldest = frame;
+        found++;
+    }
+
+    // The writer may be up to ECHO_REF_GUARD frames past what it published
+    uint32_t now = (uint32_t)android_atomic_acquire_load(&mWritten);
+    if (found && (int32_t)(now - oldest) > ECHO_REF_FRAMES - ECHO_REF_GUARD) {
+        memset(out, 0, frames * sizeof(int16_t));
+        found = 0;
+    }
+    if (found < frames)
+        android_atomic_inc(&mMisses);
+    return found;
+}
+
+void ALSAEchoReference::dump(String8& result)
+{
+    char buffer[256];
+
+    snprintf(buffer, sizeof(buffer),
+             "  echo reference: %d readers, writer %d, %u frames written, "
+             "%d delay errors, %d short reads\n",
+             android_atomic_acquire_load(&mReaders),
+             android_atomic_acquire_load(&mOwner),
+             (uint32_t)android_atomic_acquire_load(&mWritten),
+             android_atomic_acquire_load(&mDelayErrors),
+             android_atomic_acquire_load(&mMisses));
+    result.append(buffer);
+}
+
+}       // namespace android_audio_legacy
@@ -0,0 +1,363 @@
+/* ALSAJitterBuffer.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define LOG_TAG "ALSAJitterBuffer"
+//#define LOG_NDEBUG 0
+#define LOG_NDDEBUG 0
+#include <utils/Log.h>
+#include <utils/String8.h>
+
+#include "AudioHardwareALSA.h"
+
+namespace android_audio_legacy
+{
+
+// ----------------------------------------------------------------------------
+
+static const int32_t UNITY_GAIN_Q15 = 1 << 15;
+
+ALSAJitterBuffer::ALSAJitterBuffer(AudioHardwareALSA *parent, alsa_handle_t *handle) :
+    Thread(false),
+    mParent(parent),
+    mHandle(handle),
+    mRate(handle->sampleRate),
+    mReadPos(0),
+    mCount(0),
+    mPrimed(false),
+    mConcealed(0),
+    mConcealGain(UNITY_GAIN_Q15),
+    mLastArrival(0),
+    mLastSamples(0),
+    mJitterNs(0),
+    mUnderruns(0),
+    mOverflows(0),
+    mStretched(0),
+    mCompressed(0),
+    mEchoRefToken(ALSAEchoReference::newToken())
+{
+    // One VoIP packet per DSP period, mono 16 bit
+    mFrameSamples = handle->periodSize / sizeof(int16_t);
+    if (mFrameSamples == 0)
+        mFrameSamples = mRate / 50;
+    mOverlap = mRate * JB_OVERLAP_MS / 1000;
+    mMinLag = mRate * JB_MIN_PITCH_MS / 1000;
+    mMaxLag = mRate * JB_MAX_PITCH_MS / 1000;
+    if ((size_t)mMaxLag + mOverlap > mFrameSamples)
+        mMaxLag = mFrameSamples - mOverlap;
+
+    mCapacity = mRate * JB_MAX_DEPTH_MS / 1000;
+    if (mCapacity < 3 * mFrameSamples)
+        mCapacity = 3 * mFrameSamples;
+    mTarget = 2 * mFrameSamples;
+
+    mRing = (int16_t *) malloc(mCapacity * sizeof(int16_t));
+    mScratch = (int16_t *) malloc((mFrameSamples + mMaxLag + mOverlap) * sizeof(int16_t));
+    mHistory = (int16_t *) calloc(mFrameSamples, sizeof(int16_t));
+    if (!mRing || !mScratch || !mHistory) {
+        LOGE("no memory for a %d sample jitter buffer", mCapacity);
+        free(mRing);
+        mRing = NULL;
+    }
+}
+
+ALSAJitterBuffer::~ALSAJitterBuffer()
+{
+    free(mRing);
+    free(mScratch);
+    free(mHistory);
+}
+
+void ALSAJitterBuffer::exit()
+{
+    {
+        Mutex::Autolock autoLock(mLock);
+        requestExit();
+        mSpaceCV.broadcast();
+    }
+    requestExitAndWait();
+    mParent->mEchoRef.release(mEchoRefToken);
+}
+
+int ALSAJitterBuffer::write(const void *buffer, size_t bytes)
+{
+    const int16_t *in = (const int16_t *)buffer;
+    size_t samples = bytes / sizeof(int16_t);
+    nsecs_t frameNs = (nsecs_t)mFrameSamples * 1000000000LL / mRate;
+
+    Mutex::Autolock autoLock(mLock);
+
+    updateJitter(systemTime(), samples);
+
+    // Hold the writer at about one frame above target so the app side is
+    // paced by the DSP instead of draining into our queue.
+    size_t limit = mTarget + mFrameSamples;
+    while (!exitPending() && mCount > 0 && mCount + samples > limit) {
+        if (mSpaceCV.waitRelative(mLock, 4 * frameNs) != NO_ERROR)
+            break;
+        limit = mTarget + mFrameSamples;
+    }
+
+    if (samples > mCapacity) {
+        in += samples - mCapacity;
+        samples = mCapacity;
+    }
+    if (mCount + samples > mCapacity) {
+        consume(mCount + samples - mCapacity);
+        mOverflows++;
+    }
+
+    size_t pos = (mReadPos + mCount) % mCapacity;
+    size_t first = mCapacity - pos;
+    if (first > samples)
+        first = samples;
+    memcpy(mRing + pos, in, first * sizeof(int16_t));
+    memcpy(mRing, in + first, (samples - first) * sizeof(int16_t));
+    mCount += samples;
+    ALSA_TRACE_INT("voip_fill", mCount);
+    return 0;
+}
+
+/*
+ * Smoothed deviation of the packet inter-arrival time from the audio
+ * duration of the previous packet, as RTP does for transit jitter. The
+ * target depth covers three times that plus one frame.
+ */
+void ALSAJitterBuffer::updateJitter(nsecs_t now, size_t samples)
+{
+    if (mLastArrival) {
+        int64_t expected = (int64_t)mLastSamples * 1000000000LL / mRate;
+        int64_t deviation = (now - mLastArrival) - expected;
+
+        if (deviation < 0)
+            deviation = -deviation;
+        mJitterNs += (deviation - mJitterNs) / 16;
+
+        size_t target = mFrameSamples + (size_t)(3 * mJitterNs * mRate / 1000000000LL);
+        if (target > mCapacity - mFrameSamples)
+            target = mCapacity - mFrameSamples;
+        mTarget = target;
+    }
+    mLastArrival = now;
+    mLastSamples = samples;
+}
+
+size_t ALSAJitterBuffer::peek(int16_t *dst, size_t samples)
+{
+    if (samples > mCount)
+        samples = mCount;
+
+    size_t first = mCapacity - mReadPos;
+    if (first > samples)
+        first = samples;
+    memcpy(dst, mRing + mReadPos, first * sizeof(int16_t));
+    memcpy(dst + first, mRing, (samples - first) * sizeof(int16_t));
+    return samples;
+}
+
+void ALSAJitterBuffer::consume(size_t samples)
+{
+    if (samples > mCount)
+        samples = mCount;
+    mReadPos = (mReadPos + samples) % mCapacity;
+    mCount -= samples;
+}
+
+/*
+ * Lag in [mMinLag, mMaxLag] at which x best repeats itself over one
+ * overlap window, i.e. the splice point that keeps the waveform aligned.
+ */
+int ALSAJitterBuffer::bestLag(const int16_t *x)
+{
+    int best = mMinLag;
+    float bestScore = -1e30f;
+
+    for (int lag = mMinLag; lag <= mMaxLag; lag++) {
+        int64_t corr = 0, energy = 1;
+
+        for (size_t i = 0; i < mOverlap; i++) {
+            corr += (int32_t)x[i] * x[i + lag];
+            energy += (int32_t)x[i + lag] * x[i + lag];
+        }
+        float score = (float)corr / sqrtf((float)energy);
+        if (score > bestScore) {
+            bestScore = score;
+            best = lag;
+        }
+    }
+    return best;
+}
+
+// Repeat the last pitch period of what was played, fading out
+void ALSAJitterBuffer::conceal(int16_t *out)
+{
+    int period = bestLag(mHistory);
+    int32_t startGain = mConcealGain;
+    int32_t endGain = mConcealGain / 2;
+
+    memcpy(mScratch, mHistory + mFrameSamples - period, period * sizeof(int16_t));
+    for (size_t i = 0; i < mFrameSamples; i++) {
+        int32_t gain = startGain + (endGain - startGain) * (int32_t)i / (int32_t)mFrameSamples;
+        out[i] = (int16_t)((mScratch[i % period] * gain) >> 15);
+    }
+    mConcealGain = endGain;
+}
+
+void ALSAJitterBuffer::pull(int16_t *out)
+{
+    Mutex::Autolock autoLock(mLock);
+    size_t n = mFrameSamples;
+    size_t used = n;
+
+    if (!mPrimed) {
+        if (mCount < mTarget) {
+            memset(out, 0, n * sizeof(int16_t));
+            return;
+        }
+        mPrimed = true;
+    }
+
+    if (mCount == 0) {
+        conceal(out);
+        mUnderruns++;
+        if (++mConcealed > JB_MAX_CONCEALED) {
+            LOGV("pull: dry for %d frames, rebuffering", mConcealed);
+            mPrimed = false;
+        }
+        return;
+    }
+
+    size_t got = peek(mScratch, n + mMaxLag + mOverlap);
+    const int16_t *x = mScratch;
+
+    if (got < n) {
+        // Play out the tail and fade to silence rather than stop dead
+        size_t fade = got < mOverlap ? got : mOverlap;
+
+        memcpy(out, x, got * sizeof(int16_t));
+        memset(out + got, 0, (n - got) * sizeof(int16_t));
+        for (size_t i = 0; i < fade; i++)
+            out[got - fade + i] = (int16_t)(out[got - fade + i] * (int32_t)(fade - i) / (int32_t)fade);
+        used = got;
+        mUnderruns++;
+        mConcealed = 1;
+        mConcealGain = 0;
+    } else if (mCount > mTarget + n / 2 && got >= n + mMaxLag + mOverlap) {
+        // Too deep: drop one pitch period
+        int lag = bestLag(x);
+        int32_t L = mOverlap;
+
+        for (int32_t i = 0; i < L; i++)
+            out[i] = (int16_t)((x[i] * (L - i) + x[i + lag] * i) / L);
+        for (size_t i = L; i < n; i++)
+            out[i] = x[i + lag];
+        used = n + lag;
+        mCompressed++;
+    } else if (mCount + n / 2 < mTarget) {
+        // Running low: play one pitch period twice
+        int lag = bestLag(x);
+        int32_t L = mOverlap;
+
+        memcpy(out, x, lag * sizeof(int16_t));
+        for (int32_t i = 0; i < L; i++)
+            out[lag + i] = (int16_t)((x[lag + i] * (L - i) + x[i] * i) / L);
+        for (size_t i = lag + L; i < n; i++)
+            out[i] = x[i - lag];
+        used = n - lag;
+        mStretched++;
+    } else {
+        memcpy(out, x, n * sizeof(int16_t));
+    }
+
+    if (mConcealed && got >= n) {
+        // Coming back from concealment, ramp in from the faded level
+        int32_t L = mOverlap;
+        for (int32_t i = 0; i < L; i++) {
+            int32_t gain = mConcealGain + (UNITY_GAIN_Q15 - mConcealGain) * i / L;
+            out[i] = (int16_t)((out[i] * gain) >> 15);
+        }
+        mConcealed = 0;
+        mConcealGain = UNITY_GAIN_Q15;
+    }
+
+    consume(used);
+    mSpaceCV.broadcast();
+}
+
+// Same recovery the write path does without the jitter buffer
+void ALSAJitterBuffer::recover()
+{
+    ALSARWLock::AutoWLock autoLock(mParent->mRouteLock);
+
+    LOGE("playout: pcm_write failed, restarting VoIP call");
+    if (mHandle->handle) {
+        pcm_close(mHandle->handle);
+        mHandle->handle = NULL;
+    }
+    if (mHandle->rxHandle) {
+        pcm_close(mHandle->rxHandle);
+        mHandle->rxHandle = NULL;
+    }
+    mHandle->module->startVoipCall(mHandle);
+}
+
+bool ALSAJitterBuffer::threadLoop()
+{
+    int n = 1;
+
+    pull(mHistory);
+    {
+        // Keep routing from closing the PCM under the write
+        ALSARWLock::AutoRLock autoLock(mParent->mRouteLock);
+        if (mHandle->rxHandle) {
+            ALSA_TRACE_BEGIN("pcm_write");
+            n = pcm_write(mHandle->rxHandle, mHistory, mFrameSamples * sizeof(int16_t));
+            ALSA_TRACE_END();
+            if (n == 0 && mParent->mEchoRef.active())
+                mParent->mEchoRef.write(mEchoRefToken, mHandle->rxHandle, mHistory,
+                        mFrameSamples * sizeof(int16_t), 1, mRate);
+        }
+    }
+
+    if (n > 0) {
+        // No PCM right now, keep time so the queue still drains
+        usleep(mFrameSamples * 1000000 / mRate);
+    } else if (n < 0 && !exitPending()) {
+        recover();
+    }
+    return !exitPending();
+}
+
+void ALSAJitterBuffer::dump(String8& result)
+{
+    char buffer[256];
+    Mutex::Autolock autoLock(mLock);
+
+    snprintf(buffer, sizeof(buffer),
+             "  jitter buffer: depth %d ms target %d ms jitter %d ms, "
+             "%u underruns %u overflows %u stretched %u compressed\n",
+             (int)(mCount * 1000 / mRate), (int)(mTarget * 1000 / mRate),
+             (int)(mJitterNs / 1000000), mUnderruns, mOverflows,
+             mStretched, mCompressed);
+    result.append(buffer);
+}
+
+}       // namespace android_audio_legacy
@@ -0,0 +1,197 @@
+/* ALSALock.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#define LOG_TAG "ALSALock"
+//#define LOG_NDEBUG 0
+#define LOG_NDDEBUG 0
+#include <utils/Log.h>
+#include <utils/String8.h>
+
+#include <cutils/atomic.h>
+
+#include "AudioHardwareALSA.h"
+
+namespace android_audio_legacy
+{
+
+// ----------------------------------------------------------------------------
+
+bool ALSALockStats::sEnabled = false;
+
+static void atomicMax(volatile int32_t *addr, int32_t value)
+{
+    int32_t old;
+
+    do {
+        old = android_atomic_acquire_load(addr);
+        if (value <= old)
+            return;
+    } while (android_atomic_cmpxchg(old, value, addr));
+}
+
+static int32_t readAndClear(volatile int32_t *addr)
+{
+    int32_t old;
+
+    do {
+        old = android_atomic_acquire_load(addr);
+    } while (android_atomic_cmpxchg(old, 0, addr));
+    return old;
+}
+
+ALSALockStats::ALSALockStats(const char *name) :
+    mName(name),
+    mCount(0),
+    mContended(0),
+    mMaxWaitUs(0),
+    mMaxHoldUs(0),
+    mWaitUs(0),
+    mHoldUs(0)
+{
+}
+
+void ALSALockStats::acquired(nsecs_t waitNs, bool contended)
+{
+    int32_t waitUs = (int32_t)(waitNs / 1000);
+
+    android_atomic_inc(&mCount);
+    if (contended) {
+        android_atomic_inc(&mContended);
+        atomicMax(&mMaxWaitUs, waitUs);
+        Mutex::Autolock lock(mSumLock);
+        mWaitUs += waitUs;
+    }
+}
+
+void ALSALockStats::released(nsecs_t holdNs)
+{
+    int32_t holdUs = (int32_t)(holdNs / 1000);
+
+    atomicMax(&mMaxHoldUs, holdUs);
+    Mutex::Autolock lock(mSumLock);
+    mHoldUs += holdUs;
+}
+
+void ALSALockStats::dump(String8& result)
+{
+    char buffer[256];
+
+    if (!sEnabled) {
+        snprintf(buffer, sizeof(buffer), "  %s: lock stats off, set %s=1\n",
+                 mName, LOCK_STATS_PROP);
+        result.append(buffer);
+        return;
+    }
+    int32_t count = readAndClear(&mCount);
+    int32_t contended = readAndClear(&mContended);
+    int32_t maxWaitUs = readAndClear(&mMaxWaitUs);
+    int32_t maxHoldUs = readAndClear(&mMaxHoldUs);
+    int64_t waitUs, holdUs;
+    {
+        Mutex::Autolock lock(mSumLock);
+        waitUs = mWaitUs;
+        holdUs = mHoldUs;
+        mWaitUs = 0;
+        mHoldUs = 0;
+    }
+
+    snprintf(buffer, sizeof(buffer),
+             "  %s: %d locks, %d contended, wait %lld us (max %d), hold %lld us (max %d)\n",
+             mName, count, contended, (long long)waitUs, maxWaitUs, (long long)holdUs,
+             maxHoldUs);
+    result.append(buffer);
+}
+
+// ----------------------------------------------------------------------------
+
+void ALSAMutex::lock()
+{
+    if (!ALSALockStats::sEnabled) {
+        mMutex.lock();
+        return;
+    }
+
+    nsecs_t start = systemTime();
+    bool contended = (mMutex.tryLock() != NO_ERROR);
+
+    if (contended)
+        mMutex.lock();
+    mAcquired = systemTime();
+    mStats.acquired(mAcquired - start, contended);
+}
+
+void ALSAMutex::unlock()
+{
+    if (mAcquired) {
+        mStats.released(systemTime() - mAcquired);
+        mAcquired = 0;
+    }
+    mMutex.unlock();
+}
+
+// ----------------------------------------------------------------------------
+
+nsecs_t ALSARWLock::readLock()
+{
+    if (!ALSALockStats::sEnabled) {
+        mRWLock.readLock();
+        return 0;
+    }
+
+    nsecs_t start = systemTime();
+    bool contended = (mRWLock.tryReadLock() != NO_ERROR);
+
+    if (contended)
+        mRWLock.readLock();
+    nsecs_t acquired = systemTime();
+    mStats.acquired(acquired - start, contended);
+    return acquired;
+}
+
+void ALSARWLock::readUnlock(nsecs_t acquired)
+{
+    if (acquired)
+        mStats.released(systemTime() - acquired);
+    mRWLock.unlock();
+}
+
+void ALSARWLock::writeLock()
+{
+    if (!ALSALockStats::sEnabled) {
+        mRWLock.writeLock();
+        return;
+    }
+
+    nsecs_t start = systemTime();
+    bool contended = (mRWLock.tryWriteLock() != NO_ERROR);
+
+    if (contended)
+        mRWLock.writeLock();
+    mWriteAcquired = systemTime();
+    mStats.acquired(mWriteAcquired - start, contended);
+}
+
+void ALSARWLock::writeUnlock()
+{
+    if (mWriteAcquired) {
+        mStats.released(systemTime() - mWriteAcquired);
+        mWriteAcquired = 0;
+    }
+    mRWLock.unlock();
+}
+
+}       // namespace android_audio_legacy
@@ -0,0 +1,258 @@
+/* ALSAPcmTap.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_TAG "ALSAPcmTap"
+//#define LOG_NDEBUG 0
+#define LOG_NDDEBUG 0
+#include <utils/Log.h>
+#include <utils/String8.h>
+
+#include <cutils/atomic.h>
+#include <cutils/properties.h>
+
+#include "AudioHardwareALSA.h"
+
+namespace android_audio_legacy
+{
+
+// ----------------------------------------------------------------------------
+
+#define ID_RIFF 0x46464952
+#define ID_WAVE 0x45564157
+#define ID_FMT  0x20746d66
+#define ID_DATA 0x61746164
+
+struct wav_header {
+    uint32_t riff_id;
+    uint32_t riff_sz;
+    uint32_t riff_fmt;
+    uint32_t fmt_id;
+    uint32_t fmt_sz;
+    uint16_t audio_format;
+    uint16_t num_channels;
+    uint32_t sample_rate;
+    uint32_t byte_rate;
+    uint16_t block_align;
+    uint16_t bits_per_sample;
+    uint32_t data_id;
+    uint32_t data_sz;
+};
+
+static bool writeHeader(int fd, uint32_t rate, uint32_t channels, uint32_t dataBytes)
+{
+    struct wav_header hdr;
+
+    hdr.riff_id = ID_RIFF;
+    hdr.riff_sz = dataBytes + sizeof(hdr) - 8;
+    hdr.riff_fmt = ID_WAVE;
+    hdr.fmt_id = ID_FMT;
+    hdr.fmt_sz = 16;
+    hdr.audio_format = 1;                   // PCM
+    hdr.num_channels = channels;
+    hdr.sample_rate = rate;
+    hdr.byte_rate = rate * channels * sizeof(int16_t);
+    hdr.block_align = channels * sizeof(int16_t);
+    hdr.bits_per_sample = 16;
+    hdr.data_id = ID_DATA;
+    hdr.data_sz = dataBytes;
+    return pwrite(fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr);
+}
+
+ALSAPcmTap::ALSAPcmTap(const char *name, uint32_t rate, uint32_t channels, uint32_t seconds) :
+    Thread(false),
+    mFd(-1),
+    mRate(rate),
+    mChannels(channels ? channels : 1),
+    mRing(NULL),
+    mWritePos(0),
+    mReadPos(0),
+    mDone(0),
+    mDropped(0),
+    mQueued(0),
+    mFileBytes(0),
+    mErrno(0)
+{
+    char dir[PROPERTY_VALUE_MAX];
+    char value[PROPERTY_VALUE_MAX];
+    char stamp[32];
+    char path[PATH_MAX];
+    time_t now = time(NULL);
+    struct tm tm;
+
+    if (seconds > PCM_TAP_MAX_SECONDS)
+        seconds = PCM_TAP_MAX_SECONDS;
+    property_get(PCM_TAP_MAX_BYTES_PROP, value, "0");
+    mLimit = atoi(value) > 0 ? atoi(value) : PCM_TAP_MAX_BYTES;
+    if (mLimit > (size_t)seconds * mRate * mChannels * sizeof(int16_t))
+        mLimit = (size_t)seconds * mRate * mChannels * sizeof(int16_t);
+    mLimit -= mLimit % (mChannels * sizeof(int16_t));
+    mDeadline = systemTime() + s2ns(seconds);
+
+    property_get(PCM_TAP_DIR_PROP, dir, PCM_TAP_DIR);
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    snprintf(path, sizeof(path), "%s/%s_%s.wav", dir, name, stamp);
+    // Use case names carry spaces, keep the file name shell friendly
+    for (char *p = strrchr(path, '/') + 1; *p; p++) {
+        if (*p == ' ')
+            *p = '_';
+    }
+    mPath = path;
+
+    mRing = (char *)malloc(PCM_TAP_RING_BYTES);
+    if (!mRing) {
+        LOGE("ALSAPcmTap: no memory for the ring");
+        return;
+    }
+    mFd = open(mPath.string(), O_WRONLY | O_CREAT | O_TRUNC, 0660);
+    if (mFd < 0) {
+        LOGE("ALSAPcmTap: cannot create %s: %s", mPath.string(), strerror(errno));
+        return;
+    }
+    if (!writeHeader(mFd, mRate, mChannels, 0)) {
+        LOGE("ALSAPcmTap: cannot write %s: %s", mPath.string(), strerror(errno));
+        close(mFd);
+        mFd = -1;
+        return;
+    }
+    LOGD("ALSAPcmTap: capturing %u Hz %u ch to %s, up to %u bytes in %u s",
+         mRate, mChannels, mPath.string(), mLimit, seconds);
+}
+
+ALSAPcmTap::~ALSAPcmTap()
+{
+    // The thread can exit without finishing when stop() races its loop
+    if (mFd >= 0)
+        finish();
+    free(mRing);
+}
+
+void ALSAPcmTap::write(const void *buffer, size_t bytes)
+{
+    if (android_atomic_acquire_load(&mDone))
+        return;
+
+    bool last = (bytes >= mLimit - mQueued);
+    if (last)
+        bytes = mLimit - mQueued;
+
+    int32_t w = mWritePos;
+    uint32_t used = (uint32_t)(w - android_atomic_acquire_load(&mReadPos));
+    if (bytes > PCM_TAP_RING_BYTES - used) {
+        // The disk fell behind; a gap is better than stalling the stream
+        android_atomic_inc(&mDropped);
+        return;
+    }
+
+    size_t pos = (uint32_t)w & (PCM_TAP_RING_BYTES - 1);
+    size_t first = PCM_TAP_RING_BYTES - pos;
+    if (first > bytes)
+        first = bytes;
+    memcpy(mRing + pos, buffer, first);
+    memcpy(mRing, (const char *)buffer + first, bytes - first);
+    android_atomic_release_store(w + bytes, &mWritePos);
+    mQueued += bytes;
+
+    if (last)
+        android_atomic_release_store(1, &mDone);
+}
+
+void ALSAPcmTap::stop()
+{
+    android_atomic_release_store(1, &mDone);
+    requestExitAndWait();
+}
+
+bool ALSAPcmTap::threadLoop()
+{
+    // Sample the end condition first so the drain below sees every
+    // period queued before it
+    bool done = android_atomic_acquire_load(&mDone) || exitPending() ||
+                systemTime() >= mDeadline;
+
+    if (done)
+        android_atomic_release_store(1, &mDone);
+    drain();
+    if (done) {
+        finish();
+        return false;
+    }
+    usleep(PCM_TAP_POLL_MS * 1000);
+    return true;
+}
+
+void ALSAPcmTap::drain()
+{
+    int32_t w = android_atomic_acquire_load(&mWritePos);
+    int32_t r = mReadPos;
+
+    while (r != w) {
+        size_t pos = (uint32_t)r & (PCM_TAP_RING_BYTES - 1);
+        size_t chunk = (uint32_t)(w - r);
+        if (chunk > PCM_TAP_RING_BYTES - pos)
+            chunk = PCM_TAP_RING_BYTES - pos;
+
+        ssize_t n = ::write(mFd, mRing + pos, chunk);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            mErrno = n < 0 ? errno : ENOSPC;
+            LOGE("drain: writing %s failed: %s", mPath.string(), strerror(mErrno));
+            android_atomic_release_store(1, &mDone);
+            r = w;
+        } else {
+            r += n;
+            android_atomic_add(n, &mFileBytes);
+        }
+        android_atomic_release_store(r, &mReadPos);
+    }
+}
+
+void ALSAPcmTap::finish()
+{
+    uint32_t bytes = android_atomic_acquire_load(&mFileBytes);
+
+    if (!writeHeader(mFd, mRate, mChannels, bytes))
+        LOGE("finish: cannot update the header of %s", mPath.string());
+    close(mFd);
+    mFd = -1;
+    LOGD("finish: %s done, %u bytes, %d periods dropped", mPath.string(), bytes,
+         android_atomic_acquire_load(&mDropped));
+}
+
+void ALSAPcmTap::dump(String8& result)
+{
+    char buffer[512];
+
+    snprintf(buffer, sizeof(buffer), "  pcm tap: %s, %u of %u bytes, %d periods dropped%s%s\n",
+             mPath.string(), (uint32_t)android_atomic_acquire_load(&mFileBytes), mLimit,
+             android_atomic_acquire_load(&mDropped),
+             android_atomic_acquire_load(&mDone) ? ", done" : "",
+             mErrno ? ", write error" : "");
+    result.append(buffer);
+}
+
+}       // namespace android_audio_legacy
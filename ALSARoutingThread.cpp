@@ -0,0 +1,154 @@
+/* ALSARoutingThread.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define LOG_TAG "ALSARoutingThread"
+//#define LOG_NDEBUG 0
+#define LOG_NDDEBUG 0
+#include <utils/Log.h>
+#include <utils/String8.h>
+
+#include "AudioHardwareALSA.h"
+
+namespace android_audio_legacy
+{
+
+// ----------------------------------------------------------------------------
+
+void ALSARoutingThread::Command::wait()
+{
+    Mutex::Autolock autoLock(mLock);
+
+    while (!mDone)
+        mCond.wait(mLock);
+}
+
+ALSARoutingThread::ALSARoutingThread(AudioHardwareALSA *parent) :
+    Thread(false),
+    mParent(parent)
+{
+}
+
+ALSARoutingThread::~ALSARoutingThread()
+{
+}
+
+sp<ALSARoutingThread::Command> ALSARoutingThread::post(int cmd, int device, void *arg)
+{
+    Mutex::Autolock autoLock(mLock);
+
+    if (cmd == CMD_ROUTE && !mCommands.empty()) {
+        List< sp<Command> >::iterator tail = mCommands.end();
+        tail--;
+        if ((*tail)->mCmd == CMD_ROUTE) {
+            // Device 0 means "re-apply the current device", which the
+            // queued request does anyway.
+            if (device)
+                (*tail)->mDevice = device;
+            LOGV("post: route merged into pending request, device %d", (*tail)->mDevice);
+            return *tail;
+        }
+    }
+
+    sp<Command> command = new Command(cmd, device, arg);
+    mCommands.push_back(command);
+    mWaitWorkCV.signal();
+    return command;
+}
+
+void ALSARoutingThread::sync()
+{
+    post(CMD_SYNC, 0)->wait();
+}
+
+void ALSARoutingThread::exit()
+{
+    {
+        Mutex::Autolock autoLock(mLock);
+        requestExit();
+        mWaitWorkCV.signal();
+    }
+    requestExitAndWait();
+}
+
+void ALSARoutingThread::complete(const sp<Command>& command)
+{
+    Mutex::Autolock autoLock(command->mLock);
+
+    command->mDone = true;
+    command->mCond.broadcast();
+}
+
+bool ALSARoutingThread::threadLoop()
+{
+    sp<Command> command;
+
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        while (mCommands.empty() && !exitPending())
+            mWaitWorkCV.wait(mLock);
+
+        if (exitPending()) {
+            // Release anyone still waiting on a command we will not run
+            while (!mCommands.empty()) {
+                complete(*mCommands.begin());
+                mCommands.erase(mCommands.begin());
+            }
+            return false;
+        }
+        command = *mCommands.begin();
+        mCommands.erase(mCommands.begin());
+    }
+
+    nsecs_t start = systemTime();
+
+    switch (command->mCmd) {
+    case CMD_INIT_UCM:
+        mParent->initUcm();
+        break;
+    case CMD_ROUTE:
+        mParent->doRouting(command->mDevice);
+        break;
+    case CMD_HANDLE_FM: {
+        ALSARWLock::AutoWLock autoLock(mParent->mRouteLock);
+        mParent->handleFm(command->mDevice);
+        break;
+    }
+    case CMD_SET_FLAGS: {
+        ALSARWLock::AutoWLock autoLock(mParent->mRouteLock);
+        mParent->mALSADevice->setFlags(mParent->mCard, (uint32_t)command->mDevice);
+        break;
+    }
+    case CMD_PREWARM:
+        static_cast<AudioStreamOutALSA *>(command->mArg)->prewarm();
+        break;
+    case CMD_SYNC:
+    default:
+        break;
+    }
+
+    LOGV("threadLoop: command %d device %d done in %lld us", command->mCmd,
+         command->mDevice, (long long)((systemTime() - start) / 1000));
+    complete(command);
+    return true;
+}
+
+}       // namespace android_audio_legacy
@@ -0,0 +1,46 @@
+/* ALSASharedState.h
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#ifndef ANDROID_ALSA_SHARED_STATE_H
+#define ANDROID_ALSA_SHARED_STATE_H
+
+#include <stdint.h>
+
+/**
+ * HAL state the policy manager reads on hot paths. Both modules live in
+ * mediaserver, so the HAL exports one instance and the policy finds it
+ * with dlsym() instead of formatting and parsing getParameters() strings.
+ *
+ * The HAL stores a value and then bumps generation with a release store.
+ * A reader only copies the values again after generation has changed.
+ */
+#define ALSA_SHARED_STATE_LIBRARY   "/system/lib/hw/audio.primary.msm8960.so"
+#define ALSA_SHARED_STATE_SYMBOL    "alsa_shared_state"
+
+enum alsa_state_key {
+    ALSA_STATE_BT_HEADSET_VGS,      // headset controls SCO volume itself
+    ALSA_STATE_MAX
+};
+
+struct alsa_shared_state_t {
+    volatile int32_t    generation;
+    volatile int32_t    values[ALSA_STATE_MAX];
+};
+
+extern "C" struct alsa_shared_state_t alsa_shared_state;
+
+#endif    // ANDROID_ALSA_SHARED_STATE_H
@@ -21,6 +21,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <dlfcn.h>
 
@@ -43,16 +44,21 @@ namespace android_audio_legacy
 
 ALSAStreamOps::ALSAStreamOps(AudioHardwareALSA *parent, alsa_handle_t *handle) :
     mParent(parent),
-    mHandle(handle)
+    mHandle(handle),
+    mVoipRate(handle->sampleRate),
+    mVoipPeriod(handle->bufferSize),
+    mIoLock(useCaseName(handle->useCase))
 {
 }
 
 ALSAStreamOps::~ALSAStreamOps()
 {
-    Mutex::Autolock autoLock(mParent->mLock);
+    if (mTap != 0)
+        mTap->stop();
 
-    if((!strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) ||
-       (!strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP))) {
+    ALSARWLock::AutoWLock autoLock(mParent->mRouteLock);
+
+    if (useCaseIs(mHandle->useCase, UC_VOIP)) {
         if((mParent->mVoipStreamCount)) {
             mParent->mVoipStreamCount--;
             if(mParent->mVoipStreamCount > 0) {
@@ -65,13 +71,10 @@ ALSAStreamOps::~ALSAStreamOps()
     }
     close();
 
-    for(ALSAHandleList::iterator it = mParent->mDeviceList.begin();
-            it != mParent->mDeviceList.end(); ++it) {
-            if (mHandle == &(*it)) {
-                it->useCase[0] = 0;
-                mParent->mDeviceList.erase(it);
-                break;
-            }
+    ALSAHandleList::iterator it = mParent->mDeviceList.iteratorFor(mHandle);
+    if (it != mParent->mDeviceList.end()) {
+        it->useCase = USE_CASE_NONE;
+        mParent->mDeviceList.erase(it);
     }
 }
 
@@ -172,14 +175,40 @@ status_t ALSAStreamOps::set(int      *format,
 status_t ALSAStreamOps::setParameters(const String8& keyValuePairs)
 {
     AudioParameter param = AudioParameter(keyValuePairs);
-    String8 key = String8(AudioParameter::keyRouting);
+    String8 key = String8(VOIP_RATE_KEY);
+    status_t status = NO_ERROR;
     int device;
+    int rate;
+    int seconds;
+
+    if (param.getInt(key, rate) == NO_ERROR) {
+        LOGD("setParameters(): voip rate %d", rate);
+        if (useCaseIs(mHandle->useCase, UC_VOIP)) {
+            // Only the PCMs change rate; both streams keep the rate and
+            // period AudioFlinger opened them with, see toVoipPcm()
+            ALSAMutex::Autolock ioLock(mIoLock);
+            ALSARWLock::AutoWLock routeLock(mParent->mRouteLock);
+            status = mParent->switchVoipRate(mHandle, rate);
+        } else {
+            status = INVALID_OPERATION;
+        }
+        param.remove(key);
+    }
+
+    key = String8(PCM_TAP_KEY);
+    if (param.getInt(key, seconds) == NO_ERROR) {
+        LOGD("setParameters(): pcm tap %d s", seconds);
+        status = setTap(seconds);
+        param.remove(key);
+    }
+
+    key = String8(AudioParameter::keyRouting);
     if (param.getInt(key, device) == NO_ERROR) {
         // Ignore routing if device is 0.
         LOGD("setParameters(): keyRouting with device %d", device);
         mDevices = device;
         if(device) {
-            mParent->doRouting(device);
+            mParent->mRoutingThread->post(ALSARoutingThread::CMD_ROUTE, device);
         }
         param.remove(key);
     }
@@ -190,16 +219,58 @@ status_t ALSAStreamOps::setParameters(const String8& keyValuePairs)
         LOGD("setParameters(): handleFm with device %d", device);
         mDevices = device;
             if(device) {
-                mParent->handleFm(device);
+                mParent->mRoutingThread->post(ALSARoutingThread::CMD_HANDLE_FM, device);
             }
             param.remove(key);
         }
     }
 #endif
 
+    return status;
+}
+
+status_t ALSAStreamOps::setTap(int seconds)
+{
+    sp<ALSAPcmTap> tap;
+    sp<ALSAPcmTap> old;
+
+    if (seconds > 0) {
+        char name[64];
+        uint32_t rate, channels;
+        {
+            ALSAMutex::Autolock ioLock(mIoLock);
+            snprintf(name, sizeof(name), "%s_%x", useCaseName(mHandle->useCase),
+                     mHandle->devices);
+            rate = mHandle->sampleRate;
+            channels = mHandle->channels;
+        }
+        // File creation stays out of mIoLock, the data path must not wait on it
+        tap = new ALSAPcmTap(name, rate, channels, seconds);
+        if (tap->initCheck() != NO_ERROR)
+            return NO_INIT;
+        tap->run("ALSAPcmTap", ANDROID_PRIORITY_BACKGROUND);
+    }
+    {
+        ALSAMutex::Autolock ioLock(mIoLock);
+        old = mTap;
+        mTap = tap;
+    }
+    if (old != 0)
+        old->stop();
     return NO_ERROR;
 }
 
+void ALSAStreamOps::dumpTap(String8& result)
+{
+    sp<ALSAPcmTap> tap;
+    {
+        ALSAMutex::Autolock ioLock(mIoLock);
+        tap = mTap;
+    }
+    if (tap != 0)
+        tap->dump(result);
+}
+
 String8 ALSAStreamOps::getParameters(const String8& keys)
 {
     AudioParameter param = AudioParameter(keys);
@@ -216,6 +287,8 @@ String8 ALSAStreamOps::getParameters(const String8& keys)
 
 uint32_t ALSAStreamOps::sampleRate() const
 {
+    if (useCaseIs(mHandle->useCase, UC_VOIP))
+        return mVoipRate;
     return mHandle->sampleRate;
 }
 
@@ -224,10 +297,69 @@ uint32_t ALSAStreamOps::sampleRate() const
 //
 size_t ALSAStreamOps::bufferSize() const
 {
+    if (useCaseIs(mHandle->useCase, UC_VOIP))
+        return mVoipPeriod;
     LOGV("bufferSize() returns %d", mHandle->bufferSize);
     return mHandle->bufferSize;
 }
 
+// Caller holds mRouteLock, which a rate switch takes for writing
+bool ALSAStreamOps::voipResampling() const
+{
+    return useCaseIs(mHandle->useCase, UC_VOIP) && mHandle->sampleRate != mVoipRate;
+}
+
+// Caller holds mRouteLock
+const void *ALSAStreamOps::toVoipPcm(const void *in, size_t *bytes)
+{
+    size_t pcmBytes = mHandle->periodSize;
+
+    if (!voipResampling())
+        return in;
+    if (pcmBytes > sizeof(mVoipBuffer))
+        pcmBytes = sizeof(mVoipBuffer);
+    resampleVoip(in, *bytes, mVoipBuffer, pcmBytes);
+    *bytes = pcmBytes;
+    return mVoipBuffer;
+}
+
+/*
+ * Linear interpolation going up, the mean of the covered frames going
+ * down so 8-16 kHz speech does not alias into the narrowband call.
+ */
+void ALSAStreamOps::resampleVoip(const void *in, size_t inBytes, void *out, size_t outBytes)
+{
+    const int16_t *src = (const int16_t *)in;
+    int16_t *dst = (int16_t *)out;
+    uint32_t channels = mHandle->channels ? mHandle->channels : 1;
+    size_t inFrames = inBytes / (channels * sizeof(int16_t));
+    size_t outFrames = outBytes / (channels * sizeof(int16_t));
+
+    if (!inFrames) {
+        memset(out, 0, outBytes);
+        return;
+    }
+    for (size_t j = 0; j < outFrames; j++) {
+        for (uint32_t c = 0; c < channels; c++) {
+            if (outFrames < inFrames) {
+                size_t first = j * inFrames / outFrames;
+                size_t last = (j + 1) * inFrames / outFrames;
+                int32_t sum = 0;
+                for (size_t i = first; i < last; i++)
+                    sum += src[i * channels + c];
+                dst[j * channels + c] = (int16_t)(sum / (int32_t)(last - first));
+            } else {
+                uint32_t pos = (uint32_t)((uint64_t)j * inFrames * 65536 / outFrames);
+                size_t i = pos >> 16;
+                size_t k = (i + 1 < inFrames) ? i + 1 : i;
+                int32_t frac = pos & 0xffff;
+                dst[j * channels + c] = (int16_t)((src[i * channels + c] * (65536 - frac) +
+                                                   src[k * channels + c] * frac) >> 16);
+            }
+        }
+    }
+}
+
 int ALSAStreamOps::format() const
 {
     int pcmFormatBitWidth;
@@ -288,8 +420,7 @@ uint32_t ALSAStreamOps::channels() const
 void ALSAStreamOps::close()
 {
     LOGD("close");
-    if((!strncmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL, strlen(SND_USE_CASE_VERB_IP_VOICECALL))) ||
-       (!strncmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP, strlen(SND_USE_CASE_MOD_PLAY_VOIP)))) {
+    if (useCaseIs(mHandle->useCase, UC_VOIP)) {
        mParent->mVoipMicMute = false;
        mParent->mVoipStreamCount = 0;
     }
@@ -0,0 +1,125 @@
+/* ALSAStreamStats.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#define LOG_TAG "ALSAStreamStats"
+//#define LOG_NDEBUG 0
+#define LOG_NDDEBUG 0
+#include <utils/Log.h>
+#include <utils/String8.h>
+
+#include <cutils/atomic.h>
+
+#include "AudioHardwareALSA.h"
+
+namespace android_audio_legacy
+{
+
+// ----------------------------------------------------------------------------
+
+// Upper bounds of the call time buckets, the last one takes the rest
+static const int32_t kBucketUs[STATS_BUCKETS - 1] = {
+    1000, 2000, 5000, 10000, 20000, 50000, 100000
+};
+
+static const char *kTierNames[ALSAStreamStats::XRUN_TIERS] = {
+    "prepared", "reopened", "failed"
+};
+
+ALSAStreamStats::ALSAStreamStats() :
+    mFrames(0),
+    mCalls(0),
+    mOpens(0),
+    mMaxWallUs(0),
+    mPcm(NULL),
+    mPcmUnderruns(0)
+{
+    memset((void *)mXruns, 0, sizeof(mXruns));
+    memset((void *)mWallUs, 0, sizeof(mWallUs));
+}
+
+void ALSAStreamStats::transferred(struct pcm *pcm, size_t frames, nsecs_t wallNs)
+{
+    int32_t us = (int32_t)(wallNs / 1000);
+    int bucket = 0;
+
+    android_atomic_add(frames, &mFrames);
+    android_atomic_inc(&mCalls);
+    while (bucket < STATS_BUCKETS - 1 && us >= kBucketUs[bucket])
+        bucket++;
+    android_atomic_inc(&mWallUs[bucket]);
+    if (us > mMaxWallUs)
+        android_atomic_release_store(us, &mMaxWallUs);
+
+    // libalsa-intf re-prepares on EPIPE by itself and only counts it
+    if (pcm != mPcm) {
+        mPcm = pcm;
+        mPcmUnderruns = 0;
+    }
+    if (pcm != NULL && pcm->underruns > mPcmUnderruns) {
+        android_atomic_add(pcm->underruns - mPcmUnderruns, &mXruns[XRUN_PREPARED]);
+        mPcmUnderruns = pcm->underruns;
+    }
+}
+
+void ALSAStreamStats::dump(String8& result, alsa_handle_t *handle)
+{
+    char buffer[256];
+    struct pcm *pcm = handle->handle ? handle->handle : handle->rxHandle;
+    int pos;
+
+    snprintf(buffer, sizeof(buffer),
+             "  stats: %u frames in %d calls, %d opens, xruns",
+             (uint32_t)android_atomic_acquire_load(&mFrames),
+             android_atomic_acquire_load(&mCalls),
+             android_atomic_acquire_load(&mOpens));
+    result.append(buffer);
+    for (int t = 0; t < XRUN_TIERS; t++) {
+        snprintf(buffer, sizeof(buffer), " %d %s", android_atomic_acquire_load(&mXruns[t]),
+                 kTierNames[t]);
+        result.append(buffer);
+    }
+    result.append("\n");
+
+    pos = snprintf(buffer, sizeof(buffer), "  call time us:");
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        pos += snprintf(buffer + pos, sizeof(buffer) - pos, " %s%d %d",
+                        b < STATS_BUCKETS - 1 ? "<" : ">=",
+                        kBucketUs[b < STATS_BUCKETS - 1 ? b : b - 1],
+                        android_atomic_acquire_load(&mWallUs[b]));
+    }
+    snprintf(buffer + pos, sizeof(buffer) - pos, ", max %d\n",
+             android_atomic_acquire_load(&mMaxWallUs));
+    result.append(buffer);
+
+    snprintf(buffer, sizeof(buffer),
+             "  pcm: %s, devices 0x%x, rx %s tx %s, %u Hz %u ch, period %u buffer %u bytes",
+             useCaseName(handle->useCase), handle->devices,
+             handle->card->curRxUCMDevice, handle->card->curTxUCMDevice,
+             handle->sampleRate, handle->channels, handle->periodSize, handle->bufferSize);
+    result.append(buffer);
+    if (pcm != NULL)
+        snprintf(buffer, sizeof(buffer), ", open with %u x %u bytes\n",
+                 pcm->period_cnt, pcm->period_size);
+    else
+        snprintf(buffer, sizeof(buffer), ", closed\n");
+    result.append(buffer);
+}
+
+}       // namespace android_audio_legacy
@@ -0,0 +1,103 @@
+/* ALSATrace.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define LOG_TAG "ALSATrace"
+//#define LOG_NDEBUG 0
+#define LOG_NDDEBUG 0
+#include <utils/Log.h>
+
+extern "C" {
+   #include <sound/asound.h>
+   #include "alsa_audio.h"
+}
+
+#ifdef ALSA_SIM
+#include "alsa_sim.h"
+#endif
+
+#include "ALSATrace.h"
+
+namespace android_audio_legacy
+{
+
+#ifdef ALSA_TRACE
+
+// ----------------------------------------------------------------------------
+
+#define TRACE_MARKER_PATH   "/sys/kernel/debug/tracing/trace_marker"
+
+static pthread_once_t sTraceOnce = PTHREAD_ONCE_INIT;
+static int sTraceFd = -1;
+
+static void traceInit()
+{
+    sTraceFd = open(TRACE_MARKER_PATH, O_WRONLY);
+    if (sTraceFd < 0)
+        LOGW("traceInit: cannot open %s, tracing off", TRACE_MARKER_PATH);
+}
+
+static void traceMarker(const char *fmt, ...)
+{
+    char buffer[128];
+    va_list args;
+    int len;
+
+    pthread_once(&sTraceOnce, traceInit);
+    if (sTraceFd < 0)
+        return;
+    va_start(args, fmt);
+    len = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    if (len >= (int)sizeof(buffer))
+        len = sizeof(buffer) - 1;
+    if (len > 0)
+        ::write(sTraceFd, buffer, len);
+}
+
+void alsa_trace_begin(const char *name)
+{
+    traceMarker("B|%d|%s", getpid(), name);
+}
+
+void alsa_trace_end()
+{
+    traceMarker("E");
+}
+
+void alsa_trace_int(const char *name, int value)
+{
+    traceMarker("C|%d|%s|%d", getpid(), name, value);
+}
+
+void alsa_trace_delay(const char *name, struct pcm *pcm)
+{
+    snd_pcm_sframes_t delay;
+
+    if (pcm != NULL && !ioctl(pcm->fd, SNDRV_PCM_IOCTL_DELAY, &delay))
+        alsa_trace_int(name, (int)delay);
+}
+
+#endif  // ALSA_TRACE
+
+}       // namespace android_audio_legacy
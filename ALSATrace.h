@@ -0,0 +1,92 @@
+/* ALSATrace.h
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#ifndef ANDROID_ALSA_TRACE_H
+#define ANDROID_ALSA_TRACE_H
+
+#include <cutils/atomic.h>
+#include <utils/Timers.h>
+
+struct pcm;
+
+namespace android_audio_legacy
+{
+
+/**
+ * Spans and counters for systrace, written to the ftrace marker file.
+ * They only exist when built with BOARD_USES_ALSA_TRACE := true, which
+ * defines ALSA_TRACE; otherwise every macro compiles to nothing.
+ */
+#ifdef ALSA_TRACE
+
+void alsa_trace_begin(const char *name);
+void alsa_trace_end();
+void alsa_trace_int(const char *name, int value);
+// Counter of the frames queued in the PCM, from SNDRV_PCM_IOCTL_DELAY
+void alsa_trace_delay(const char *name, struct pcm *pcm);
+
+class ALSATraceScope
+{
+public:
+    ALSATraceScope(const char *name) { alsa_trace_begin(name); }
+    ~ALSATraceScope() { alsa_trace_end(); }
+};
+
+#define ALSA_TRACE_BEGIN(name)          alsa_trace_begin(name)
+#define ALSA_TRACE_END()                alsa_trace_end()
+#define ALSA_TRACE_INT(name, value)     alsa_trace_int(name, value)
+#define ALSA_TRACE_DELAY(name, pcm)     alsa_trace_delay(name, pcm)
+#define ALSA_TRACE_SCOPE(name)          ALSATraceScope __alsaTraceScope(name)
+
+#else
+
+#define ALSA_TRACE_BEGIN(name)          ((void)0)
+#define ALSA_TRACE_END()                ((void)0)
+#define ALSA_TRACE_INT(name, value)     ((void)0)
+#define ALSA_TRACE_DELAY(name, pcm)     ((void)0)
+#define ALSA_TRACE_SCOPE(name)          ((void)0)
+
+#endif
+
+/*
+ * For logs on paths that run once per open, route or mixer write. At most
+ * one message per ALSA_LOG_INTERVAL_MS and call site; the next one that
+ * gets through says how many were dropped. Call sites are shared by
+ * threads, so the state is only touched through cutils atomics.
+ */
+#define ALSA_LOG_INTERVAL_MS    1000
+
+#define LOGD_RATELIMIT(...)                                                 \
+    do {                                                                    \
+        static volatile int32_t __alsaLogLast;      /* ms, wraps */         \
+        static volatile int32_t __alsaLogDropped;                           \
+        int32_t __alsaLogNow = (int32_t)ns2ms(systemTime());                \
+        int32_t __alsaLogPrev = android_atomic_acquire_load(&__alsaLogLast); \
+        if ((uint32_t)__alsaLogNow - (uint32_t)__alsaLogPrev >= ALSA_LOG_INTERVAL_MS && \
+            !android_atomic_cmpxchg(__alsaLogPrev, __alsaLogNow, &__alsaLogLast)) { \
+            int32_t __alsaLogSkipped = android_atomic_and(0, &__alsaLogDropped); \
+            if (__alsaLogSkipped)                                           \
+                LOGD("(%d similar messages dropped)", __alsaLogSkipped);   \
+            LOGD(__VA_ARGS__);                                              \
+        } else {                                                            \
+            android_atomic_inc(&__alsaLogDropped);                          \
+        }                                                                   \
+    } while (0)
+
+};        // namespace android_audio_legacy
+
+#endif    // ANDROID_ALSA_TRACE_H
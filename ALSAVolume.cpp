@@ -0,0 +1,170 @@
+/* ALSAVolume.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LOG_TAG "ALSAVolume"
+//#define LOG_NDEBUG 0
+#define LOG_NDDEBUG 0
+#include <utils/Log.h>
+#include <cutils/properties.h>
+#include <hardware_legacy/AudioSystemLegacy.h>
+
+#include "ALSAVolume.h"
+
+namespace android_audio_legacy
+{
+
+// ----------------------------------------------------------------------------
+
+static const char *kCurveNames[VOLUME_CURVE_MAX] = {
+    "media", "call", "voice", "voip", "fm", "lpa"
+};
+
+static const char *kDeviceNames[VOLUME_DEVICE_MAX] = {
+    "ear", "spkr", "hs", "bt", "other"
+};
+
+// Same 0.5 dB per percent curve as AudioSystem::linearToLog()
+static float linearToLog(int percent)
+{
+    static const float dBConvert = -0.5f * 2.302585093f / 20.0f;
+
+    return percent ? expf((float)(VOLUME_STEPS - percent) * dBConvert) : 0.0f;
+}
+
+static float defaultValue(alsa_volume_curve curve, int percent)
+{
+    switch (curve) {
+    case VOLUME_CURVE_MEDIA:
+        return linearToLog(percent);
+    case VOLUME_CURVE_CALL:
+        // Offset so that the lowest step is never silent, 1% corresponds
+        // roughly to the first VOICE_CALL step (see AudioService.java)
+        return 0.01f + 0.99f * linearToLog(percent);
+    case VOLUME_CURVE_VOICE:
+    case VOLUME_CURVE_VOIP:
+        // The driver takes the attenuation, 0 is loudest
+        return (float)(VOLUME_STEPS - percent);
+    case VOLUME_CURVE_FM:
+    case VOLUME_CURVE_LPA:
+    default:
+        return (float)percent * VOLUME_UNITY / VOLUME_STEPS;
+    }
+}
+
+ALSAVolumeCurves::ALSAVolumeCurves()
+{
+    for (int c = 0; c < VOLUME_CURVE_MAX; c++) {
+        for (int d = 0; d < VOLUME_DEVICE_MAX; d++) {
+            for (int p = 0; p <= VOLUME_STEPS; p++)
+                mTables[c][d][p] = defaultValue((alsa_volume_curve)c, p);
+            loadCurve((alsa_volume_curve)c, (alsa_volume_device)d);
+        }
+    }
+}
+
+void ALSAVolumeCurves::loadCurve(alsa_volume_curve curve, alsa_volume_device device)
+{
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+    float *table = mTables[curve][device];
+    int lastPercent = -1;
+    float lastValue = 0;
+    char *s;
+
+    snprintf(key, sizeof(key), "%s.%s.%s", VOLUME_CURVE_PROP,
+             kCurveNames[curve], kDeviceNames[device]);
+    if (property_get(key, value, NULL) <= 0)
+        return;
+
+    s = value;
+    while (*s) {
+        char *end;
+        int percent = strtol(s, &end, 10);
+
+        if (end == s || *end != ':' || percent <= lastPercent || percent > VOLUME_STEPS)
+            goto bad;
+        s = end + 1;
+        float v = strtod(s, &end);
+        if (end == s || (*end && *end != ','))
+            goto bad;
+        s = *end ? end + 1 : end;
+
+        if (lastPercent < 0) {
+            for (int p = 0; p <= percent; p++)
+                table[p] = v;
+        } else {
+            for (int p = lastPercent + 1; p <= percent; p++)
+                table[p] = lastValue + (v - lastValue) *
+                           (p - lastPercent) / (percent - lastPercent);
+        }
+        lastPercent = percent;
+        lastValue = v;
+    }
+    if (lastPercent < 0)
+        goto bad;
+    for (int p = lastPercent + 1; p <= VOLUME_STEPS; p++)
+        table[p] = lastValue;
+
+    LOGD("loadCurve: %s = %s", key, value);
+    return;
+
+bad:
+    LOGE("loadCurve: ignoring malformed %s = %s", key, value);
+    for (int p = 0; p <= VOLUME_STEPS; p++)
+        table[p] = defaultValue(curve, p);
+}
+
+float ALSAVolumeCurves::valueAt(alsa_volume_curve curve, alsa_volume_device device,
+                                int volume) const
+{
+    const float *table = mTables[curve][device];
+
+    if (volume <= 0)
+        return table[0];
+    if (volume >= VOLUME_UNITY)
+        return table[VOLUME_STEPS];
+
+    int pos = volume * VOLUME_STEPS;
+    int i = pos / VOLUME_UNITY;
+    float frac = (float)(pos % VOLUME_UNITY) / VOLUME_UNITY;
+
+    return table[i] + (table[i + 1] - table[i]) * frac;
+}
+
+alsa_volume_device ALSAVolumeCurves::deviceForOutput(uint32_t devices)
+{
+    if (devices & (AudioSystem::DEVICE_OUT_WIRED_HEADSET |
+                   AudioSystem::DEVICE_OUT_WIRED_HEADPHONE |
+                   AudioSystem::DEVICE_OUT_ANC_HEADSET |
+                   AudioSystem::DEVICE_OUT_ANC_HEADPHONE))
+        return VOLUME_DEVICE_HEADSET;
+    if (devices & (AudioSystem::DEVICE_OUT_BLUETOOTH_SCO |
+                   AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_HEADSET |
+                   AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_CARKIT))
+        return VOLUME_DEVICE_BT_SCO;
+    if (devices & AudioSystem::DEVICE_OUT_EARPIECE)
+        return VOLUME_DEVICE_EARPIECE;
+    if (devices & AudioSystem::DEVICE_OUT_SPEAKER)
+        return VOLUME_DEVICE_SPEAKER;
+    return VOLUME_DEVICE_OTHER;
+}
+
+};        // namespace android_audio_legacy
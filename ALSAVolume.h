@@ -0,0 +1,85 @@
+/* ALSAVolume.h
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#ifndef ANDROID_ALSA_VOLUME_H
+#define ANDROID_ALSA_VOLUME_H
+
+#include <stdint.h>
+
+namespace android_audio_legacy
+{
+
+// Volumes handed from the HAL to the ALSA module are fixed point, 0 to
+// VOLUME_UNITY. The module turns them into mixer values with the tables
+// below for the device it is currently routed to.
+#define VOLUME_UNITY        0x2000
+
+// One table entry per volume percent
+#define VOLUME_STEPS        100
+
+// Overrides a default curve, e.g. persist.audio.vol.voice.spkr=0:80,100:20
+// lists percent:value breakpoints, joined by straight lines.
+#define VOLUME_CURVE_PROP   "persist.audio.vol"
+
+enum alsa_volume_curve {
+    VOLUME_CURVE_MEDIA,     // policy: stream index to linear gain
+    VOLUME_CURVE_CALL,      // policy: voice call, DTMF and SCO stream gain
+    VOLUME_CURVE_VOICE,     // module: "Voice Rx Volume"
+    VOLUME_CURVE_VOIP,      // module: "Voip Rx Volume"
+    VOLUME_CURVE_FM,        // module: "Internal FM RX Volume"
+    VOLUME_CURVE_LPA,       // module: "LPA RX Volume"
+    VOLUME_CURVE_MAX
+};
+
+enum alsa_volume_device {
+    VOLUME_DEVICE_EARPIECE,
+    VOLUME_DEVICE_SPEAKER,
+    VOLUME_DEVICE_HEADSET,
+    VOLUME_DEVICE_BT_SCO,
+    VOLUME_DEVICE_OTHER,
+    VOLUME_DEVICE_MAX
+};
+
+class ALSAVolumeCurves
+{
+public:
+    // Builds every table, applying any VOLUME_CURVE_PROP overrides
+    ALSAVolumeCurves();
+
+    float value(alsa_volume_curve curve, alsa_volume_device device, int percent) const
+    {
+        if (percent < 0)
+            percent = 0;
+        else if (percent > VOLUME_STEPS)
+            percent = VOLUME_STEPS;
+        return mTables[curve][device][percent];
+    }
+
+    // Interpolates between the two entries around a fixed point volume
+    float valueAt(alsa_volume_curve curve, alsa_volume_device device, int volume) const;
+
+    static alsa_volume_device deviceForOutput(uint32_t devices);
+
+private:
+    void loadCurve(alsa_volume_curve curve, alsa_volume_device device);
+
+    float mTables[VOLUME_CURVE_MAX][VOLUME_DEVICE_MAX][VOLUME_STEPS + 1];
+};
+
+};        // namespace android_audio_legacy
+
+#endif    // ANDROID_ALSA_VOLUME_H
@@ -3,12 +3,12 @@
 # Copyright 2008 Wind River Systems
 #
 
+LOCAL_PATH := $(call my-dir)
+
 ifeq ($(BOARD_USES_ALSA_AUDIO),true)
 ifeq ($(TARGET_BOARD_PLATFORM),msm8960)
 ifneq ($(TARGET_PROVIDES_LIBAUDIO),true)
 
-LOCAL_PATH := $(call my-dir)
-
 include $(CLEAR_VARS)
 
 LOCAL_ARM_MODE := arm
@@ -19,6 +19,13 @@ LOCAL_SRC_FILES := \
   AudioStreamOutALSA.cpp 	\
   AudioStreamInALSA.cpp 	\
   ALSAStreamOps.cpp		\
+  ALSARoutingThread.cpp		\
+  ALSALock.cpp			\
+  ALSAJitterBuffer.cpp		\
+  ALSAEchoReference.cpp		\
+  ALSAStreamStats.cpp		\
+  ALSAPcmTap.cpp		\
+  ALSATrace.cpp			\
   audio_hw_hal.cpp
 
 LOCAL_STATIC_LIBRARIES := \
@@ -42,11 +49,16 @@ LOCAL_C_INCLUDES += hardware/libhardware/include
 LOCAL_C_INCLUDES += hardware/libhardware_legacy/include
 LOCAL_C_INCLUDES += frameworks/base/include
 LOCAL_C_INCLUDES += system/core/include
+LOCAL_C_INCLUDES += $(call include-path-for, audio-effects)
 
 ifeq ($(BOARD_HAVE_SAMSUNG_AUDIO),true)
 LOCAL_CFLAGS += -DSAMSUNG_AUDIO
 endif
 
+ifeq ($(BOARD_USES_ALSA_TRACE),true)
+LOCAL_CFLAGS += -DALSA_TRACE
+endif
+
 LOCAL_MODULE := audio.primary.msm8960
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 LOCAL_MODULE_TAGS := optional
@@ -65,6 +77,7 @@ endif
 
 LOCAL_SRC_FILES := \
     AudioPolicyManagerALSA.cpp	\
+    ALSAVolume.cpp		\
     audio_policy_hal.cpp
 
 LOCAL_MODULE := audio_policy.msm8960
@@ -78,7 +91,8 @@ LOCAL_STATIC_LIBRARIES := \
 LOCAL_SHARED_LIBRARIES := \
     libcutils \
     libutils \
-    libmedia
+    libmedia \
+    libdl
 
 LOCAL_C_INCLUDES += hardware/libhardware_legacy/audio
 
@@ -99,11 +113,17 @@ ifneq ($(ALSA_DEFAULT_SAMPLE_RATE),)
     LOCAL_CFLAGS += -DALSA_DEFAULT_SAMPLE_RATE=$(ALSA_DEFAULT_SAMPLE_RATE)
 endif
 
+ifeq ($(BOARD_USES_ALSA_TRACE),true)
+    LOCAL_CFLAGS += -DALSA_TRACE
+endif
+
 LOCAL_C_INCLUDES += $(TARGET_OUT_HEADERS)/mm-audio/libalsa-intf
 
 LOCAL_SRC_FILES:= \
     alsa_default.cpp \
-    ALSAControl.cpp
+    ALSAVolume.cpp \
+    ALSAControl.cpp \
+    ALSATrace.cpp
 
 LOCAL_SHARED_LIBRARIES := \
     libcutils \
@@ -115,6 +135,158 @@ LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_SHARED_LIBRARY)
 
+# The same benchmark on the device, against the sound card. It can be
+# pointed at snd-dummy or snd-aloop with -d. The HAL and policy sources
+# are linked in for the doRouting() and getDeviceForStrategy() cases,
+# without audio_hw_hal.cpp and audio_policy_hal.cpp whose
+# HAL_MODULE_INFO_SYM would clash with the ALSA module's.
+
+include $(CLEAR_VARS)
+
+LOCAL_CFLAGS := -D_POSIX_SOURCE -Wno-multichar
+
+ifneq ($(ALSA_DEFAULT_SAMPLE_RATE),)
+    LOCAL_CFLAGS += -DALSA_DEFAULT_SAMPLE_RATE=$(ALSA_DEFAULT_SAMPLE_RATE)
+endif
+
+ifeq ($(BOARD_USES_ALSA_TRACE),true)
+    LOCAL_CFLAGS += -DALSA_TRACE
+endif
+
+ifeq ($(BOARD_HAVE_BLUETOOTH),true)
+    LOCAL_CFLAGS += -DWITH_A2DP
+endif
+
+LOCAL_C_INCLUDES += $(TARGET_OUT_HEADERS)/mm-audio/audio-alsa
+LOCAL_C_INCLUDES += $(TARGET_OUT_HEADERS)/mm-audio/audcal
+LOCAL_C_INCLUDES += $(TARGET_OUT_HEADERS)/mm-audio/audio-acdb-util
+LOCAL_C_INCLUDES += $(TARGET_OUT_HEADERS)/mm-audio/libalsa-intf
+LOCAL_C_INCLUDES += hardware/libhardware/include
+LOCAL_C_INCLUDES += hardware/libhardware_legacy/include
+LOCAL_C_INCLUDES += hardware/libhardware_legacy/audio
+LOCAL_C_INCLUDES += frameworks/base/include
+LOCAL_C_INCLUDES += system/core/include
+LOCAL_C_INCLUDES += $(call include-path-for, audio-effects)
+
+LOCAL_SRC_FILES := \
+    alsa_bench.cpp \
+    alsa_default.cpp \
+    ALSAVolume.cpp \
+    ALSAControl.cpp \
+    ALSATrace.cpp \
+    AudioHardwareALSA.cpp \
+    AudioStreamOutALSA.cpp \
+    AudioStreamInALSA.cpp \
+    ALSAStreamOps.cpp \
+    ALSARoutingThread.cpp \
+    ALSALock.cpp \
+    ALSAJitterBuffer.cpp \
+    ALSAEchoReference.cpp \
+    ALSAStreamStats.cpp \
+    ALSAPcmTap.cpp \
+    AudioPolicyManagerALSA.cpp
+
+LOCAL_STATIC_LIBRARIES := \
+    libmedia_helper \
+    libaudiohw_legacy \
+    libaudiopolicy_legacy
+
+LOCAL_SHARED_LIBRARIES := \
+    libcutils \
+    libutils \
+    liblog    \
+    libmedia \
+    libhardware \
+    libpower \
+    libdl \
+    libalsa-intf
+
+LOCAL_MODULE := alsa_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
+
 endif # TARGET_PROVIDES_LIBAUDIO := true
 endif # TARGET_BOARD_PLATFORM := msm8960
 endif # BOARD_USES_ALSA_AUDIO :true
+
+# Host builds against the simulator. They sit outside the board guards
+# so any lunch target can build them, and take alsa_audio.h and
+# msm8960_use_cases.h from sim/include since mm-audio is not exported
+# for the host.
+
+# Simulated libalsa-intf for the host, see alsa_sim.h
+
+include $(CLEAR_VARS)
+
+LOCAL_CFLAGS := -D_POSIX_SOURCE -DALSA_SIM
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/sim/include
+
+LOCAL_SRC_FILES := \
+    alsa_sim.cpp
+
+LOCAL_MODULE := libalsa-intf-sim
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+# The ALSA module built for the host against the simulator. The HAL and
+# policy layers need libmedia and libhardware_legacy, which have no host
+# build, so they stay on the device.
+
+include $(CLEAR_VARS)
+
+LOCAL_CFLAGS := -D_POSIX_SOURCE -Wno-multichar -DALSA_SIM
+
+ifeq ($(BOARD_USES_ALSA_TRACE),true)
+    LOCAL_CFLAGS += -DALSA_TRACE
+endif
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/sim/include
+LOCAL_C_INCLUDES += hardware/libhardware/include
+LOCAL_C_INCLUDES += hardware/libhardware_legacy/include
+LOCAL_C_INCLUDES += frameworks/base/include
+LOCAL_C_INCLUDES += system/core/include
+
+LOCAL_SRC_FILES := \
+    alsa_default.cpp \
+    ALSAVolume.cpp \
+    ALSAControl.cpp \
+    ALSATrace.cpp
+
+LOCAL_MODULE := libalsa-module-sim
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+# Open, write and recovery latency benchmark for the ALSA module, see
+# alsa_bench.cpp. Routing through the HAL is only measured by the device
+# build above.
+
+include $(CLEAR_VARS)
+
+LOCAL_CFLAGS := -D_POSIX_SOURCE -Wno-multichar -DALSA_SIM
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/sim/include
+LOCAL_C_INCLUDES += hardware/libhardware/include
+LOCAL_C_INCLUDES += hardware/libhardware_legacy/include
+LOCAL_C_INCLUDES += frameworks/base/include
+LOCAL_C_INCLUDES += system/core/include
+
+LOCAL_SRC_FILES := \
+    alsa_bench.cpp
+
+LOCAL_STATIC_LIBRARIES := \
+    libalsa-module-sim \
+    libalsa-intf-sim \
+    libutils \
+    libcutils \
+    liblog
+
+LOCAL_LDLIBS := -lpthread -lrt
+
+LOCAL_MODULE := alsa_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
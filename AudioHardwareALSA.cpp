@@ -18,6 +18,7 @@
 
 #include <errno.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -31,6 +32,7 @@
 #include <utils/Log.h>
 #include <utils/String8.h>
 
+#include <cutils/atomic.h>
 #include <cutils/properties.h>
 #include <media/AudioRecord.h>
 #include <hardware_legacy/power.h>
@@ -45,6 +47,11 @@ extern "C"
     android_audio_legacy::AudioHardwareInterface *createAudioHardware(void) {
         return android_audio_legacy::AudioHardwareALSA::create();
     }
+
+    //
+    // Looked up by the policy manager, see ALSASharedState.h.
+    //
+    struct alsa_shared_state_t alsa_shared_state;
 }         // extern "C"
 
 namespace android_audio_legacy
@@ -56,15 +63,45 @@ AudioHardwareInterface *AudioHardwareALSA::create() {
     return new AudioHardwareALSA();
 }
 
+/*
+ * Pick the UCM card configuration from a single read of the card list,
+ * instead of scanning it line by line.
+ */
+static int probeCodecRev()
+{
+    char line[256];
+    int rev = 2;
+    FILE *fp = fopen("/proc/asound/cards", "r");
+
+    if (fp == NULL) {
+        LOGE("Cannot open /proc/asound/cards file to get sound card info");
+        return 2;
+    }
+    // One line per card name, and the tabla card need not be the first
+    while (rev == 2 && fgets(line, sizeof(line), fp) != NULL) {
+        if (strstr(line, "msm8960-tabla1x-snd-card")
+#ifdef SAMSUNG_AUDIO
+                || strstr(line, "msm8960sndcard")
+#endif
+                ) {
+            rev = 1;
+        }
+    }
+    fclose(fp);
+    return rev;
+}
+
 AudioHardwareALSA::AudioHardwareALSA() :
-    mALSADevice(0),mVoipStreamCount(0),mVoipMicMute(false)
+    mALSADevice(0),mCard(NULL),mRouteLock("route"),mUcMgr(NULL),mVoipStreamCount(0),mVoipMicMute(false),mSoftMuteSwitch(true),mUnmutedSwitches(0),mVoipJitterBuffer(false),
+    mCodecRev(2),mFirstOutputOpened(false)
 {
-    FILE *fp;
-    char soundCardInfo[200];
+    char value[PROPERTY_VALUE_MAX];
     hw_module_t *module;
+    mStartTime = systemTime();
+    property_get(LOCK_STATS_PROP, value, "0");
+    ALSALockStats::sEnabled = atoi(value) != 0;
     int err = hw_get_module(ALSA_HARDWARE_MODULE_ID,
             (hw_module_t const**)&module);
-    int codec_rev = 2;
     LOGD("hw_get_module(ALSA_HARDWARE_MODULE_ID) returned err %d", err);
     if (err == 0) {
         hw_device_t* device;
@@ -72,53 +109,66 @@ AudioHardwareALSA::AudioHardwareALSA() :
         if (err == 0) {
             mALSADevice = (alsa_device_t *)device;
             mALSADevice->init(mALSADevice, mDeviceList);
+            mCard = mALSADevice->getCard(mALSADevice, 0);
             mIsVoiceCallActive = 0;
             mIsFmActive = 0;
             mDevSettingsFlag = 0;
             mDevSettingsFlag |= TTY_OFF;
             mBluetoothVGS = false;
-
-
-            if((fp = fopen("/proc/asound/cards","r")) == NULL) {
-                LOGE("Cannot open /proc/asound/cards file to get sound card info");
-            } else {
-                while((fgets(soundCardInfo, sizeof(soundCardInfo), fp) != NULL)) {
-                    LOGV("SoundCardInfo %s", soundCardInfo);
-                    if (strstr(soundCardInfo, "msm8960-tabla1x-snd-card")
-#ifdef SAMSUNG_AUDIO
-                            || strstr(soundCardInfo, "msm8960sndcard")
-#endif
-                            ) {
-                        codec_rev = 1;
-                        break;
-                    }
-                }
-                fclose(fp);
-            }
-
-            if (codec_rev == 1) {
-                    LOGV("Detected tabla 1.x sound card");
-                    snd_use_case_mgr_open(&mUcMgr, "snd_soc_msm");
-            } else {
-                    LOGV("Detected tabla 2.x sound card");
-                    snd_use_case_mgr_open(&mUcMgr, "snd_soc_msm_2x");
-            }
-
-            if (mUcMgr < 0) {
-                LOGE("Failed to open ucm instance: %d", errno);
-            } else {
-                LOGI("ucm instance opened: %u", (unsigned)mUcMgr);
-            }
+            publishState(ALSA_STATE_BT_HEADSET_VGS, false);
+            property_get(SOFT_MUTE_SWITCH_PROP, value, "1");
+            mSoftMuteSwitch = atoi(value) != 0;
+            property_get(VOIP_JITTER_BUFFER_PROP, value, "0");
+            mVoipJitterBuffer = atoi(value) != 0;
+            property_get(PREWARM_PROP, value, "1");
+            mPrewarm = atoi(value) != 0;
+
+            mCodecRev = probeCodecRev();
+            LOGI("startup: module and card probe took %lld us, tabla %d.x",
+                 (long long)((systemTime() - mStartTime) / 1000), mCodecRev);
         } else {
             LOGE("ALSA Module could not be opened!!!");
         }
     } else {
         LOGE("ALSA Module not found!!!");
     }
+
+    mRoutingThread = new ALSARoutingThread(this);
+    mRoutingThread->run("ALSARouting", ANDROID_PRIORITY_AUDIO);
+    // Parsing the UCM configuration is the slow part of bring-up. Queue it
+    // first on the worker; everything needing mUcMgr syncs with the worker.
+    if (mALSADevice)
+        mRoutingThread->post(ALSARoutingThread::CMD_INIT_UCM, 0);
+}
+
+void AudioHardwareALSA::initUcm()
+{
+    nsecs_t start = systemTime();
+
+    if (mCodecRev == 1) {
+        LOGV("Detected tabla 1.x sound card");
+        snd_use_case_mgr_open(&mUcMgr, "snd_soc_msm");
+    } else {
+        LOGV("Detected tabla 2.x sound card");
+        snd_use_case_mgr_open(&mUcMgr, "snd_soc_msm_2x");
+    }
+
+    if (mUcMgr == NULL) {
+        LOGE("Failed to open ucm instance: %d", errno);
+    } else {
+        LOGI("ucm instance opened: %u", (unsigned)mUcMgr);
+    }
+    LOGI("startup: ucm open took %lld us, ready %lld us after HAL construction",
+         (long long)((systemTime() - start) / 1000),
+         (long long)((systemTime() - mStartTime) / 1000));
 }
 
 AudioHardwareALSA::~AudioHardwareALSA()
 {
+    if (mRoutingThread != 0) {
+        mRoutingThread->exit();
+        mRoutingThread.clear();
+    }
     if (mUcMgr != NULL) {
         LOGD("closing ucm instance: %u", (unsigned)mUcMgr);
         snd_use_case_mgr_close(mUcMgr);
@@ -126,11 +176,7 @@ AudioHardwareALSA::~AudioHardwareALSA()
     if (mALSADevice) {
         mALSADevice->common.close(&mALSADevice->common);
     }
-    for(ALSAHandleList::iterator it = mDeviceList.begin();
-            it != mDeviceList.end(); ++it) {
-        it->useCase[0] = 0;
-        mDeviceList.erase(it);
-    }
+    mDeviceList.clear();
 }
 
 status_t AudioHardwareALSA::initCheck()
@@ -154,19 +200,15 @@ status_t AudioHardwareALSA::setVoiceVolume(float v)
 
     int newMode = mode();
     LOGD("setVoiceVolume  newMode %d",newMode);
-    int vol = lrint(v * 100.0);
-
-    // Voice volume levels from android are mapped to driver volume levels as follows.
-    // 0 -> 5, 20 -> 4, 40 ->3, 60 -> 2, 80 -> 1, 100 -> 0
-    // So adjust the volume to get the correct volume index in driver
-    vol = 100 - vol;
+    // The ALSA module maps this to the driver level for the current device
+    int vol = lrint(v * VOLUME_UNITY);
 
     // ToDo: Send mixer command only when voice call is active
     if(mALSADevice) {
         if(newMode == AudioSystem::MODE_IN_COMMUNICATION) {
-            mALSADevice->setVoipVolume(vol);
+            mALSADevice->setVoipVolume(mCard, vol);
         } else {
-            mALSADevice->setVoiceVolume(vol);
+            mALSADevice->setVoiceVolume(mCard, vol);
         }
     }
 
@@ -187,12 +229,11 @@ status_t  AudioHardwareALSA::setFmVolume(float value)
         LOGW("setFmVolume(%f) over 1.0, assuming 1.0\n", value);
         value = 1.0;
     }
-    vol  = lrint((value * 0x2000) + 0.5);
+    vol  = lrint(value * VOLUME_UNITY);
 
     LOGD("setFmVolume(%f)\n", value);
-    LOGD("Setting FM volume to %d (available range is 0 to 0x2000)\n", vol);
 
-    mALSADevice->setFmVolume(vol);
+    mALSADevice->setFmVolume(mCard, vol);
 
     return status;
 }
@@ -236,11 +277,11 @@ status_t AudioHardwareALSA::setParameters(const String8& keyValuePairs)
             mDevSettingsFlag |= TTY_OFF;
         }
         LOGI("Changed TTY Mode=%s", value.string());
-        mALSADevice->setFlags(mDevSettingsFlag);
+        mRoutingThread->post(ALSARoutingThread::CMD_SET_FLAGS, mDevSettingsFlag);
         if(mMode != AudioSystem::MODE_IN_CALL){
            return NO_ERROR;
         }
-        doRouting(0);
+        mRoutingThread->post(ALSARoutingThread::CMD_ROUTE, 0);
     }
 
     key = String8(FLUENCE_KEY);
@@ -258,8 +299,8 @@ status_t AudioHardwareALSA::setParameters(const String8& keyValuePairs)
             mDevSettingsFlag &= (~QMIC_FLAG);
             LOGV("Fluence feature Disabled");
         }
-        mALSADevice->setFlags(mDevSettingsFlag);
-        doRouting(0);
+        mRoutingThread->post(ALSARoutingThread::CMD_SET_FLAGS, mDevSettingsFlag);
+        mRoutingThread->post(ALSARoutingThread::CMD_ROUTE, 0);
     }
 
     key = String8(ANC_KEY);
@@ -271,22 +312,22 @@ status_t AudioHardwareALSA::setParameters(const String8& keyValuePairs)
             LOGV("Disabling ANC setting in the setparameter\n");
             mDevSettingsFlag &= (~ANC_FLAG);
         }
-        mALSADevice->setFlags(mDevSettingsFlag);
-        doRouting(0);
+        mRoutingThread->post(ALSARoutingThread::CMD_SET_FLAGS, mDevSettingsFlag);
+        mRoutingThread->post(ALSARoutingThread::CMD_ROUTE, 0);
     }
 
     key = String8(AudioParameter::keyRouting);
     if (param.getInt(key, device) == NO_ERROR) {
         // Ignore routing if device is 0.
         if(device) {
-            doRouting(device);
+            mRoutingThread->post(ALSARoutingThread::CMD_ROUTE, device);
         }
         param.remove(key);
     }
 
     key = String8(BT_SAMPLERATE_KEY);
     if (param.getInt(key, btRate) == NO_ERROR) {
-        mALSADevice->setBtscoRate(btRate);
+        mALSADevice->setBtscoRate(mCard, btRate);
         param.remove(key);
     }
 
@@ -297,6 +338,7 @@ status_t AudioHardwareALSA::setParameters(const String8& keyValuePairs)
         } else {
             mBluetoothVGS = false;
         }
+        publishState(ALSA_STATE_BT_HEADSET_VGS, mBluetoothVGS);
     }
 
     key = String8(WIDEVOICE_KEY);
@@ -306,7 +348,7 @@ status_t AudioHardwareALSA::setParameters(const String8& keyValuePairs)
             flag = true;
         }
         if(mALSADevice) {
-            mALSADevice->enableWideVoice(flag);
+            mALSADevice->enableWideVoice(mCard, flag);
         }
         param.remove(key);
     }
@@ -318,7 +360,7 @@ status_t AudioHardwareALSA::setParameters(const String8& keyValuePairs)
             flag = true;
         }
         if(mALSADevice) {
-            mALSADevice->enableFENS(flag);
+            mALSADevice->enableFENS(mCard, flag);
         }
         param.remove(key);
     }
@@ -327,7 +369,7 @@ status_t AudioHardwareALSA::setParameters(const String8& keyValuePairs)
     if (param.getInt(key, device) == NO_ERROR) {
         // Ignore if device is 0
         if(device) {
-            handleFm(device);
+            mRoutingThread->post(ALSARoutingThread::CMD_HANDLE_FM, device);
         }
         param.remove(key);
     }
@@ -338,6 +380,14 @@ status_t AudioHardwareALSA::setParameters(const String8& keyValuePairs)
     return status;
 }
 
+void AudioHardwareALSA::publishState(alsa_state_key key, int32_t value)
+{
+    if (alsa_shared_state.values[key] == value)
+        return;
+    alsa_shared_state.values[key] = value;
+    android_atomic_inc(&alsa_shared_state.generation);
+}
+
 String8 AudioHardwareALSA::getParameters(const String8& keys)
 {
     AudioParameter param = AudioParameter(keys);
@@ -382,7 +432,8 @@ String8 AudioHardwareALSA::getParameters(const String8& keys)
 
 void AudioHardwareALSA::doRouting(int device)
 {
-    Mutex::Autolock autoLock(mLock);
+    ALSA_TRACE_SCOPE("route");
+    ALSARWLock::AutoWLock autoLock(mRouteLock);
     int newMode = mode();
     if ((device == AudioSystem::DEVICE_IN_VOICE_CALL) ||
         (device == AudioSystem::DEVICE_IN_FM_RX) ||
@@ -400,14 +451,7 @@ void AudioHardwareALSA::doRouting(int device)
         // Start voice call
         unsigned long bufferSize = DEFAULT_BUFFER_SIZE;
         alsa_handle_t alsa_handle;
-        char *use_case;
-        snd_use_case_get(mUcMgr, "_verb", (const char **)&use_case);
-        if ((use_case == NULL) || (!strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
-            strlcpy(alsa_handle.useCase, SND_USE_CASE_VERB_VOICECALL, sizeof(alsa_handle.useCase));
-        } else {
-            strlcpy(alsa_handle.useCase, SND_USE_CASE_MOD_PLAY_VOICE, sizeof(alsa_handle.useCase));
-        }
-        free(use_case);
+        alsa_handle.useCase = useCaseFor(USE_CASE_VERB_VOICECALL, useCaseVerbInactive(mUcMgr));
 
         for (size_t b = 1; (bufferSize & ~b) != 0; b <<= 1)
         bufferSize &= ~b;
@@ -421,30 +465,27 @@ void AudioHardwareALSA::doRouting(int device)
         alsa_handle.latency = VOICE_LATENCY;
         alsa_handle.rxHandle = 0;
         alsa_handle.ucMgr = mUcMgr;
+        alsa_handle.card = mCard;
+        alsa_handle.softMute = SOFT_MUTE_OFF;
+        alsa_handle.routeSeq = 0;
+        alsa_handle.playing = 0;
+        alsa_handle.drainFd = -1;
+        if (mDeviceList.push_back(alsa_handle) != NO_ERROR)
+            return;
         mIsVoiceCallActive = 1;
-        mDeviceList.push_back(alsa_handle);
         ALSAHandleList::iterator it = mDeviceList.end();
         it--;
         LOGV("Enabling voice call");
         mALSADevice->route(&(*it), (uint32_t)device, newMode);
-        if (!strcmp(it->useCase, SND_USE_CASE_VERB_VOICECALL)) {
-            snd_use_case_set(mUcMgr, "_verb", SND_USE_CASE_VERB_VOICECALL);
-        } else {
-            snd_use_case_set(mUcMgr, "_enamod", SND_USE_CASE_MOD_PLAY_VOICE);
-        }
         mALSADevice->startVoiceCall(&(*it));
     } else if(newMode == AudioSystem::MODE_NORMAL && mIsVoiceCallActive == 1) {
         // End voice call
-        for(ALSAHandleList::iterator it = mDeviceList.begin();
-            it != mDeviceList.end(); ++it) {
-            if((!strcmp(it->useCase, SND_USE_CASE_VERB_VOICECALL)) ||
-               (!strcmp(it->useCase, SND_USE_CASE_MOD_PLAY_VOICE))) {
-                LOGV("Disabling voice call");
-                mALSADevice->close(&(*it));
-                mALSADevice->route(&(*it), (uint32_t)device, newMode);
-                mDeviceList.erase(it);
-                break;
-            }
+        ALSAHandleList::iterator it = mDeviceList.findActive(UC_VOICE);
+        if (it != mDeviceList.end()) {
+            LOGV("Disabling voice call");
+            mALSADevice->close(&(*it));
+            mALSADevice->route(&(*it), (uint32_t)device, newMode);
+            mDeviceList.erase(it);
         }
         mIsVoiceCallActive = 0;
     } else if((((mCurDevice & AudioSystem::DEVICE_OUT_WIRED_HEADSET) ||
@@ -457,24 +498,93 @@ void AudioHardwareALSA::doRouting(int device)
               (device & AudioSystem::DEVICE_OUT_SPEAKER) &&
               ((mCurDevice & AudioSystem::DEVICE_OUT_WIRED_HEADSET) ||
               (mCurDevice & AudioSystem::DEVICE_OUT_WIRED_HEADPHONE)))) {
-              for(ALSAHandleList::iterator it = mDeviceList.begin();
-                  it != mDeviceList.end(); ++it) {
-                  if((!strncmp(it->useCase, SND_USE_CASE_VERB_HIFI,
-                       strlen(SND_USE_CASE_VERB_HIFI))) ||
-                     (!strncmp(it->useCase, SND_USE_CASE_MOD_PLAY_MUSIC,
-                       strlen(SND_USE_CASE_MOD_PLAY_MUSIC)))) {
-                     mALSADevice->route(&(*it), (uint32_t)device, newMode);
-                     break;
-                  }
-             }
+              ALSAHandleList::iterator it = mDeviceList.findActive(UC_MUSIC);
+              if (it != mDeviceList.end())
+                  routeKeepPcm(&(*it), (uint32_t)device, newMode);
      } else {
-        ALSAHandleList::iterator it = mDeviceList.end();
-        it--;
+        // Reroute through the newest stream in the direction that changed;
+        // with nothing open the device is applied by the next open.
+        ALSAHandleList::iterator it = mDeviceList.findLast(
+                (device & AudioSystem::DEVICE_OUT_ALL) ? UC_PLAYBACK : UC_CAPTURE);
+        if (it == mDeviceList.end()) {
+            LOGV("doRouting: no stream for device 0x%x, applied on next open", device);
+            mCurDevice = device;
+            return;
+        }
         mALSADevice->route(&(*it), (uint32_t)device, newMode);
     }
     mCurDevice = device;
 }
 
+/*
+ * Move a running music stream between speaker, headset and the combo
+ * device. With soft mute the writer ramps to silence and keeps feeding
+ * the PCM while UCM swaps the backend, so queued audio is not dropped;
+ * otherwise the module closes and reopens the PCM around the switch.
+ *
+ * Called from doRouting() with mRouteLock held for writing. The music
+ * writer ramps down without the route lock, but opens, closes and other
+ * streams need it, so it is dropped for the wait. The ramp spans several
+ * write() calls; only a stream in standby, which has nothing to ramp,
+ * is switched at once.
+ */
+void AudioHardwareALSA::routeKeepPcm(alsa_handle_t *handle, uint32_t device, int mode)
+{
+    unsigned int frameBytes = handle->channels * 2;
+    nsecs_t timeout, waited;
+
+    int32_t seq = android_atomic_inc(&handle->routeSeq) + 1;
+    if (!mSoftMuteSwitch || handle->handle == NULL ||
+        !android_atomic_acquire_load(&handle->playing)) {
+        mALSADevice->route(handle, device, mode);
+        return;
+    }
+
+    // The ramp has to reach the DAC, so allow for a full buffer of silence
+    timeout = 2 * (ms2ns(SOFT_MUTE_RAMP_MS) +
+                   (nsecs_t)handle->handle->buffer_size * 1000000000LL /
+                   (frameBytes * handle->sampleRate));
+
+    android_atomic_release_store(SOFT_MUTE_RAMP_DOWN, &handle->softMute);
+    mRouteLock.writeUnlock();
+    nsecs_t start = systemTime();
+    {
+        Mutex::Autolock lock(mSoftMuteLock);
+        waited = 0;
+        while (android_atomic_acquire_load(&handle->softMute) == SOFT_MUTE_RAMP_DOWN &&
+               android_atomic_acquire_load(&handle->playing) && waited < timeout) {
+            mSoftMuteCond.waitRelative(mSoftMuteLock, timeout - waited);
+            waited = systemTime() - start;
+        }
+    }
+    mRouteLock.writeLock();
+
+    // The stream may have been closed, and its slot reused, meanwhile
+    if (mDeviceList.iteratorFor(handle) == mDeviceList.end() ||
+        android_atomic_acquire_load(&handle->routeSeq) != seq) {
+        LOGD("routeKeepPcm: stream closed during the ramp, device 0x%x applied on next open",
+             device);
+        return;
+    }
+    if (android_atomic_acquire_load(&handle->softMute) != SOFT_MUTE_ON &&
+        handle->handle != NULL && android_atomic_acquire_load(&handle->playing)) {
+        LOGW("routeKeepPcm: no silence from writer after %lld us, switching anyway",
+             (long long)ns2us(waited));
+        android_atomic_inc(&mUnmutedSwitches);
+    }
+
+    mALSADevice->route(handle, device, mode);
+    android_atomic_release_store(SOFT_MUTE_OFF, &handle->softMute);
+    LOGD("routeKeepPcm: device 0x%x switched with PCM running, muted wait %lld us",
+         device, (long long)ns2us(waited));
+}
+
+void AudioHardwareALSA::signalSoftMute()
+{
+    Mutex::Autolock lock(mSoftMuteLock);
+    mSoftMuteCond.broadcast();
+}
+
 AudioStreamOut *
 AudioHardwareALSA::openOutputStream(uint32_t devices,
                                     int *format,
@@ -482,9 +592,16 @@ AudioHardwareALSA::openOutputStream(uint32_t devices,
                                     uint32_t *sampleRate,
                                     status_t *status)
 {
-    Mutex::Autolock autoLock(mLock);
+    // Let queued routing land before touching the device list
+    mRoutingThread->sync();
+    ALSARWLock::AutoWLock autoLock(mRouteLock);
     LOGD("openOutputStream: devices 0x%x channels %d sampleRate %d",
          devices, *channels, *sampleRate);
+    if (!mFirstOutputOpened) {
+        mFirstOutputOpened = true;
+        LOGI("startup: first output stream requested %lld us after HAL construction",
+             (long long)((systemTime() - mStartTime) / 1000));
+    }
 
     status_t err = BAD_VALUE;
     AudioStreamOutALSA *out = 0;
@@ -498,14 +615,10 @@ AudioHardwareALSA::openOutputStream(uint32_t devices,
 
     if(devices == AudioSystem::DEVICE_OUT_DIRECTOUTPUT) {
         bool voipstream_active = false;
-        for(it = mDeviceList.begin();
-            it != mDeviceList.end(); ++it) {
-                if((!strcmp(it->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) ||
-                   (!strcmp(it->useCase, SND_USE_CASE_MOD_PLAY_VOIP))) {
-                    LOGD("openOutput:  it->rxHandle %d it->handle %d",it->rxHandle,it->handle);
-                    voipstream_active = true;
-                    break;
-                }
+        it = mDeviceList.findActive(UC_VOIP);
+        if (it != mDeviceList.end()) {
+            LOGD("openOutput:  it->rxHandle %d it->handle %d",it->rxHandle,it->handle);
+            voipstream_active = true;
         }
 
       if(voipstream_active == false) {
@@ -534,27 +647,27 @@ AudioHardwareALSA::openOutputStream(uint32_t devices,
           alsa_handle.latency = VOIP_PLAYBACK_LATENCY;
           alsa_handle.rxHandle = 0;
           alsa_handle.ucMgr = mUcMgr;
-          char *use_case;
-          snd_use_case_get(mUcMgr, "_verb", (const char **)&use_case);
-          if ((use_case == NULL) || (!strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
-              strlcpy(alsa_handle.useCase, SND_USE_CASE_VERB_IP_VOICECALL, sizeof(alsa_handle.useCase));
-          } else {
-              strlcpy(alsa_handle.useCase, SND_USE_CASE_MOD_PLAY_VOIP, sizeof(alsa_handle.useCase));
+          alsa_handle.card = mCard;
+          alsa_handle.softMute = SOFT_MUTE_OFF;
+          alsa_handle.routeSeq = 0;
+          alsa_handle.playing = 0;
+          alsa_handle.drainFd = -1;
+          alsa_handle.useCase = useCaseFor(USE_CASE_VERB_IP_VOICECALL, useCaseVerbInactive(mUcMgr));
+          if (mDeviceList.push_back(alsa_handle) != NO_ERROR) {
+              if (status) *status = NO_MEMORY;
+              return NULL;
           }
-          free(use_case);
-          mDeviceList.push_back(alsa_handle);
           it = mDeviceList.end();
           it--;
-          LOGV("openoutput: mALSADevice->route useCase %s mCurDevice %d mVoipStreamCount %d mode %d", it->useCase,mCurDevice,mVoipStreamCount, mode());
+          LOGV("openoutput: mALSADevice->route useCase %s mCurDevice %d mVoipStreamCount %d mode %d", useCaseName(it->useCase),mCurDevice,mVoipStreamCount, mode());
           mALSADevice->route(&(*it), mCurDevice, AudioSystem::MODE_IN_COMMUNICATION);
-          if(!strcmp(it->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) {
-              snd_use_case_set(mUcMgr, "_verb", SND_USE_CASE_VERB_IP_VOICECALL);
-          } else {
-              snd_use_case_set(mUcMgr, "_enamod", SND_USE_CASE_MOD_PLAY_VOIP);
-          }
+          useCaseEnable(mUcMgr, it->useCase);
           err = mALSADevice->startVoipCall(&(*it));
           if (err) {
               LOGE("Device open failed");
+              mALSADevice->close(&(*it));
+              mDeviceList.erase(it);
+              if (status) *status = err;
               return NULL;
           }
       }
@@ -585,28 +698,27 @@ AudioHardwareALSA::openOutputStream(uint32_t devices,
       alsa_handle.latency = PLAYBACK_LATENCY;
       alsa_handle.rxHandle = 0;
       alsa_handle.ucMgr = mUcMgr;
-
-      char *use_case;
-      snd_use_case_get(mUcMgr, "_verb", (const char **)&use_case);
-      if ((use_case == NULL) || (!strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
-          strlcpy(alsa_handle.useCase, SND_USE_CASE_VERB_HIFI, sizeof(alsa_handle.useCase));
-      } else {
-          strlcpy(alsa_handle.useCase, SND_USE_CASE_MOD_PLAY_MUSIC, sizeof(alsa_handle.useCase));
+      alsa_handle.card = mCard;
+      alsa_handle.softMute = SOFT_MUTE_OFF;
+      alsa_handle.routeSeq = 0;
+      alsa_handle.playing = 0;
+      alsa_handle.drainFd = -1;
+
+      alsa_handle.useCase = useCaseFor(USE_CASE_VERB_HIFI, useCaseVerbInactive(mUcMgr));
+      if (mDeviceList.push_back(alsa_handle) != NO_ERROR) {
+          if (status) *status = NO_MEMORY;
+          return NULL;
       }
-      free(use_case);
-      mDeviceList.push_back(alsa_handle);
       ALSAHandleList::iterator it = mDeviceList.end();
       it--;
-      LOGD("useCase %s", it->useCase);
+      LOGD("useCase %s", useCaseName(it->useCase));
       mALSADevice->route(&(*it), devices, mode());
-      if(!strcmp(it->useCase, SND_USE_CASE_VERB_HIFI)) {
-          snd_use_case_set(mUcMgr, "_verb", SND_USE_CASE_VERB_HIFI);
-      } else {
-          snd_use_case_set(mUcMgr, "_enamod", SND_USE_CASE_MOD_PLAY_MUSIC);
-      }
+      useCaseEnable(mUcMgr, it->useCase);
       err = mALSADevice->open(&(*it));
       if (err) {
           LOGE("Device open failed");
+          mALSADevice->close(&(*it));
+          mDeviceList.erase(it);
       } else {
           out = new AudioStreamOutALSA(this, &(*it));
           err = out->set(format, channels, sampleRate, devices);
@@ -629,7 +741,9 @@ AudioHardwareALSA::openOutputSession(uint32_t devices,
                                      status_t *status,
                                      int sessionId)
 {
-    Mutex::Autolock autoLock(mLock);
+    // Let queued routing land before touching the device list
+    mRoutingThread->sync();
+    ALSARWLock::AutoWLock autoLock(mRouteLock);
     LOGD("openOutputSession");
     AudioStreamOutALSA *out = 0;
     status_t err = BAD_VALUE;
@@ -650,27 +764,30 @@ AudioHardwareALSA::openOutputSession(uint32_t devices,
     alsa_handle.latency = VOICE_LATENCY;
     alsa_handle.rxHandle = 0;
     alsa_handle.ucMgr = mUcMgr;
-
-    char *use_case;
-    snd_use_case_get(mUcMgr, "_verb", (const char **)&use_case);
-    if ((use_case == NULL) || (!strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
-        strlcpy(alsa_handle.useCase, SND_USE_CASE_VERB_HIFI_LOW_POWER, sizeof(alsa_handle.useCase));
-    } else {
-        strlcpy(alsa_handle.useCase, SND_USE_CASE_MOD_PLAY_LPA, sizeof(alsa_handle.useCase));
+    alsa_handle.card = mCard;
+    alsa_handle.softMute = SOFT_MUTE_OFF;
+    alsa_handle.routeSeq = 0;
+    alsa_handle.playing = 0;
+    alsa_handle.drainFd = -1;
+
+    alsa_handle.useCase = useCaseFor(USE_CASE_VERB_HIFI_LOW_POWER, useCaseVerbInactive(mUcMgr));
+    if (mDeviceList.push_back(alsa_handle) != NO_ERROR) {
+        if (status) *status = NO_MEMORY;
+        return NULL;
     }
-    free(use_case);
-    mDeviceList.push_back(alsa_handle);
     ALSAHandleList::iterator it = mDeviceList.end();
     it--;
-    LOGD("useCase %s", it->useCase);
+    LOGD("useCase %s", useCaseName(it->useCase));
     mALSADevice->route(&(*it), devices, mode());
-    if(!strcmp(it->useCase, SND_USE_CASE_VERB_HIFI_LOW_POWER)) {
-        snd_use_case_set(mUcMgr, "_verb", SND_USE_CASE_VERB_HIFI_LOW_POWER);
+    useCaseEnable(mUcMgr, it->useCase);
+    err = mALSADevice->open(&(*it));
+    if (err) {
+        LOGE("Session open failed");
+        mALSADevice->close(&(*it));
+        mDeviceList.erase(it);
     } else {
-        snd_use_case_set(mUcMgr, "_enamod", SND_USE_CASE_MOD_PLAY_LPA);
+        out = new AudioStreamOutALSA(this, &(*it));
     }
-    err = mALSADevice->open(&(*it));
-    out = new AudioStreamOutALSA(this, &(*it));
 
     if (status) *status = err;
        return out;
@@ -690,8 +807,9 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
                                    status_t *status,
                                    AudioSystem::audio_in_acoustics acoustics)
 {
-    Mutex::Autolock autoLock(mLock);
-    char *use_case;
+    // Let queued routing land before touching the device list
+    mRoutingThread->sync();
+    ALSARWLock::AutoWLock autoLock(mRouteLock);
     int newMode = mode();
     uint32_t route_devices;
 
@@ -707,14 +825,10 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
 
     if((devices == AudioSystem::DEVICE_IN_COMMUNICATION) )  {
         bool voipstream_active = false;
-        for(it = mDeviceList.begin();
-            it != mDeviceList.end(); ++it) {
-                if((!strcmp(it->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) ||
-                   (!strcmp(it->useCase, SND_USE_CASE_MOD_PLAY_VOIP))) {
-                    LOGD("openInput:  it->rxHandle %d it->handle %d",it->rxHandle,it->handle);
-                    voipstream_active = true;
-                    break;
-                }
+        it = mDeviceList.findActive(UC_VOIP);
+        if (it != mDeviceList.end()) {
+            LOGD("openInput:  it->rxHandle %d it->handle %d",it->rxHandle,it->handle);
+            voipstream_active = true;
         }
         if(voipstream_active == false) {
            mVoipStreamCount = 0;
@@ -742,22 +856,20 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
            alsa_handle.latency = VOIP_RECORD_LATENCY;
            alsa_handle.rxHandle = 0;
            alsa_handle.ucMgr = mUcMgr;
-           snd_use_case_get(mUcMgr, "_verb", (const char **)&use_case);
-           if ((use_case != NULL) && (strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
-                strcpy(alsa_handle.useCase, SND_USE_CASE_MOD_PLAY_VOIP);
-           } else {
-                strcpy(alsa_handle.useCase, SND_USE_CASE_VERB_IP_VOICECALL);
+           alsa_handle.card = mCard;
+           alsa_handle.softMute = SOFT_MUTE_OFF;
+           alsa_handle.routeSeq = 0;
+           alsa_handle.playing = 0;
+           alsa_handle.drainFd = -1;
+           alsa_handle.useCase = useCaseFor(USE_CASE_VERB_IP_VOICECALL, useCaseVerbInactive(mUcMgr));
+           if (mDeviceList.push_back(alsa_handle) != NO_ERROR) {
+               if (status) *status = NO_MEMORY;
+               return NULL;
            }
-           free(use_case);
-           mDeviceList.push_back(alsa_handle);
            it = mDeviceList.end();
            it--;
            mALSADevice->route(&(*it),mCurDevice, AudioSystem::MODE_IN_COMMUNICATION);
-           if(!strcmp(it->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) {
-               snd_use_case_set(mUcMgr, "_verb", SND_USE_CASE_VERB_IP_VOICECALL);
-           } else {
-               snd_use_case_set(mUcMgr, "_enamod", SND_USE_CASE_MOD_PLAY_VOIP);
-           }
+           useCaseEnable(mUcMgr, it->useCase);
            if(sampleRate) {
                it->sampleRate = *sampleRate;
            }
@@ -766,6 +878,9 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
            err = mALSADevice->startVoipCall(&(*it));
            if (err) {
                LOGE("Error opening pcm input device");
+               mALSADevice->close(&(*it));
+               mDeviceList.erase(it);
+               if (status) *status = err;
                return NULL;
            }
         }
@@ -780,29 +895,27 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
         return in;
       } else
       {
-        for(ALSAHandleList::iterator itDev = mDeviceList.begin();
-              itDev != mDeviceList.end(); ++itDev)
-        {
-            if((0 == strncmp(itDev->useCase, SND_USE_CASE_VERB_HIFI_REC, MAX_UC_LEN))
-              ||(0 == strncmp(itDev->useCase, SND_USE_CASE_MOD_CAPTURE_MUSIC, MAX_UC_LEN))
-              ||(0 == strncmp(itDev->useCase, SND_USE_CASE_MOD_CAPTURE_FM, MAX_UC_LEN))
-              ||(0 == strncmp(itDev->useCase, SND_USE_CASE_VERB_FM_REC, MAX_UC_LEN)))
-            {
-                if(!(devices == AudioSystem::DEVICE_IN_FM_RX_A2DP)){
-                    LOGD("Input stream already exists, new stream not permitted: useCase:%s, devices:0x%x, module:%p",
-                        itDev->useCase, itDev->devices, itDev->module);
-                    return in;
-                }
+        static const alsa_use_case_t recUseCases[] = {
+            USE_CASE_VERB_HIFI_REC, USE_CASE_MOD_CAPTURE_MUSIC,
+            USE_CASE_MOD_CAPTURE_FM, USE_CASE_VERB_FM_REC,
+        };
+        static const alsa_use_case_t a2dpRecUseCases[] = {
+            USE_CASE_VERB_FM_A2DP_REC, USE_CASE_MOD_CAPTURE_A2DP_FM,
+        };
+        const alsa_use_case_t *busy = recUseCases;
+        size_t busyCount = sizeof(recUseCases) / sizeof(recUseCases[0]);
+
+        if (devices == AudioSystem::DEVICE_IN_FM_RX_A2DP) {
+            busy = a2dpRecUseCases;
+            busyCount = sizeof(a2dpRecUseCases) / sizeof(a2dpRecUseCases[0]);
+        }
+        for (size_t i = 0; i < busyCount; i++) {
+            ALSAHandleList::iterator itDev = mDeviceList.findUseCase(busy[i]);
+            if (itDev != mDeviceList.end()) {
+                LOGD("Input stream already exists, new stream not permitted: useCase:%s, devices:0x%x, module:%p",
+                    useCaseName(itDev->useCase), itDev->devices, itDev->module);
+                return in;
             }
-        else if ((0 == strncmp(itDev->useCase, SND_USE_CASE_VERB_FM_A2DP_REC, MAX_UC_LEN))
-                ||(0 == strncmp(itDev->useCase, SND_USE_CASE_MOD_CAPTURE_A2DP_FM, MAX_UC_LEN)))
-             {
-                 if((devices == AudioSystem::DEVICE_IN_FM_RX_A2DP)){
-                     LOGD("Input stream already exists, new stream not permitted: useCase:%s, devices:0x%x, module:%p",
-                         itDev->useCase, itDev->devices, itDev->module);
-                     return in;
-                 }
-             }
         }
 
         alsa_handle_t alsa_handle;
@@ -818,48 +931,34 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
         alsa_handle.latency = RECORD_LATENCY;
         alsa_handle.rxHandle = 0;
         alsa_handle.ucMgr = mUcMgr;
-        snd_use_case_get(mUcMgr, "_verb", (const char **)&use_case);
-        if ((use_case != NULL) && (strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
-            if ((devices == AudioSystem::DEVICE_IN_VOICE_CALL) &&
-                (newMode == AudioSystem::MODE_IN_CALL)) {
-                LOGD("openInputStream: into incall recording, channels %d", *channels);
-                mIncallMode = *channels;
-                if ((*channels & AudioSystem::CHANNEL_IN_VOICE_UPLINK) &&
-                    (*channels & AudioSystem::CHANNEL_IN_VOICE_DNLINK)) {
-                    strlcpy(alsa_handle.useCase, SND_USE_CASE_MOD_CAPTURE_VOICE_UL_DL,
-                            sizeof(alsa_handle.useCase));
-                } else if (*channels & AudioSystem::CHANNEL_IN_VOICE_DNLINK) {
-                    strlcpy(alsa_handle.useCase, SND_USE_CASE_MOD_CAPTURE_VOICE_DL,
-                            sizeof(alsa_handle.useCase));
-                }
-            } else if((devices == AudioSystem::DEVICE_IN_FM_RX)) {
-                strlcpy(alsa_handle.useCase, SND_USE_CASE_MOD_CAPTURE_FM, sizeof(alsa_handle.useCase));
-            } else if(devices == AudioSystem::DEVICE_IN_FM_RX_A2DP) {
-                strlcpy(alsa_handle.useCase, SND_USE_CASE_MOD_CAPTURE_A2DP_FM, sizeof(alsa_handle.useCase));
-            } else {
-                strlcpy(alsa_handle.useCase, SND_USE_CASE_MOD_CAPTURE_MUSIC, sizeof(alsa_handle.useCase));
+        alsa_handle.card = mCard;
+        alsa_handle.softMute = SOFT_MUTE_OFF;
+        alsa_handle.routeSeq = 0;
+        alsa_handle.playing = 0;
+        alsa_handle.drainFd = -1;
+        alsa_handle.useCase = USE_CASE_NONE;
+        if ((devices == AudioSystem::DEVICE_IN_VOICE_CALL) &&
+            (newMode == AudioSystem::MODE_IN_CALL)) {
+            LOGD("openInputStream: incall recording, channels %d", *channels);
+            mIncallMode = *channels;
+            if ((*channels & AudioSystem::CHANNEL_IN_VOICE_UPLINK) &&
+                (*channels & AudioSystem::CHANNEL_IN_VOICE_DNLINK)) {
+                alsa_handle.useCase = USE_CASE_VERB_UL_DL_REC;
+            } else if (*channels & AudioSystem::CHANNEL_IN_VOICE_DNLINK) {
+                alsa_handle.useCase = USE_CASE_VERB_DL_REC;
             }
+        } else if(devices == AudioSystem::DEVICE_IN_FM_RX) {
+            alsa_handle.useCase = USE_CASE_VERB_FM_REC;
+        } else if (devices == AudioSystem::DEVICE_IN_FM_RX_A2DP) {
+            alsa_handle.useCase = USE_CASE_VERB_FM_A2DP_REC;
         } else {
-            if ((devices == AudioSystem::DEVICE_IN_VOICE_CALL) &&
-                (newMode == AudioSystem::MODE_IN_CALL)) {
-                LOGD("openInputStream: incall recording, channels %d", *channels);
-                mIncallMode = *channels;
-                if ((*channels & AudioSystem::CHANNEL_IN_VOICE_UPLINK) &&
-                    (*channels & AudioSystem::CHANNEL_IN_VOICE_DNLINK)) {
-                    strlcpy(alsa_handle.useCase, SND_USE_CASE_VERB_UL_DL_REC, sizeof(alsa_handle.useCase));
-                } else if (*channels & AudioSystem::CHANNEL_IN_VOICE_DNLINK) {
-                    strlcpy(alsa_handle.useCase, SND_USE_CASE_VERB_DL_REC, sizeof(alsa_handle.useCase));
-                }
-            } else if(devices == AudioSystem::DEVICE_IN_FM_RX) {
-                strlcpy(alsa_handle.useCase, SND_USE_CASE_VERB_FM_REC, sizeof(alsa_handle.useCase));
-            } else if (devices == AudioSystem::DEVICE_IN_FM_RX_A2DP) {
-                strlcpy(alsa_handle.useCase, SND_USE_CASE_VERB_FM_A2DP_REC, sizeof(alsa_handle.useCase));
-            } else {
-                strlcpy(alsa_handle.useCase, SND_USE_CASE_VERB_HIFI_REC, sizeof(alsa_handle.useCase));
-            }
+            alsa_handle.useCase = USE_CASE_VERB_HIFI_REC;
+        }
+        alsa_handle.useCase = useCaseFor(alsa_handle.useCase, useCaseVerbInactive(mUcMgr));
+        if (mDeviceList.push_back(alsa_handle) != NO_ERROR) {
+            if (status) *status = NO_MEMORY;
+            return NULL;
         }
-        free(use_case);
-        mDeviceList.push_back(alsa_handle);
         ALSAHandleList::iterator it = mDeviceList.end();
         it--;
         if (devices == AudioSystem::DEVICE_IN_VOICE_CALL){
@@ -869,15 +968,7 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
         } else {
             mALSADevice->route(&(*it), devices, mode());
         }
-        if(!strcmp(it->useCase, SND_USE_CASE_VERB_HIFI_REC) ||
-           !strcmp(it->useCase, SND_USE_CASE_VERB_FM_REC) ||
-           !strcmp(it->useCase, SND_USE_CASE_VERB_FM_A2DP_REC) ||
-           !strcmp(it->useCase, SND_USE_CASE_VERB_DL_REC) ||
-           !strcmp(it->useCase, SND_USE_CASE_VERB_UL_DL_REC)) {
-            snd_use_case_set(mUcMgr, "_verb", it->useCase);
-        } else {
-            snd_use_case_set(mUcMgr, "_enamod", it->useCase);
-        }
+        useCaseEnable(mUcMgr, it->useCase);
         if(sampleRate) {
             it->sampleRate = *sampleRate;
         }
@@ -890,6 +981,8 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
         err = mALSADevice->open(&(*it));
         if (err) {
            LOGE("Error opening pcm input device");
+           mALSADevice->close(&(*it));
+           mDeviceList.erase(it);
         } else {
            in = new AudioStreamInALSA(this, &(*it), acoustics);
            err = in->set(format, channels, sampleRate, devices);
@@ -914,7 +1007,7 @@ status_t AudioHardwareALSA::setMicMute(bool state)
              mVoipMicMute = state;
             LOGD("setMicMute: mVoipMicMute %d", mVoipMicMute);
             if(mALSADevice) {
-                mALSADevice->setVoipMicMute(state);
+                mALSADevice->setVoipMicMute(mCard, state);
             }
         }
     } else {
@@ -922,7 +1015,7 @@ status_t AudioHardwareALSA::setMicMute(bool state)
               mMicMute = state;
               LOGD("setMicMute: mMicMute %d", mMicMute);
               if(mALSADevice) {
-                 mALSADevice->setMicMute(state);
+                 mALSADevice->setMicMute(mCard, state);
               }
         }
     }
@@ -942,6 +1035,29 @@ status_t AudioHardwareALSA::getMicMute(bool *state)
 
 status_t AudioHardwareALSA::dump(int fd, const Vector<String16>& args)
 {
+    String8 result("AudioHardwareALSA locks:\n");
+    char buffer[256];
+
+    mRouteLock.stats().dump(result);
+
+    ALSARWLock::AutoRLock autoLock(mRouteLock);
+    if (mCard != NULL) {
+        snprintf(buffer, sizeof(buffer),
+                 "AudioHardwareALSA state: mode %d, device 0x%x, rx %s tx %s, "
+                 "voice %d fm %d voip streams %u\n", mode(), mCurDevice,
+                 mCard->curRxUCMDevice, mCard->curTxUCMDevice, mIsVoiceCallActive,
+                 mIsFmActive, mVoipStreamCount);
+        result.append(buffer);
+    }
+    for (ALSAHandleList::iterator it = mDeviceList.begin(); it != mDeviceList.end(); ++it) {
+        snprintf(buffer, sizeof(buffer),
+                 "  %s: devices 0x%x, %u Hz %u ch, period %u buffer %u bytes, pcm %s%s\n",
+                 useCaseName(it->useCase), it->devices, it->sampleRate, it->channels,
+                 it->periodSize, it->bufferSize, it->handle ? "open" : "closed",
+                 it->rxHandle ? ", rx open" : "");
+        result.append(buffer);
+    }
+    ::write(fd, result.string(), result.size());
     return NO_ERROR;
 }
 
@@ -969,15 +1085,8 @@ int newMode = mode();
         // Start FM Radio on current active device
         unsigned long bufferSize = FM_BUFFER_SIZE;
         alsa_handle_t alsa_handle;
-        char *use_case;
         LOGV("Start FM");
-        snd_use_case_get(mUcMgr, "_verb", (const char **)&use_case);
-        if ((use_case == NULL) || (!strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
-            strlcpy(alsa_handle.useCase, SND_USE_CASE_VERB_DIGITAL_RADIO, sizeof(alsa_handle.useCase));
-        } else {
-            strlcpy(alsa_handle.useCase, SND_USE_CASE_MOD_PLAY_FM, sizeof(alsa_handle.useCase));
-        }
-        free(use_case);
+        alsa_handle.useCase = useCaseFor(USE_CASE_VERB_DIGITAL_RADIO, useCaseVerbInactive(mUcMgr));
 
         for (size_t b = 1; (bufferSize & ~b) != 0; b <<= 1)
         bufferSize &= ~b;
@@ -991,31 +1100,43 @@ int newMode = mode();
         alsa_handle.latency = VOICE_LATENCY;
         alsa_handle.rxHandle = 0;
         alsa_handle.ucMgr = mUcMgr;
+        alsa_handle.card = mCard;
+        alsa_handle.softMute = SOFT_MUTE_OFF;
+        alsa_handle.routeSeq = 0;
+        alsa_handle.playing = 0;
+        alsa_handle.drainFd = -1;
+        if (mDeviceList.push_back(alsa_handle) != NO_ERROR)
+            return;
         mIsFmActive = 1;
-        mDeviceList.push_back(alsa_handle);
         ALSAHandleList::iterator it = mDeviceList.end();
         it--;
         mALSADevice->route(&(*it), (uint32_t)device, newMode);
-        if(!strcmp(it->useCase, SND_USE_CASE_VERB_DIGITAL_RADIO)) {
-            snd_use_case_set(mUcMgr, "_verb", SND_USE_CASE_VERB_DIGITAL_RADIO);
-        } else {
-            snd_use_case_set(mUcMgr, "_enamod", SND_USE_CASE_MOD_PLAY_FM);
-        }
         mALSADevice->startFm(&(*it));
     } else if (!(device & AudioSystem::DEVICE_OUT_FM) && mIsFmActive == 1) {
         //i Stop FM Radio
         LOGV("Stop FM");
-        for(ALSAHandleList::iterator it = mDeviceList.begin();
-            it != mDeviceList.end(); ++it) {
-            if((!strcmp(it->useCase, SND_USE_CASE_VERB_DIGITAL_RADIO)) ||
-              (!strcmp(it->useCase, SND_USE_CASE_MOD_PLAY_FM))) {
-                mALSADevice->close(&(*it));
-                //mALSADevice->route(&(*it), (uint32_t)device, newMode);
-                mDeviceList.erase(it);
-                break;
-            }
+        ALSAHandleList::iterator it = mDeviceList.findActive(UC_FM);
+        if (it != mDeviceList.end()) {
+            mALSADevice->close(&(*it));
+            //mALSADevice->route(&(*it), (uint32_t)device, newMode);
+            mDeviceList.erase(it);
         }
         mIsFmActive = 0;
     }
 }
+
+// Caller holds mRouteLock for writing
+status_t AudioHardwareALSA::switchVoipRate(alsa_handle_t *handle, uint32_t rate)
+{
+    if (rate != VOIP_SAMPLING_RATE_8K && rate != VOIP_SAMPLING_RATE_16K) {
+        LOGE("switchVoipRate: unsupported samplerate %d for voip", rate);
+        return BAD_VALUE;
+    }
+    if (handle->sampleRate == rate)
+        return NO_ERROR;
+
+    LOGD("switchVoipRate: %d -> %d, mVoipStreamCount %d", handle->sampleRate, rate,
+         mVoipStreamCount);
+    return mALSADevice->setVoipRate(handle, rate);
+}
 }       // namespace android_audio_legacy
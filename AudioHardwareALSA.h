@@ -27,6 +27,12 @@
 #include <system/audio.h>
 #include <hardware/audio.h>
 #include <utils/threads.h>
+#include <utils/Timers.h>
+#include <cutils/atomic.h>
+
+#include "ALSASharedState.h"
+#include "ALSAVolume.h"
+#include "ALSATrace.h"
 
 extern "C" {
    #include <sound/asound.h>
@@ -34,13 +40,23 @@ extern "C" {
    #include "msm8960_use_cases.h"
 }
 
+#ifdef ALSA_SIM
+#include "alsa_sim.h"
+#endif
+
 #include <hardware/hardware.h>
 
 namespace android_audio_legacy
 {
 using android::List;
 using android::Mutex;
+using android::RWLock;
+using android::Condition;
+using android::RefBase;
+using android::Thread;
+using android::sp;
 class AudioHardwareALSA;
+class ALSAJitterBuffer;
 
 /**
  * The id of ALSA module
@@ -76,6 +92,10 @@ class AudioHardwareALSA;
 #define BTHEADSET_VGS       "bt_headset_vgs"
 #define WIDEVOICE_KEY "wide_voice_enable"
 #define FENS_KEY "fens_enable"
+#define VOIP_RATE_KEY "voip_sample_rate"
+#define STREAM_DRAIN_KEY "drain"
+#define STREAM_FLUSH_KEY "flush"
+#define STREAM_PREWARM_KEY "prewarm"
 
 #define ANC_FLAG        0x00000001
 #define DMIC_FLAG       0x00000002
@@ -86,18 +106,169 @@ class AudioHardwareALSA;
 #define TTY_HCO         0x00000080
 #define TTY_CLEAR       0xFFFFFF0F
 
+/* Soft mute handshake between doRouting() and the music writer */
+#define SOFT_MUTE_OFF           0
+#define SOFT_MUTE_RAMP_DOWN     1       // routing asked for silence
+#define SOFT_MUTE_ON            2       // writer has filled the buffer with silence
+#define SOFT_MUTE_RAMP_MS       10
+#define SOFT_MUTE_SWITCH_PROP   "audio.alsa.softmute_switch"
+#define ROUTE_GAP_WINDOW_NS     500000000LL
+
+// A close/reopen switch waits this long for drain() to drop its PCM fd
+#define DRAIN_CLOSE_WAIT_MS     100
+
+// Set to 0 to ignore the policy's prewarm hint, for first write timings
+#define PREWARM_PROP            "audio.alsa.prewarm"
+
 #define DEVICE_SPEAKER_HEADSET "Speaker Headset"
 #define DEVICE_HEADSET "Headset"
 #define DEVICE_HEADPHONES "Headphones"
 
+#define ALSA_MAX_CARDS          8
+#define ALSA_PCM_NODE_LEN       70          // UCM PCM name, e.g. "hw:<card>,<device>"
+#define ALSA_STREAM_POOL_SIZE   8
+
 struct alsa_device_t;
+class ALSAControl;
+struct alsa_params_cache;
 static uint32_t FLUENCE_MODE_ENDFIRE   = 0;
 static uint32_t FLUENCE_MODE_BROADSIDE = 1;
 
+/**
+ * Interned UCM use cases. The SND_USE_CASE_* strings are only needed when
+ * talking to the use case manager; everything else works on the id and
+ * the descriptor flags. Keep in sync with sUseCaseTable below.
+ */
+enum alsa_use_case_t {
+    USE_CASE_NONE = 0,
+    USE_CASE_VERB_HIFI,
+    USE_CASE_VERB_HIFI_LOW_POWER,
+    USE_CASE_VERB_HIFI_REC,
+    USE_CASE_VERB_VOICECALL,
+    USE_CASE_VERB_IP_VOICECALL,
+    USE_CASE_VERB_DIGITAL_RADIO,
+    USE_CASE_VERB_FM_REC,
+    USE_CASE_VERB_FM_A2DP_REC,
+    USE_CASE_VERB_DL_REC,
+    USE_CASE_VERB_UL_DL_REC,
+    USE_CASE_MOD_PLAY_MUSIC,
+    USE_CASE_MOD_PLAY_LPA,
+    USE_CASE_MOD_PLAY_VOICE,
+    USE_CASE_MOD_PLAY_VOIP,
+    USE_CASE_MOD_PLAY_FM,
+    USE_CASE_MOD_CAPTURE_MUSIC,
+    USE_CASE_MOD_CAPTURE_FM,
+    USE_CASE_MOD_CAPTURE_A2DP_FM,
+    USE_CASE_MOD_CAPTURE_VOICE_UL_DL,
+    USE_CASE_MOD_CAPTURE_VOICE_DL,
+    USE_CASE_MAX
+};
+
+#define UC_VERB         0x0001
+#define UC_MODIFIER     0x0002
+#define UC_PLAYBACK     0x0004
+#define UC_CAPTURE      0x0008
+#define UC_MUSIC        0x0010  // deep buffer music (HiFi / Play Music)
+#define UC_LPA          0x0020  // PCM owned by LPAPlayer
+#define UC_VOICE        0x0040  // CS voice call
+#define UC_VOIP         0x0080
+#define UC_FM           0x0100  // FM radio playback
+
+struct alsa_use_case_desc_t {
+    const char *        name;
+    uint16_t            flags;
+    uint8_t             peer;           // verb <-> modifier counterpart
+};
+
+static const alsa_use_case_desc_t sUseCaseTable[USE_CASE_MAX] = {
+    { "",                                   0,                                          USE_CASE_NONE },
+    { SND_USE_CASE_VERB_HIFI,               UC_VERB | UC_PLAYBACK | UC_MUSIC,           USE_CASE_MOD_PLAY_MUSIC },
+    { SND_USE_CASE_VERB_HIFI_LOW_POWER,     UC_VERB | UC_PLAYBACK | UC_LPA,             USE_CASE_MOD_PLAY_LPA },
+    { SND_USE_CASE_VERB_HIFI_REC,           UC_VERB | UC_CAPTURE,                       USE_CASE_MOD_CAPTURE_MUSIC },
+    { SND_USE_CASE_VERB_VOICECALL,          UC_VERB | UC_PLAYBACK | UC_CAPTURE | UC_VOICE, USE_CASE_MOD_PLAY_VOICE },
+    { SND_USE_CASE_VERB_IP_VOICECALL,       UC_VERB | UC_PLAYBACK | UC_CAPTURE | UC_VOIP, USE_CASE_MOD_PLAY_VOIP },
+    { SND_USE_CASE_VERB_DIGITAL_RADIO,      UC_VERB | UC_PLAYBACK | UC_CAPTURE | UC_FM, USE_CASE_MOD_PLAY_FM },
+    { SND_USE_CASE_VERB_FM_REC,             UC_VERB | UC_CAPTURE,                       USE_CASE_MOD_CAPTURE_FM },
+    { SND_USE_CASE_VERB_FM_A2DP_REC,        UC_VERB | UC_CAPTURE,                       USE_CASE_MOD_CAPTURE_A2DP_FM },
+    { SND_USE_CASE_VERB_DL_REC,             UC_VERB | UC_CAPTURE,                       USE_CASE_MOD_CAPTURE_VOICE_DL },
+    { SND_USE_CASE_VERB_UL_DL_REC,          UC_VERB | UC_CAPTURE,                       USE_CASE_MOD_CAPTURE_VOICE_UL_DL },
+    { SND_USE_CASE_MOD_PLAY_MUSIC,          UC_MODIFIER | UC_PLAYBACK | UC_MUSIC,       USE_CASE_VERB_HIFI },
+    { SND_USE_CASE_MOD_PLAY_LPA,            UC_MODIFIER | UC_PLAYBACK | UC_LPA,         USE_CASE_VERB_HIFI_LOW_POWER },
+    { SND_USE_CASE_MOD_PLAY_VOICE,          UC_MODIFIER | UC_PLAYBACK | UC_CAPTURE | UC_VOICE, USE_CASE_VERB_VOICECALL },
+    { SND_USE_CASE_MOD_PLAY_VOIP,           UC_MODIFIER | UC_PLAYBACK | UC_CAPTURE | UC_VOIP, USE_CASE_VERB_IP_VOICECALL },
+    { SND_USE_CASE_MOD_PLAY_FM,             UC_MODIFIER | UC_PLAYBACK | UC_CAPTURE | UC_FM, USE_CASE_VERB_DIGITAL_RADIO },
+    { SND_USE_CASE_MOD_CAPTURE_MUSIC,       UC_MODIFIER | UC_CAPTURE,                   USE_CASE_VERB_HIFI_REC },
+    { SND_USE_CASE_MOD_CAPTURE_FM,          UC_MODIFIER | UC_CAPTURE,                   USE_CASE_VERB_FM_REC },
+    { SND_USE_CASE_MOD_CAPTURE_A2DP_FM,     UC_MODIFIER | UC_CAPTURE,                   USE_CASE_VERB_FM_A2DP_REC },
+    { SND_USE_CASE_MOD_CAPTURE_VOICE_UL_DL, UC_MODIFIER | UC_CAPTURE,                   USE_CASE_VERB_UL_DL_REC },
+    { SND_USE_CASE_MOD_CAPTURE_VOICE_DL,    UC_MODIFIER | UC_CAPTURE,                   USE_CASE_VERB_DL_REC },
+};
+
+static inline const char *useCaseName(uint32_t useCase)
+{
+    return sUseCaseTable[useCase].name;
+}
+
+static inline bool useCaseIs(uint32_t useCase, uint32_t flags)
+{
+    return (sUseCaseTable[useCase].flags & flags) != 0;
+}
+
+// Pick the verb form when no verb is active, the modifier form otherwise.
+static inline alsa_use_case_t useCaseFor(uint32_t useCase, bool verbInactive)
+{
+    if (useCaseIs(useCase, UC_VERB) != verbInactive)
+        return (alsa_use_case_t)sUseCaseTable[useCase].peer;
+    return (alsa_use_case_t)useCase;
+}
+
+// Query the active UCM verb. Only used on (re)open and routing paths.
+static inline bool useCaseVerbInactive(snd_use_case_mgr_t *ucMgr)
+{
+    char *verb = NULL;
+    bool inactive;
+
+    snd_use_case_get(ucMgr, "_verb", (const char **)&verb);
+    inactive = (verb == NULL) || !strcmp(verb, SND_USE_CASE_VERB_INACTIVE);
+    free(verb);
+    return inactive;
+}
+
+// Enable a use case through UCM as a verb or as a modifier.
+static inline int useCaseEnable(snd_use_case_mgr_t *ucMgr, uint32_t useCase)
+{
+    ALSA_TRACE_SCOPE("ucm_enable");
+    return snd_use_case_set(ucMgr, useCaseIs(useCase, UC_VERB) ? "_verb" : "_enamod",
+                            useCaseName(useCase));
+}
+
+/**
+ * Routing and mixer state of one sound card, owned by alsa_device_t. Each
+ * card tracks its own devices and settings so that several cards (e.g. the
+ * codec plus HDMI or USB) can be routed independently.
+ */
+struct alsa_card_t {
+    int                 id;
+    char                controlPath[32];
+    ALSAControl *       control;            // opened once, shared by the setters
+    char                curRxUCMDevice[50];
+    char                curTxUCMDevice[50];
+    char                micType[25];
+    int                 fluenceMode;
+    uint32_t            devSettingsFlag;
+    int                 callMode;
+    int                 btscoSampleRate;
+    int                 fmVolume;
+    bool                pcmClosed;          // music PCM closed across a device switch
+    alsa_params_cache * paramsCache;        // negotiated hw params, see setHardwareParams
+    char                pcmNode[USE_CASE_MAX][2][ALSA_PCM_NODE_LEN]; // by use case, playback/capture
+};
+
 struct alsa_handle_t {
     alsa_device_t *     module;
+    alsa_card_t *       card;
     uint32_t            devices;
-    char                useCase[MAX_STR_LEN];
+    alsa_use_case_t     useCase;
     struct pcm *        handle;
     snd_pcm_format_t    format;
     uint32_t            channels;
@@ -107,31 +278,289 @@ struct alsa_handle_t {
     unsigned int        periodSize;
     struct pcm *        rxHandle;
     snd_use_case_mgr_t  *ucMgr;
+    volatile int32_t    softMute;        // SOFT_MUTE_*, PCM is kept open while set
+    volatile int32_t    routeSeq;        // bumped on every device switch
+    volatile int32_t    playing;         // 1 from write() until standby or close
+    volatile int32_t    drainFd;         // drain()'s dup of the PCM fd, -1 when none
 };
 
-typedef List<alsa_handle_t> ALSAHandleList;
+/*
+ * Handles live in fixed slots, so opening a stream never allocates a list
+ * node and &(*it) stays valid for as long as the entry is in the list.
+ * Iteration is in insertion order, like the List this replaces. Only one
+ * handle per UCM verb or modifier can be active, which bounds the size.
+ *
+ * Each slot is also chained under its use case, so looking up the voice,
+ * VoIP, FM or music handle does not walk the list. A handle's use case
+ * must be changed through setUseCase() to keep that index in step.
+ */
+#define ALSA_MAX_HANDLES        (2 * USE_CASE_MAX)
+
+class ALSAHandleList
+{
+public:
+    class iterator
+    {
+    public:
+        iterator() : mList(NULL), mIndex(-1) {}
+
+        alsa_handle_t& operator*() const { return mList->mSlots[mIndex]; }
+        alsa_handle_t* operator->() const { return &mList->mSlots[mIndex]; }
+        iterator& operator++() { mIndex = mList->mNext[mIndex]; return *this; }
+        iterator& operator--() {
+            mIndex = (mIndex < 0) ? mList->mTail : mList->mPrev[mIndex];
+            return *this;
+        }
+        iterator operator++(int) { iterator it(*this); ++*this; return it; }
+        iterator operator--(int) { iterator it(*this); --*this; return it; }
+        bool operator==(const iterator& it) const { return mIndex == it.mIndex; }
+        bool operator!=(const iterator& it) const { return mIndex != it.mIndex; }
+
+    private:
+        friend class ALSAHandleList;
+        iterator(ALSAHandleList *list, int index) : mList(list), mIndex(index) {}
+
+        ALSAHandleList *mList;
+        int             mIndex;             // -1 is end()
+    };
+
+    ALSAHandleList() { clear(); }
+
+    iterator begin() { return iterator(this, mHead); }
+    iterator end() { return iterator(this, -1); }
+    bool     empty() const { return mHead < 0; }
+    size_t   size() const { return mCount; }
+
+    // Most recently added handle for exactly this use case
+    iterator findUseCase(alsa_use_case_t useCase)
+    {
+        return iterator(this, mUseCaseHead[useCase]);
+    }
+
+    // Handle of any use case matching one of the UC_* flags, see useCaseIs()
+    iterator findActive(uint32_t flags)
+    {
+        for (int uc = USE_CASE_NONE + 1; uc < USE_CASE_MAX; uc++) {
+            if (mUseCaseHead[uc] >= 0 && useCaseIs(uc, flags))
+                return iterator(this, mUseCaseHead[uc]);
+        }
+        return end();
+    }
+
+    // Newest handle in open order matching the flags, for rerouting
+    iterator findLast(uint32_t flags)
+    {
+        for (int slot = mTail; slot >= 0; slot = mPrev[slot]) {
+            if (useCaseIs(mKey[slot], flags))
+                return iterator(this, slot);
+        }
+        return end();
+    }
+
+    iterator iteratorFor(alsa_handle_t *handle)
+    {
+        int slot = handle - mSlots;
+
+        if (slot < 0 || slot >= ALSA_MAX_HANDLES || !mInUse[slot])
+            return end();
+        return iterator(this, slot);
+    }
+
+    void setUseCase(alsa_handle_t *handle, alsa_use_case_t useCase)
+    {
+        int slot = handle - mSlots;
+
+        if (slot >= 0 && slot < ALSA_MAX_HANDLES && mInUse[slot]) {
+            unlinkUseCase(slot);
+            linkUseCase(slot, useCase);
+        }
+        handle->useCase = useCase;
+    }
+
+    // NO_MEMORY once every slot is taken, the caller fails its open
+    status_t push_back(const alsa_handle_t& handle)
+    {
+        int slot = mFree;
+
+        if (slot < 0) {
+            LOGE("ALSAHandleList: all %d handle slots in use", ALSA_MAX_HANDLES);
+            return NO_MEMORY;
+        }
+        mFree = mNext[slot];
+        mSlots[slot] = handle;
+        mInUse[slot] = true;
+        linkUseCase(slot, handle.useCase);
+        mNext[slot] = -1;
+        mPrev[slot] = mTail;
+        if (mTail >= 0)
+            mNext[mTail] = slot;
+        else
+            mHead = slot;
+        mTail = slot;
+        mCount++;
+        return NO_ERROR;
+    }
+
+    iterator erase(iterator it)
+    {
+        int slot = it.mIndex;
+        int next = mNext[slot];
+
+        unlinkUseCase(slot);
+        mInUse[slot] = false;
+        if (mPrev[slot] >= 0)
+            mNext[mPrev[slot]] = next;
+        else
+            mHead = next;
+        if (next >= 0)
+            mPrev[next] = mPrev[slot];
+        else
+            mTail = mPrev[slot];
+        mNext[slot] = mFree;
+        mFree = slot;
+        mCount--;
+        return iterator(this, next);
+    }
+
+    iterator erase(alsa_handle_t *handle)
+    {
+        iterator it = iteratorFor(handle);
+
+        return (it != end()) ? erase(it) : it;
+    }
+
+    void clear()
+    {
+        for (int i = 0; i < ALSA_MAX_HANDLES; i++) {
+            mNext[i] = (i + 1 < ALSA_MAX_HANDLES) ? i + 1 : -1;
+            mInUse[i] = false;
+        }
+        for (int uc = 0; uc < USE_CASE_MAX; uc++)
+            mUseCaseHead[uc] = -1;
+        mFree = 0;
+        mHead = mTail = -1;
+        mCount = 0;
+    }
+
+private:
+    ALSAHandleList(const ALSAHandleList &);
+    ALSAHandleList& operator=(const ALSAHandleList &);
+
+    void linkUseCase(int slot, alsa_use_case_t useCase)
+    {
+        mKey[slot] = useCase;
+        mUseCaseNext[slot] = mUseCaseHead[useCase];
+        mUseCaseHead[useCase] = slot;
+    }
+
+    void unlinkUseCase(int slot)
+    {
+        int *link = &mUseCaseHead[mKey[slot]];
+
+        while (*link >= 0 && *link != slot)
+            link = &mUseCaseNext[*link];
+        if (*link == slot)
+            *link = mUseCaseNext[slot];
+    }
+
+    alsa_handle_t   mSlots[ALSA_MAX_HANDLES];
+    int             mNext[ALSA_MAX_HANDLES];  // also chains the free slots
+    int             mPrev[ALSA_MAX_HANDLES];
+    bool            mInUse[ALSA_MAX_HANDLES];
+    alsa_use_case_t mKey[ALSA_MAX_HANDLES];   // use case the slot is indexed under
+    int             mUseCaseNext[ALSA_MAX_HANDLES];
+    int             mUseCaseHead[USE_CASE_MAX];
+    int             mHead;
+    int             mTail;
+    int             mFree;
+    size_t          mCount;
+};
+
+/*
+ * Fixed-capacity allocator for objects created and destroyed on the stream
+ * open path. Requests that do not fit, or that arrive while every slot is
+ * taken, fall through to the heap.
+ */
+template <size_t SIZE, int COUNT>
+class ALSAObjectPool
+{
+public:
+    ALSAObjectPool()
+    {
+        for (int i = 0; i < COUNT; i++)
+            mUsed[i] = false;
+    }
+
+    void *alloc(size_t size)
+    {
+        if (size <= SIZE) {
+            Mutex::Autolock autoLock(mLock);
+            for (int i = 0; i < COUNT; i++) {
+                if (!mUsed[i]) {
+                    mUsed[i] = true;
+                    return mSlots[i].bytes;
+                }
+            }
+        }
+        return ::operator new(size);
+    }
+
+    void release(void *ptr)
+    {
+        Slot *slot = (Slot *)ptr;
+
+        if (slot >= mSlots && slot < mSlots + COUNT) {
+            Mutex::Autolock autoLock(mLock);
+            mUsed[slot - mSlots] = false;
+            return;
+        }
+        ::operator delete(ptr);
+    }
+
+private:
+    union Slot {
+        char        bytes[SIZE];
+        int64_t     align;
+        void *      ptr;
+    };
+
+    Mutex           mLock;
+    bool            mUsed[COUNT];
+    Slot            mSlots[COUNT];
+};
 
 struct alsa_device_t {
     hw_device_t common;
 
     status_t (*init)(alsa_device_t *, ALSAHandleList &);
+    alsa_card_t *(*getCard)(alsa_device_t *, int);
     status_t (*open)(alsa_handle_t *);
     status_t (*close)(alsa_handle_t *);
     status_t (*standby)(alsa_handle_t *);
+    // Back to PREPARED once the caller drained the PCM
+    status_t (*prepare)(alsa_handle_t *);
+    // Drop the queued frames, then prepare for the next write
+    status_t (*flush)(alsa_handle_t *);
     status_t (*route)(alsa_handle_t *, uint32_t, int);
+    // Voice and FM enable handle->useCase themselves, overlapped with
+    // the PCM bring-up
     status_t (*startVoiceCall)(alsa_handle_t *);
     status_t (*startVoipCall)(alsa_handle_t *);
+    status_t (*setVoipRate)(alsa_handle_t *, uint32_t);
     status_t (*startFm)(alsa_handle_t *);
-    void     (*setVoiceVolume)(int);
-    void     (*setVoipVolume)(int);
-    void     (*setMicMute)(int);
-    void     (*setVoipMicMute)(int);
-    status_t (*setFmVolume)(int);
-    void     (*setBtscoRate)(int);
-    status_t (*setLpaVolume)(int);
-    void     (*enableWideVoice)(bool);
-    void     (*enableFENS)(bool);
-    void     (*setFlags)(uint32_t);
+    // Volumes are 0 to VOLUME_UNITY, mapped through ALSAVolumeCurves
+    void     (*setVoiceVolume)(alsa_card_t *, int);
+    void     (*setVoipVolume)(alsa_card_t *, int);
+    void     (*setMicMute)(alsa_card_t *, int);
+    void     (*setVoipMicMute)(alsa_card_t *, int);
+    status_t (*setFmVolume)(alsa_card_t *, int);
+    void     (*setBtscoRate)(alsa_card_t *, int);
+    status_t (*setLpaVolume)(alsa_card_t *, int);
+    void     (*enableWideVoice)(alsa_card_t *, bool);
+    void     (*enableFENS)(alsa_card_t *, bool);
+    void     (*setFlags)(alsa_card_t *, uint32_t);
+
+    alsa_card_t *       cards[ALSA_MAX_CARDS];
 };
 
 // ----------------------------------------------------------------------------
@@ -167,9 +596,197 @@ public:
     status_t                set(const char *name, const char *);
 
 private:
+    // Binder threads set voice volume and mic mute while the routing
+    // thread sets FM volume, and a mixer_ctl is not safe to share
+    Mutex                     mLock;
     struct mixer*             mHandle;
 };
 
+/**
+ * Wait and hold accounting for the HAL locks. It is off unless
+ * LOCK_STATS_PROP is set when the HAL starts, so the lock paths cost a
+ * flag test otherwise. Counters are in microseconds and start over after
+ * every dump(). The wait and hold totals are 64 bit: a stream lock is
+ * held for most of the time, which fills 32 bits of microseconds in
+ * about 35 minutes. The cutils atomics are 32 bit only, so they are
+ * added up under mSumLock.
+ */
+#define LOCK_STATS_PROP         "audio.alsa.lock_stats"
+
+class ALSALockStats
+{
+public:
+    ALSALockStats(const char *name);
+
+    void                acquired(nsecs_t waitNs, bool contended);
+    void                released(nsecs_t holdNs);
+    void                setName(const char *name) { mName = name; }
+    void                dump(String8& result);
+
+    static bool         sEnabled;
+
+private:
+    const char *        mName;
+    volatile int32_t    mCount;
+    volatile int32_t    mContended;
+    volatile int32_t    mMaxWaitUs;
+    volatile int32_t    mMaxHoldUs;
+    Mutex               mSumLock;
+    int64_t             mWaitUs;
+    int64_t             mHoldUs;
+};
+
+class ALSAMutex
+{
+public:
+    ALSAMutex(const char *name) : mStats(name), mAcquired(0) {}
+
+    void                lock();
+    void                unlock();
+    ALSALockStats&      stats() { return mStats; }
+
+    class Autolock
+    {
+    public:
+        Autolock(ALSAMutex& lock) : mLock(lock) { mLock.lock(); }
+        ~Autolock() { mLock.unlock(); }
+    private:
+        ALSAMutex&      mLock;
+    };
+
+private:
+    Mutex               mMutex;
+    ALSALockStats       mStats;
+    nsecs_t             mAcquired;
+};
+
+class ALSARWLock
+{
+public:
+    ALSARWLock(const char *name) : mStats(name), mWriteAcquired(0) {}
+
+    // Readers keep their own acquire time, there can be several at once
+    nsecs_t             readLock();
+    void                readUnlock(nsecs_t acquired);
+    void                writeLock();
+    void                writeUnlock();
+    ALSALockStats&      stats() { return mStats; }
+
+    class AutoRLock
+    {
+    public:
+        AutoRLock(ALSARWLock& lock) : mLock(lock) { mAcquired = mLock.readLock(); }
+        ~AutoRLock() { mLock.readUnlock(mAcquired); }
+    private:
+        ALSARWLock&     mLock;
+        nsecs_t         mAcquired;
+    };
+
+    class AutoWLock
+    {
+    public:
+        AutoWLock(ALSARWLock& lock) : mLock(lock) { mLock.writeLock(); }
+        ~AutoWLock() { mLock.writeUnlock(); }
+    private:
+        ALSARWLock&     mLock;
+    };
+
+private:
+    RWLock              mRWLock;
+    ALSALockStats       mStats;
+    nsecs_t             mWriteAcquired;
+};
+
+/**
+ * Data path counters of one stream. The stream's I/O thread is the only
+ * writer and dump() reads them from the binder thread, so they are plain
+ * atomic adds and are never reset. Xruns are split by how far recovery
+ * had to go: absorbed by a re-prepare inside libalsa-intf, fixed by
+ * reopening the PCM, or not recovered at all.
+ */
+#define STATS_BUCKETS           8
+
+class ALSAStreamStats
+{
+public:
+    enum {
+        XRUN_PREPARED,
+        XRUN_REOPENED,
+        XRUN_FAILED,
+        XRUN_TIERS
+    };
+
+    ALSAStreamStats();
+
+    // One read() or write() call, with the PCM it ended on
+    void                transferred(struct pcm *pcm, size_t frames, nsecs_t wallNs);
+    void                opened() { android_atomic_inc(&mOpens); }
+    void                xrun(int tier) { android_atomic_inc(&mXruns[tier]); }
+    void                dump(String8& result, alsa_handle_t *handle);
+
+private:
+    volatile int32_t    mFrames;
+    volatile int32_t    mCalls;
+    volatile int32_t    mOpens;
+    volatile int32_t    mXruns[XRUN_TIERS];
+    volatile int32_t    mWallUs[STATS_BUCKETS];
+    volatile int32_t    mMaxWallUs;
+    struct pcm *        mPcm;               // underruns already counted for
+    int                 mPcmUnderruns;
+};
+
+/**
+ * Copies what a stream hands to pcm_write() or gets from pcm_read() into
+ * a WAV file. The I/O thread only copies each period into a single
+ * producer, single consumer ring and drops the period if the ring is
+ * full; the tap's own thread drains the ring to disk. A capture ends
+ * after the requested time or PCM_TAP_MAX_BYTES_PROP bytes, whichever
+ * comes first, or when stop() is called.
+ */
+#define PCM_TAP_KEY             "pcm_tap"               // seconds, 0 stops
+#define PCM_TAP_DIR_PROP        "audio.alsa.tap.dir"
+#define PCM_TAP_DIR             "/data/misc/audio"
+#define PCM_TAP_MAX_BYTES_PROP  "audio.alsa.tap.max_bytes"
+#define PCM_TAP_MAX_BYTES       (32 * 1024 * 1024)
+#define PCM_TAP_MAX_SECONDS     600
+#define PCM_TAP_RING_BYTES      (512 * 1024)            // power of two
+#define PCM_TAP_POLL_MS         20
+
+class ALSAPcmTap : public Thread
+{
+public:
+    ALSAPcmTap(const char *name, uint32_t rate, uint32_t channels, uint32_t seconds);
+    virtual            ~ALSAPcmTap();
+
+    status_t            initCheck() const { return mFd >= 0 ? NO_ERROR : NO_INIT; }
+    // I/O thread side, never blocks
+    void                write(const void *buffer, size_t bytes);
+    // Finish the file and wait for the writer thread
+    void                stop();
+    void                dump(String8& result);
+
+private:
+    virtual bool        threadLoop();
+
+    void                drain();
+    void                finish();
+
+    String8             mPath;
+    int                 mFd;
+    uint32_t            mRate;
+    uint32_t            mChannels;
+    char *              mRing;
+    volatile int32_t    mWritePos;          // bytes ever queued, wraps
+    volatile int32_t    mReadPos;           // bytes ever written to the file
+    volatile int32_t    mDone;              // no more data is accepted
+    volatile int32_t    mDropped;           // periods lost to a full ring
+    size_t              mQueued;            // I/O thread only
+    size_t              mLimit;             // bytes of PCM data in the file
+    nsecs_t             mDeadline;
+    volatile int32_t    mFileBytes;
+    int                 mErrno;
+};
+
 class ALSAStreamOps
 {
 public:
@@ -192,19 +809,99 @@ public:
 protected:
     friend class AudioHardwareALSA;
 
+    // Starts a new PCM_TAP_KEY capture, or only ends the running one
+    // when seconds <= 0
+    status_t            setTap(int seconds);
+    void                dumpTap(String8& result);
+
+    // VoIP streams keep the rate and period they were opened with, which
+    // is what AudioFlinger sized its buffers for. After a VOIP_RATE_KEY
+    // switch the shared PCMs run at the other rate; one stream period is
+    // converted to or from one PCM period, both are 20 ms.
+    bool                voipResampling() const;
+    void                resampleVoip(const void *in, size_t inBytes, void *out, size_t outBytes);
+    // One stream period as the PCM wants it, in mVoipBuffer if converted
+    const void *        toVoipPcm(const void *in, size_t *bytes);
+
     AudioHardwareALSA *     mParent;
     alsa_handle_t *         mHandle;
     uint32_t                mDevices;
+    uint32_t                mVoipRate;
+    size_t                  mVoipPeriod;
+    int16_t                 mVoipBuffer[VOIP_BUFFER_MAX_SIZE / sizeof(int16_t)];
+    // Serializes this stream's data path against its own standby/close.
+    // Lock order is mIoLock, then AudioHardwareALSA::mRouteLock.
+    ALSAMutex               mIoLock;
+    ALSAStreamStats         mStats;
+    sp<ALSAPcmTap>          mTap;           // set under mIoLock, see PCM_TAP_KEY
 };
 
 // ----------------------------------------------------------------------------
 
+/**
+ * Runs routing and FM commands off the caller's thread. Commands execute
+ * in order; a route request still queued behind the tail is superseded
+ * by the next one, so only the last target device gets programmed.
+ */
+class ALSARoutingThread : public Thread
+{
+public:
+    enum {
+        CMD_INIT_UCM,
+        CMD_ROUTE,
+        CMD_HANDLE_FM,
+        CMD_SET_FLAGS,      // device carries mDevSettingsFlag
+        CMD_PREWARM,        // arg is the AudioStreamOutALSA
+        CMD_SYNC,
+    };
+
+    class Command : public RefBase
+    {
+    public:
+        Command(int cmd, int device, void *arg) :
+            mCmd(cmd), mDevice(device), mArg(arg), mDone(false) {}
+
+        // Block until the worker has executed the command
+        void                wait();
+
+    private:
+        friend class ALSARoutingThread;
+
+        int                 mCmd;
+        int                 mDevice;
+        void *              mArg;
+        bool                mDone;
+        Mutex               mLock;
+        Condition           mCond;
+    };
+
+    ALSARoutingThread(AudioHardwareALSA *parent);
+    virtual            ~ALSARoutingThread();
+
+    sp<Command>         post(int cmd, int device, void *arg = NULL);
+    // Wait for everything posted so far. Must not be called with mRouteLock held.
+    void                sync();
+    void                exit();
+
+private:
+    virtual bool        threadLoop();
+    void                complete(const sp<Command>& command);
+
+    AudioHardwareALSA * mParent;
+    Mutex               mLock;
+    Condition           mWaitWorkCV;
+    List< sp<Command> > mCommands;
+};
+
 class AudioStreamOutALSA : public AudioStreamOut, public ALSAStreamOps
 {
 public:
     AudioStreamOutALSA(AudioHardwareALSA *parent, alsa_handle_t *handle);
     virtual            ~AudioStreamOutALSA();
 
+    static void *       operator new(size_t size);
+    static void         operator delete(void *ptr);
+
     virtual uint32_t    sampleRate() const
     {
         return ALSAStreamOps::sampleRate();
@@ -231,9 +928,10 @@ public:
 
     virtual status_t    standby();
 
-    virtual status_t    setParameters(const String8& keyValuePairs) {
-        return ALSAStreamOps::setParameters(keyValuePairs);
-    }
+    // STREAM_DRAIN_KEY and STREAM_FLUSH_KEY call drain() and flush().
+    // STREAM_PREWARM_KEY=1 opens the PCM on the routing thread ahead of
+    // the first write, 0 closes it again if nothing was written.
+    virtual status_t    setParameters(const String8& keyValuePairs);
 
     virtual String8     getParameters(const String8& keys) {
         return ALSAStreamOps::getParameters(keys);
@@ -246,8 +944,45 @@ public:
     status_t            open(int mode);
     status_t            close();
 
+    // Blocks until the last written frame has played
+    status_t            drain();
+    // Drops the queued frames, keeping the PCM open and routed
+    status_t            flush();
+
 private:
-    uint32_t            mFrameCount;
+    friend class ALSARoutingThread;
+
+    // mRouteLock held for writing
+    status_t            openPcm();
+    // routing thread, for STREAM_PREWARM_KEY
+    void                prewarm();
+
+    // frames still queued in the PCM, mRouteLock held
+    uint32_t            queuedFrames();
+    const void *        applySoftMute(const void *buffer, size_t bytes, int32_t state);
+    // standby or close, a switch waiting for our ramp goes ahead
+    void                stopPlaying();
+    void                trackRouteGap(nsecs_t now);
+    void                stopJitterBuffer();
+
+    uint32_t            mFrameCount;        // written since standby, less flushed ones
+    int16_t *           mRampBuffer;
+    size_t              mRampBufferSize;
+    int32_t             mRampGain;          // Q15
+    size_t              mMutedBytes;
+    int32_t             mRouteSeq;
+    nsecs_t             mLastWriteTime;
+    nsecs_t             mRouteGapStart;     // 0 when no switch is being measured
+    nsecs_t             mRouteGapMax;
+    sp<ALSAJitterBuffer> mJitterBuffer;     // VoIP only, see VOIP_JITTER_BUFFER_PROP
+    int32_t             mEchoRefToken;
+    sp<ALSARoutingThread::Command> mPrewarmCmd;
+    bool                mFirstWrite;        // no write since standby
+    // first write() after standby, by whether the PCM was already open
+    uint32_t            mWarmStarts;
+    nsecs_t             mWarmStartNs;
+    uint32_t            mColdStarts;
+    nsecs_t             mColdStartNs;
 
 protected:
     AudioHardwareALSA *     mParent;
@@ -261,6 +996,9 @@ public:
             AudioSystem::audio_in_acoustics audio_acoustics);
     virtual            ~AudioStreamInALSA();
 
+    static void *       operator new(size_t size);
+    static void         operator delete(void *ptr);
+
     virtual uint32_t    sampleRate() const
     {
         return ALSAStreamOps::sampleRate();
@@ -304,15 +1042,10 @@ public:
     // Unit: the number of input audio frames
     virtual unsigned int  getInputFramesLost() const;
 
-    virtual status_t addAudioEffect(effect_handle_t effect)
-    {
-        return BAD_VALUE;
-    }
-   
-    virtual status_t removeAudioEffect(effect_handle_t effect)
-    {
-        return BAD_VALUE;
-    }
+    // An AEC preprocessor gets the echo reference through process_reverse,
+    // other effects need nothing from the HAL
+    virtual status_t addAudioEffect(effect_handle_t effect);
+    virtual status_t removeAudioEffect(effect_handle_t effect);
     status_t            setAcousticParams(void* params);
 
     status_t            open(int mode);
@@ -320,14 +1053,158 @@ public:
 
 private:
     void                resetFramesLost();
+    void                stampCapture(size_t bytes);
+    void                pushEchoReference();
 
     unsigned int        mFramesLost;
     AudioSystem::audio_in_acoustics mAcoustics;
+    effect_handle_t     mAecEffect;         // counted in ALSAEchoReference readers
+    nsecs_t             mCaptureTime;       // first frame of the last read()
+    size_t              mCaptureFrames;
+    int16_t *           mEchoRefBuffer;
+    size_t              mEchoRefBufferSize;
 
 protected:
     AudioHardwareALSA *     mParent;
 };
 
+/**
+ * Adaptive jitter buffer for the VoIP downlink. write() queues frames as
+ * the app delivers them and a playout thread feeds the DSP one frame per
+ * period. The playout depth follows the measured arrival jitter: queued
+ * audio is compressed or stretched by one pitch period at a time (WSOLA)
+ * to move towards the target, and a dry queue is bridged by repeating
+ * the last pitch period.
+ */
+#define VOIP_JITTER_BUFFER_PROP "audio.alsa.voip_jitter_buffer"
+#define JB_MAX_DEPTH_MS         160
+#define JB_OVERLAP_MS           5
+#define JB_MIN_PITCH_MS         3
+#define JB_MAX_PITCH_MS         12
+#define JB_MAX_CONCEALED        3       // frames bridged before rebuffering
+
+class ALSAJitterBuffer : public Thread
+{
+public:
+    ALSAJitterBuffer(AudioHardwareALSA *parent, alsa_handle_t *handle);
+    virtual            ~ALSAJitterBuffer();
+
+    status_t            initCheck() const { return mRing ? NO_ERROR : NO_INIT; }
+    uint32_t            rate() const { return mRate; }
+    // Queue one or more frames, 0 on success like pcm_write()
+    int                 write(const void *buffer, size_t bytes);
+    void                exit();
+    void                dump(String8& result);
+
+private:
+    virtual bool        threadLoop();
+
+    void                updateJitter(nsecs_t now, size_t samples);
+    size_t              peek(int16_t *dst, size_t samples);
+    void                consume(size_t samples);
+    void                pull(int16_t *out);
+    void                conceal(int16_t *out);
+    int                 bestLag(const int16_t *x);
+    void                recover();
+
+    AudioHardwareALSA * mParent;
+    alsa_handle_t *     mHandle;
+    Mutex               mLock;
+    Condition           mSpaceCV;
+
+    uint32_t            mRate;
+    size_t              mFrameSamples;
+    size_t              mOverlap;
+    int                 mMinLag;
+    int                 mMaxLag;
+
+    int16_t *           mRing;
+    size_t              mCapacity;          // all sizes in samples
+    size_t              mReadPos;
+    size_t              mCount;
+    size_t              mTarget;
+    bool                mPrimed;
+
+    int16_t *           mScratch;
+    int16_t *           mHistory;           // last frame handed to the DSP
+    int                 mConcealed;
+    int32_t             mConcealGain;       // Q15
+
+    nsecs_t             mLastArrival;
+    size_t              mLastSamples;
+    int64_t             mJitterNs;          // RFC 3550 style smoothed estimate
+
+    uint32_t            mUnderruns;
+    uint32_t            mOverflows;
+    uint32_t            mStretched;
+    uint32_t            mCompressed;
+    int32_t             mEchoRefToken;
+};
+
+/*
+ * Echo reference tap for software AEC. The stream feeding the speaker
+ * copies each period into a mono ring and stamps it with the time its
+ * first frame reaches the DAC, taken from the PCM queue depth. A capture
+ * stream with an AEC effect attached reads back the reference that was
+ * playing when its own samples were taken, resampled to its rate, and
+ * feeds it to the effect's reverse input.
+ *
+ * Writes land in chunks of at most ECHO_REF_GUARD frames, each published
+ * before the next starts, so the frames a reader accepts are never the
+ * ones being overwritten.
+ *
+ * One writer and any number of readers, no locks. The writer is whoever
+ * claims the tap first and holds it until standby; with no reader the
+ * tap costs one atomic load per period.
+ */
+#define ECHO_REF_FRAMES         16384   // power of two, ~340 ms at 48 kHz
+#define ECHO_REF_GUARD          1024    // frames kept clear of the writer
+#define ECHO_REF_ANCHORS        16      // power of two
+
+class ALSAEchoReference
+{
+public:
+    ALSAEchoReference();
+
+    static int32_t      newToken();
+
+    // Capture side
+    void                start();
+    void                stop();
+    bool                active() { return android_atomic_acquire_load(&mReaders) > 0; }
+    // Mono reference played at captureTime onwards, 0 filled where the
+    // ring has nothing. Returns the number of frames actually found.
+    size_t              read(int16_t *out, size_t frames, uint32_t rate, nsecs_t captureTime);
+
+    // Playback side
+    void                write(int32_t token, struct pcm *pcm, const void *buffer,
+                              size_t bytes, uint32_t channels, uint32_t rate);
+    void                release(int32_t token);
+
+    void                dump(String8& result);
+
+private:
+    struct Anchor {
+        uint32_t        frame;              // ring position of the first frame
+        nsecs_t         time;               // when that frame reaches the DAC
+        uint32_t        rate;
+    };
+
+    bool                latestAnchor(Anchor *anchor);
+
+    volatile int32_t    mReaders;
+    volatile int32_t    mOwner;             // token of the writer, 0 if none
+    volatile int32_t    mWritten;           // frames ever written, wraps
+    volatile int32_t    mAnchorSeq;
+    Anchor              mAnchors[ECHO_REF_ANCHORS];
+    int16_t             mRing[ECHO_REF_FRAMES];
+
+    volatile int32_t    mDelayErrors;
+    volatile int32_t    mMisses;            // reads that found no reference
+
+    static volatile int32_t sNextToken;
+};
+
 class AudioHardwareALSA : public AudioHardwareBase
 {
 public:
@@ -412,15 +1289,32 @@ protected:
     virtual status_t    dump(int fd, const Vector<String16>& args);
     void                doRouting(int device);
     void                handleFm(int device);
+    status_t            switchVoipRate(alsa_handle_t *handle, uint32_t rate);
+    void                routeKeepPcm(alsa_handle_t *handle, uint32_t device, int mode);
+    // the writer moved softMute or stopped playing, wakes routeKeepPcm()
+    void                signalSoftMute();
+    void                initUcm();
+    void                publishState(alsa_state_key key, int32_t value);
     friend class AudioStreamOutALSA;
     friend class AudioStreamInALSA;
     friend class ALSAStreamOps;
+    friend class ALSARoutingThread;
+    friend class ALSAJitterBuffer;
 
     alsa_device_t *     mALSADevice;
+    alsa_card_t *       mCard;              // primary codec card
 
     ALSAHandleList      mDeviceList;
 
-    Mutex                   mLock;
+    // Guards mDeviceList, the UCM manager and the card route state.
+    // Anything that changes them takes it for writing.
+    ALSARWLock              mRouteLock;
+
+    // routeKeepPcm() waits here, without mRouteLock, for the writer
+    Mutex               mSoftMuteLock;
+    Condition           mSoftMuteCond;
+    // switches of a playing stream made before the ramp reached silence
+    volatile int32_t    mUnmutedSwitches;
 
     snd_use_case_mgr_t *mUcMgr;
 
@@ -436,6 +1330,14 @@ protected:
     int mIsVoiceCallActive;
     int mIsFmActive;
     bool mBluetoothVGS;
+    bool mSoftMuteSwitch;
+    bool mVoipJitterBuffer;
+    bool mPrewarm;
+    ALSAEchoReference   mEchoRef;
+    sp<ALSARoutingThread> mRoutingThread;
+    int                 mCodecRev;
+    nsecs_t             mStartTime;
+    bool                mFirstOutputOpened;
 };
 
 // ----------------------------------------------------------------------------
@@ -18,22 +18,69 @@
 #define LOG_TAG "AudioPolicyManagerALSA"
 //#define LOG_NDEBUG 0
 #define LOG_NDDEBUG 0
+#include <dlfcn.h>
+#include <unistd.h>
 #include <utils/Log.h>
+#include <utils/String8.h>
+#include <cutils/atomic.h>
 #include "AudioPolicyManagerALSA.h"
 #include <media/mediarecorder.h>
 
 namespace android_audio_legacy {
 
 // ----------------------------------------------------------------------------
-uint32_t AudioPolicyManager::getDeviceForStrategy(routing_strategy strategy, bool fromCache)
+
+/*
+ * Everything computeDeviceForStrategy() reads besides the available
+ * devices, packed into one word. The top bit marks a used cache entry.
+ */
+uint32_t AudioPolicyManager::decisionState(routing_strategy strategy)
 {
-    uint32_t device = 0;
+    uint32_t state = DEVICE_DECISION_VALID | (uint32_t)strategy;
 
+    state |= ((uint32_t)mForceUse[AudioSystem::FOR_COMMUNICATION] & 0xf) << 4;
+    state |= ((uint32_t)mForceUse[AudioSystem::FOR_MEDIA] & 0xf) << 8;
+    state |= ((uint32_t)(mPhoneState - AudioSystem::MODE_INVALID) & 0xf) << 12;
+#ifdef WITH_A2DP
+    if (mA2dpOutput != 0)
+        state |= 1 << 16;
+#endif
+    return state;
+}
+
+uint32_t AudioPolicyManager::getDeviceForStrategy(routing_strategy strategy, bool fromCache)
+{
     if (fromCache) {
         LOGV("getDeviceForStrategy() from cache strategy %d, device %x", strategy, mDeviceForStrategy[strategy]);
         return mDeviceForStrategy[strategy];
     }
 
+    // Media in call also depends on the current phone device
+    uint32_t state = decisionState(strategy);
+    uint32_t phoneDevice = (mPhoneState == AudioSystem::MODE_IN_CALL) ?
+            mDeviceForStrategy[STRATEGY_PHONE] : 0;
+    uint32_t slot = ((mAvailableOutputDevices ^ phoneDevice) * 0x9e3779b1 ^ state) * 0x9e3779b1;
+    DeviceDecision &decision = mDecisions[slot >> (32 - DEVICE_DECISION_BITS)];
+
+    if (decision.mState == state && decision.mDevices == mAvailableOutputDevices &&
+        decision.mPhoneDevice == phoneDevice) {
+        mDecisionHits++;
+        return decision.mDevice;
+    }
+
+    mDecisionMisses++;
+    uint32_t device = computeDeviceForStrategy(strategy);
+    decision.mState = state;
+    decision.mDevices = mAvailableOutputDevices;
+    decision.mPhoneDevice = phoneDevice;
+    decision.mDevice = device;
+    return device;
+}
+
+uint32_t AudioPolicyManager::computeDeviceForStrategy(routing_strategy strategy)
+{
+    uint32_t device = 0;
+
     switch (strategy) {
     case STRATEGY_DTMF:
         if (!isInCall()) {
@@ -227,6 +274,58 @@ uint32_t AudioPolicyManager::getDeviceForStrategy(routing_strategy strategy, boo
 }
 
 
+status_t AudioPolicyManager::dump(int fd)
+{
+    char buffer[256];
+    String8 result;
+
+    AudioPolicyManagerBase::dump(fd);
+
+    snprintf(buffer, sizeof(buffer), "Device decisions: %u hits, %u misses\n",
+             mDecisionHits, mDecisionMisses);
+    result.append(buffer);
+    write(fd, result.string(), result.size());
+    return NO_ERROR;
+}
+
+const alsa_shared_state_t *AudioPolicyManager::halState()
+{
+    if (mHalStateResolved)
+        return mHalState;
+
+    // The HAL is already loaded by AudioFlinger, this only takes a reference
+    void *lib = dlopen(ALSA_SHARED_STATE_LIBRARY, RTLD_NOW);
+    if (lib != NULL)
+        mHalState = (const alsa_shared_state_t *)dlsym(lib, ALSA_SHARED_STATE_SYMBOL);
+    if (mHalState == NULL)
+        LOGW("halState: %s not found in %s, using getParameters()",
+             ALSA_SHARED_STATE_SYMBOL, ALSA_SHARED_STATE_LIBRARY);
+    mHalStateResolved = true;
+    return mHalState;
+}
+
+int32_t AudioPolicyManager::halValue(alsa_state_key key)
+{
+    int32_t generation = android_atomic_acquire_load(&mHalState->generation);
+
+    if (generation != mHalGeneration) {
+        for (int i = 0; i < ALSA_STATE_MAX; i++)
+            mHalValues[i] = mHalState->values[i];
+        mHalGeneration = generation;
+    }
+    return mHalValues[key];
+}
+
+bool AudioPolicyManager::bluetoothVGS()
+{
+    if (halState() != NULL)
+        return halValue(ALSA_STATE_BT_HEADSET_VGS) != 0;
+
+    AudioParameter result(mpClientInterface->getParameters(0, String8(BTHEADSET_VGS_KEY)));
+    int value;
+    return result.getInt(String8("isVGS"), value) == NO_ERROR;
+}
+
 status_t AudioPolicyManager::setDeviceConnectionState(AudioSystem::audio_devices device,
                                                       AudioSystem::device_connection_state state,
                                                       const char *device_address)
@@ -352,6 +451,8 @@ status_t AudioPolicyManager::setDeviceConnectionState(AudioSystem::audio_devices
         AudioPolicyManagerBase::checkOutputForAllStrategies();
         // A2DP outputs must be closed after checkOutputForAllStrategies() is executed
         if (state == AudioSystem::DEVICE_STATE_UNAVAILABLE && AudioSystem::isA2dpDevice(device)) {
+            mPendingRoutes.removeItem(mA2dpOutput);
+            mPendingRoutes.removeItem(mDuplicatedOutput);
             AudioPolicyManagerBase::closeA2dpOutputs();
         }
 #endif
@@ -642,6 +743,7 @@ void AudioPolicyManager::releaseSession(audio_io_handle_t output)
     AudioPolicyManager::stopOutput(output, mLPAStreamType);
     delete mOutputs.valueAt(index);
     mOutputs.removeItem(output);
+    mPendingRoutes.removeItem(output);
     mLPADecodeOutput = -1;
     mLPAActiveOuput = -1;
     mLPAStreamType = AudioSystem::DEFAULT;
@@ -650,6 +752,14 @@ void AudioPolicyManager::releaseSession(audio_io_handle_t output)
 }
 #endif
 
+void AudioPolicyManager::releaseOutput(audio_io_handle_t output)
+{
+    AudioPolicyManagerBase::releaseOutput(output);
+    // Only direct outputs are closed here, the others stay routed
+    if (mOutputs.indexOfKey(output) < 0)
+        mPendingRoutes.removeItem(output);
+}
+
 status_t AudioPolicyManager::startOutput(audio_io_handle_t output, AudioSystem::stream_type stream, int session)
 {
     LOGV("startOutput() output %d, stream %d", output, stream);
@@ -661,6 +771,7 @@ status_t AudioPolicyManager::startOutput(audio_io_handle_t output, AudioSystem::
 
     AudioOutputDescriptor *outputDesc = mOutputs.valueAt(index);
     routing_strategy strategy = getStrategy((AudioSystem::stream_type)stream);
+    bool idle = (outputDesc->refCount() == 0);
 
 #ifdef WITH_A2DP
     if (mA2dpOutput != 0  && !a2dpUsedForSonification() &&
@@ -680,6 +791,10 @@ status_t AudioPolicyManager::startOutput(audio_io_handle_t output, AudioSystem::
 #endif
         setOutputDevice(output, AudioPolicyManagerBase::getNewDevice(output), true);
 
+    if (idle) {
+        sendPrewarm(output, true);
+    }
+
     // handle special case for sonification while in call
     if (isInCall()) {
         AudioPolicyManagerBase::handleIncallSonification(stream, true, false);
@@ -691,6 +806,17 @@ status_t AudioPolicyManager::startOutput(audio_io_handle_t output, AudioSystem::
     return NO_ERROR;
 }
 
+void AudioPolicyManager::sendPrewarm(audio_io_handle_t output, bool on)
+{
+    // Other outputs are A2DP or duplicated, not ALSA PCMs
+    if (output != mHardwareOutput)
+        return;
+
+    AudioParameter param;
+    param.addInt(String8(STREAM_PREWARM_KEY), on);
+    mpClientInterface->setParameters(output, param.toString());
+}
+
 status_t AudioPolicyManager::stopOutput(audio_io_handle_t output, AudioSystem::stream_type stream, int session)
 {
     LOGV("stopOutput() output %d, stream %d", output, stream);
@@ -727,6 +853,10 @@ status_t AudioPolicyManager::stopOutput(audio_io_handle_t output, AudioSystem::s
 
         setOutputDevice(output, newDevice);
 
+        if (outputDesc->refCount() == 0) {
+            sendPrewarm(output, false);
+        }
+
 #ifdef WITH_A2DP
         if (mA2dpOutput != 0 && !a2dpUsedForSonification() &&
                 (strategy == STRATEGY_SONIFICATION || strategy == STRATEGY_ENFORCED_AUDIBLE)) {
@@ -794,6 +924,8 @@ void AudioPolicyManager::setOutputDevice(audio_io_handle_t output, uint32_t devi
     }
 
     outputDesc->mDevice = device;
+    int waitMs = 0;
+    bool muted = false;
     // mute media streams if both speaker and headset are selected
     if (device == (AudioSystem::DEVICE_OUT_SPEAKER | AudioSystem::DEVICE_OUT_WIRED_HEADSET)
         || device == (AudioSystem::DEVICE_OUT_SPEAKER | AudioSystem::DEVICE_OUT_ANC_HEADSET)
@@ -817,8 +949,9 @@ void AudioPolicyManager::setOutputDevice(audio_io_handle_t output, uint32_t devi
             LOGV("setOutputDevice: Muting mHardwareOutput:%d",mHardwareOutput);
             setStrategyMute(STRATEGY_MEDIA, true, mHardwareOutput);
         }
-        // wait for the PCM output buffers to empty before proceeding with the rest of the command
-        usleep(outputDesc->mLatency*2*1000);
+        // the PCM output buffers must empty before the rest of the command runs
+        waitMs = outputDesc->mLatency*2;
+        muted = true;
     }
 
     // wait for output buffers to be played on the HDMI device before routing to new device
@@ -827,16 +960,21 @@ void AudioPolicyManager::setOutputDevice(audio_io_handle_t output, uint32_t devi
         if((mLPADecodeOutput != -1 && output == mLPADecodeOutput &&
             mOutputs.valueFor(mLPADecodeOutput)->isUsedByStrategy(STRATEGY_MEDIA))) {
             checkAndSetVolume(AudioSystem::MUSIC, mStreams[AudioSystem::MUSIC].mIndexCur, mLPADecodeOutput, device, delayMs, force);
-            usleep(150*1000);
+            waitMs += 150;
         } else {
 #endif
             checkAndSetVolume(AudioSystem::MUSIC, mStreams[AudioSystem::MUSIC].mIndexCur, output, device, delayMs, force);
-            usleep(outputDesc->mLatency*6*1000);
+            waitMs += outputDesc->mLatency*6;
 #ifdef WITH_QCOM_LPA
         }
 #endif
     }
 
+    // the rest runs as delayed commands so that the policy thread does not
+    // sleep through the wait
+    delayMs = scheduleRoute(output, delayMs, waitMs, muted);
+    LOGV("setOutputDevice() output %d routing to %x in %d ms", output, device, delayMs);
+
     // do the routing
     AudioParameter param = AudioParameter();
     param.addInt(String8(AudioParameter::keyRouting), (int)device);
@@ -879,6 +1017,105 @@ void AudioPolicyManager::setOutputDevice(audio_io_handle_t output, uint32_t devi
     }
 }
 
+/*
+ * Delay from now at which the routing command for output should run:
+ * waitMs after delayMs. A route still pending on the output keeps its slot
+ * if it had muted media already or this one has nothing to wait for, so
+ * quick successive changes collapse onto one switch instead of pushing it
+ * out. A later route never runs ahead of an earlier one. Routing commands
+ * that land together are merged by the HAL routing thread.
+ */
+int AudioPolicyManager::scheduleRoute(audio_io_handle_t output, int delayMs, int waitMs, bool muted)
+{
+    nsecs_t now = systemTime();
+    nsecs_t time = now + milliseconds(delayMs + waitMs);
+    ssize_t index = mPendingRoutes.indexOfKey(output);
+
+    if (index >= 0 && mPendingRoutes.valueAt(index).mTime > now) {
+        const PendingRoute &pending = mPendingRoutes.valueAt(index);
+        nsecs_t earliest = now + milliseconds(delayMs);
+
+        if (pending.mMuted || waitMs == 0)
+            time = pending.mTime > earliest ? pending.mTime : earliest;
+        else if (time < pending.mTime)
+            time = pending.mTime;
+        muted = muted || pending.mMuted;
+        LOGV("scheduleRoute() output %d joins route pending in %d ms", output,
+             ns2ms(pending.mTime - now));
+    }
+
+    PendingRoute route;
+    route.mTime = time;
+    route.mMuted = muted;
+    mPendingRoutes.add(output, route);
+    return ns2ms(time - now);
+}
+
+int AudioPolicyManager::volumePercent(int stream, int index)
+{
+    StreamDescriptor &streamDesc = mStreams[stream];
+
+    return (VOLUME_STEPS * (index - streamDesc.mIndexMin)) /
+           (streamDesc.mIndexMax - streamDesc.mIndexMin);
+}
+
+alsa_volume_device AudioPolicyManager::volumeDevice(audio_io_handle_t output, uint32_t device)
+{
+    if (device == 0)
+        device = mOutputs.valueFor(output)->device();
+    return ALSAVolumeCurves::deviceForOutput(device);
+}
+
+float AudioPolicyManager::computeVolume(int stream, int index, audio_io_handle_t output, uint32_t device)
+{
+    AudioOutputDescriptor *outputDesc = mOutputs.valueFor(output);
+    StreamDescriptor &streamDesc = mStreams[stream];
+    float volume;
+
+    if (device == 0) {
+        device = outputDesc->device();
+    }
+
+    // if volume is not 0 (not muted), force media volume to max on digital output
+    if (stream == AudioSystem::MUSIC &&
+        index != streamDesc.mIndexMin &&
+        device == AudioSystem::DEVICE_OUT_AUX_DIGITAL) {
+        return 1.0;
+    }
+
+    volume = mVolumeCurves.value(VOLUME_CURVE_MEDIA, ALSAVolumeCurves::deviceForOutput(device),
+                                 volumePercent(stream, index));
+
+    // if a headset is connected, apply the following rules to ring tones and notifications
+    // to avoid sound level bursts in user's ears:
+    // - always attenuate ring tones and notifications volume by 6dB
+    // - if music is playing, always limit the volume to current music volume,
+    // with a minimum threshold at -36dB so that notification is always perceived.
+    if ((device &
+        (AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP |
+        AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP_HEADPHONES |
+        AudioSystem::DEVICE_OUT_WIRED_HEADSET |
+        AudioSystem::DEVICE_OUT_WIRED_HEADPHONE)) &&
+        ((getStrategy((AudioSystem::stream_type)stream) == STRATEGY_SONIFICATION) ||
+         (stream == AudioSystem::SYSTEM)) &&
+        streamDesc.mCanBeMuted) {
+        volume *= SONIFICATION_HEADSET_VOLUME_FACTOR;
+        // when the phone is ringing we must consider that music could have been paused just before
+        // by the music application and behave as if music was active if the last music track was
+        // just stopped
+        if (outputDesc->mRefCount[AudioSystem::MUSIC] || mLimitRingtoneVolume) {
+            float musicVol = computeVolume(AudioSystem::MUSIC, mStreams[AudioSystem::MUSIC].mIndexCur, output, device);
+            float minVol = (musicVol > SONIFICATION_HEADSET_VOLUME_MIN) ? musicVol : SONIFICATION_HEADSET_VOLUME_MIN;
+            if (volume > minVol) {
+                volume = minVol;
+                LOGV("computeVolume limiting volume to %f musicVol %f", minVol, musicVol);
+            }
+        }
+    }
+
+    return volume;
+}
+
 status_t AudioPolicyManager::checkAndSetVolume(int stream, int index, audio_io_handle_t output, uint32_t device, int delayMs, bool force)
 {
 #ifdef WITH_QCOM_LPA
@@ -913,17 +1150,12 @@ status_t AudioPolicyManager::checkAndSetVolume(int stream, int index, audio_io_h
             stream == AudioSystem::DTMF ||
             stream == AudioSystem::BLUETOOTH_SCO) {
             float voiceVolume = -1.0;
-            // offset value to reflect actual hardware volume that never reaches 0
-            // 1% corresponds roughly to first step in VOICE_CALL stream volume setting (see AudioService.java)
-            volume = 0.01 + 0.99 * volume;
+            volume = mVolumeCurves.value(VOLUME_CURVE_CALL, volumeDevice(output, device),
+                                         volumePercent(stream, index));
             if (stream == AudioSystem::VOICE_CALL) {
                 voiceVolume = (float)index/(float)mStreams[stream].mIndexMax;
             } else if (stream == AudioSystem::BLUETOOTH_SCO) {
-                String8 key ("bt_headset_vgs");
-                mpClientInterface->getParameters(output,key);
-                AudioParameter result(mpClientInterface->getParameters(0,key));
-                int value;
-                if(result.getInt(String8("isVGS"),value) == NO_ERROR){
+                if (bluetoothVGS()) {
                    LOGD("BT-SCO Voice Volume %f",(float)index/(float)mStreams[stream].mIndexMax);
                    voiceVolume = 1.0;
                 } else {
@@ -17,11 +17,14 @@
 
 
 #include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 #include <utils/Timers.h>
 #include <utils/Errors.h>
 #include <utils/KeyedVector.h>
 #include <hardware_legacy/AudioPolicyManagerBase.h>
+#include "ALSASharedState.h"
+#include "ALSAVolume.h"
 
 
 namespace android_audio_legacy {
@@ -36,12 +39,25 @@ namespace android_audio_legacy {
 // Time in seconds during which we consider that music is still active after a music
 // track was stopped - see computeVolume()
 #define SONIFICATION_HEADSET_MUSIC_DELAY  5
+// getDeviceForStrategy() memo, 1 << DEVICE_DECISION_BITS entries
+#define DEVICE_DECISION_BITS 6
+#define DEVICE_DECISION_VALID 0x80000000
+// HAL parameter asked when the shared state is not exported
+#define BTHEADSET_VGS_KEY "bt_headset_vgs"
+// Output parameter, 1 when the output is about to start, 0 once it stopped
+#define STREAM_PREWARM_KEY "prewarm"
 class AudioPolicyManager: public AudioPolicyManagerBase
 {
 
 public:
                 AudioPolicyManager(AudioPolicyClientInterface *clientInterface)
-                : AudioPolicyManagerBase(clientInterface) {
+                : AudioPolicyManagerBase(clientInterface),
+                  mDecisionHits(0),
+                  mDecisionMisses(0),
+                  mHalState(NULL),
+                  mHalStateResolved(false),
+                  mHalGeneration(-1) {
+                    memset(mDecisions, 0, sizeof(mDecisions));
 #ifdef WITH_QCOM_LPA
                     mLPADecodeOutput = -1;
                     mLPAMuted = false;
@@ -69,6 +85,8 @@ public:
         //  before updateDeviceForStrategy() is called.
         virtual uint32_t getDeviceForStrategy(routing_strategy strategy, bool fromCache = true);
 
+        virtual status_t dump(int fd);
+
 #ifdef WITH_QCOM_LPA
         virtual audio_io_handle_t getSession(AudioSystem::stream_type stream,
                                             uint32_t format,
@@ -79,6 +97,7 @@ public:
         virtual void releaseSession(audio_io_handle_t output);
 #endif
 
+        virtual void releaseOutput(audio_io_handle_t output);
         virtual status_t startOutput(audio_io_handle_t output, AudioSystem::stream_type stream, int session = 0);
         virtual status_t stopOutput(audio_io_handle_t output, AudioSystem::stream_type stream, int session = 0);
         virtual void setForceUse(AudioSystem::force_use usage, AudioSystem::forced_config config);
@@ -93,6 +112,22 @@ protected:
 #endif
         // change the route of the specified output
         void setOutputDevice(audio_io_handle_t output, uint32_t device, bool force = false, int delayMs = 0);
+        // uncached device selection behind getDeviceForStrategy()
+        uint32_t computeDeviceForStrategy(routing_strategy strategy);
+        uint32_t decisionState(routing_strategy strategy);
+        // HAL state published through ALSASharedState.h, NULL if the HAL
+        // does not export it and the string parameters must be used
+        const alsa_shared_state_t *halState();
+        int32_t halValue(alsa_state_key key);
+        bool bluetoothVGS();
+        // let the HAL open the hardware output's PCM ahead of the first write
+        void sendPrewarm(audio_io_handle_t output, bool on);
+        // delay for the routing command of a device change, see setOutputDevice()
+        int scheduleRoute(audio_io_handle_t output, int delayMs, int waitMs, bool muted);
+        int volumePercent(int stream, int index);
+        alsa_volume_device volumeDevice(audio_io_handle_t output, uint32_t device);
+        // compute the volume for a stream index from mVolumeCurves
+        virtual float computeVolume(int stream, int index, audio_io_handle_t output, uint32_t device);
         // check that volume change is permitted, compute and send new volume to audio hardware
         status_t checkAndSetVolume(int stream, int index, audio_io_handle_t output, uint32_t device, int delayMs = 0, bool force = false);
         // select input device corresponding to requested audio source
@@ -107,5 +142,32 @@ protected:
         AudioSystem::stream_type  mLPAStreamType;
         AudioSystem::stream_type  mLPAActiveStreamType;
 #endif
+
+        // getDeviceForStrategy() results keyed on all of their inputs, so
+        // an entry is only replaced once one of those inputs changes
+        struct DeviceDecision {
+            uint32_t mState;        // decisionState(), 0 for an empty entry
+            uint32_t mDevices;      // mAvailableOutputDevices
+            uint32_t mPhoneDevice;  // phone device, in call only
+            uint32_t mDevice;
+        };
+        DeviceDecision mDecisions[1 << DEVICE_DECISION_BITS];
+        uint32_t mDecisionHits;
+        uint32_t mDecisionMisses;
+
+        // last routing command issued per output, dropped when it closes
+        struct PendingRoute {
+            nsecs_t mTime;      // when it runs
+            bool    mMuted;     // media was muted ahead of it
+        };
+        KeyedVector<audio_io_handle_t, PendingRoute> mPendingRoutes;
+
+        // copy of the HAL shared state as of mHalGeneration
+        const alsa_shared_state_t *mHalState;
+        bool mHalStateResolved;
+        int32_t mHalGeneration;
+        int32_t mHalValues[ALSA_STATE_MAX];
+
+        ALSAVolumeCurves mVolumeCurves;
 };
 };
@@ -18,6 +18,7 @@
 
 #include <errno.h>
 #include <stdarg.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -33,25 +34,46 @@
 #include <cutils/properties.h>
 #include <media/AudioRecord.h>
 #include <hardware_legacy/power.h>
+#include <audio_effects/effect_aec.h>
 
 #include "AudioHardwareALSA.h"
 
 namespace android_audio_legacy
 {
 
+static ALSAObjectPool<sizeof(AudioStreamInALSA), ALSA_STREAM_POOL_SIZE> sStreamPool;
+
 AudioStreamInALSA::AudioStreamInALSA(AudioHardwareALSA *parent,
         alsa_handle_t *handle,
         AudioSystem::audio_in_acoustics audio_acoustics) :
     ALSAStreamOps(parent, handle),
     mFramesLost(0),
     mParent(parent),
-    mAcoustics(audio_acoustics)
+    mAcoustics(audio_acoustics),
+    mAecEffect(NULL),
+    mCaptureTime(0),
+    mCaptureFrames(0),
+    mEchoRefBuffer(NULL),
+    mEchoRefBufferSize(0)
 {
 }
 
 AudioStreamInALSA::~AudioStreamInALSA()
 {
     close();
+    if (mAecEffect != NULL)
+        mParent->mEchoRef.stop();
+    free(mEchoRefBuffer);
+}
+
+void *AudioStreamInALSA::operator new(size_t size)
+{
+    return sStreamPool.alloc(size);
+}
+
+void AudioStreamInALSA::operator delete(void *ptr)
+{
+    sStreamPool.release(ptr);
 }
 
 status_t AudioStreamInALSA::setGain(float gain)
@@ -68,111 +90,91 @@ ssize_t AudioStreamInALSA::read(void *buffer, ssize_t bytes)
     int n;
     status_t          err;
     size_t            read = 0;
-    char *use_case;
     int newMode = mParent->mode();
 
+    ALSA_TRACE_SCOPE("in_read");
+    ALSAMutex::Autolock ioLock(mIoLock);
+    nsecs_t start = systemTime();
+
     if((mHandle->handle == NULL) && (mHandle->rxHandle == NULL) &&
-         (strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) &&
-         (strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP))) {
-        mParent->mLock.lock();
-        snd_use_case_get(mHandle->ucMgr, "_verb", (const char **)&use_case);
-        if ((use_case != NULL) && (strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
-            if ((mHandle->devices == AudioSystem::DEVICE_IN_VOICE_CALL) &&
-                (newMode == AudioSystem::MODE_IN_CALL)) {
-                LOGD("read:: mParent->mIncallMode=%d", mParent->mIncallMode);
-                if ((mParent->mIncallMode & AudioSystem::CHANNEL_IN_VOICE_UPLINK) &&
-                    (mParent->mIncallMode & AudioSystem::CHANNEL_IN_VOICE_DNLINK)) {
-                    strlcpy(mHandle->useCase, SND_USE_CASE_MOD_CAPTURE_VOICE_UL_DL,
-                            sizeof(mHandle->useCase));
-                } else if (mParent->mIncallMode & AudioSystem::CHANNEL_IN_VOICE_DNLINK) {
-                    strlcpy(mHandle->useCase, SND_USE_CASE_MOD_CAPTURE_VOICE_DL,
-                            sizeof(mHandle->useCase));
-                }
-            } else if(mHandle->devices == AudioSystem::DEVICE_IN_FM_RX) {
-                strlcpy(mHandle->useCase, SND_USE_CASE_MOD_CAPTURE_FM, sizeof(mHandle->useCase));
-            } else if (mHandle->devices == AudioSystem::DEVICE_IN_FM_RX_A2DP) {
-                strlcpy(mHandle->useCase, SND_USE_CASE_MOD_CAPTURE_A2DP_FM, sizeof(mHandle->useCase));
-            } else if(!strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP)) {
-                strcpy(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP);
-            }else {
-                strlcpy(mHandle->useCase, SND_USE_CASE_MOD_CAPTURE_MUSIC, sizeof(mHandle->useCase));
+         !useCaseIs(mHandle->useCase, UC_VOIP)) {
+        ALSARWLock::AutoWLock routeLock(mParent->mRouteLock);
+        alsa_use_case_t useCase = mHandle->useCase;
+        if ((mHandle->devices == AudioSystem::DEVICE_IN_VOICE_CALL) &&
+            (newMode == AudioSystem::MODE_IN_CALL)) {
+            LOGD("read:: mParent->mIncallMode=%d", mParent->mIncallMode);
+            if ((mParent->mIncallMode & AudioSystem::CHANNEL_IN_VOICE_UPLINK) &&
+                (mParent->mIncallMode & AudioSystem::CHANNEL_IN_VOICE_DNLINK)) {
+                useCase = USE_CASE_VERB_UL_DL_REC;
+            } else if (mParent->mIncallMode & AudioSystem::CHANNEL_IN_VOICE_DNLINK) {
+                useCase = USE_CASE_VERB_DL_REC;
             }
-        } else {
-            if ((mHandle->devices == AudioSystem::DEVICE_IN_VOICE_CALL) &&
-                (newMode == AudioSystem::MODE_IN_CALL)) {
-                LOGD("read:: ---- mParent->mIncallMode=%d", mParent->mIncallMode);
-                if ((mParent->mIncallMode & AudioSystem::CHANNEL_IN_VOICE_UPLINK) &&
-                    (mParent->mIncallMode & AudioSystem::CHANNEL_IN_VOICE_DNLINK)) {
-                    strlcpy(mHandle->useCase, SND_USE_CASE_VERB_UL_DL_REC, sizeof(mHandle->useCase));
-                } else if (mParent->mIncallMode & AudioSystem::CHANNEL_IN_VOICE_DNLINK) {
-                    strlcpy(mHandle->useCase, SND_USE_CASE_VERB_DL_REC, sizeof(mHandle->useCase));
-                }
-            } else if(mHandle->devices == AudioSystem::DEVICE_IN_FM_RX) {
-                strlcpy(mHandle->useCase, SND_USE_CASE_VERB_FM_REC, sizeof(mHandle->useCase));
+        } else if(mHandle->devices == AudioSystem::DEVICE_IN_FM_RX) {
+            useCase = USE_CASE_VERB_FM_REC;
         } else if (mHandle->devices == AudioSystem::DEVICE_IN_FM_RX_A2DP) {
-                strlcpy(mHandle->useCase, SND_USE_CASE_VERB_FM_A2DP_REC, sizeof(mHandle->useCase));
-            } else if(!strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)){
-                    strcpy(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL);
-            } else {
-                strlcpy(mHandle->useCase, SND_USE_CASE_VERB_HIFI_REC, sizeof(mHandle->useCase));
-            }
-        }
-        free(use_case);
-        if((!strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) ||
-            (!strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP))) {
-                mHandle->module->route(mHandle, mDevices , AudioSystem::MODE_IN_COMMUNICATION);
+            useCase = USE_CASE_VERB_FM_A2DP_REC;
         } else {
-                mHandle->module->route(mHandle, mDevices , mParent->mode());
+            useCase = USE_CASE_VERB_HIFI_REC;
         }
-        if (!strcmp(mHandle->useCase, SND_USE_CASE_VERB_HIFI_REC) ||
-            !strcmp(mHandle->useCase, SND_USE_CASE_VERB_FM_REC) ||
-            !strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL) ||
-            !strcmp(mHandle->useCase, SND_USE_CASE_VERB_FM_A2DP_REC) ||
-            !strcmp(mHandle->useCase, SND_USE_CASE_VERB_UL_DL_REC) ||
-            !strcmp(mHandle->useCase, SND_USE_CASE_VERB_DL_REC)) {
-            snd_use_case_set(mHandle->ucMgr, "_verb", mHandle->useCase);
-        } else {
-            snd_use_case_set(mHandle->ucMgr, "_enamod", mHandle->useCase);
-        }
-       if((!strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) ||
-           (!strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP))) {
-            err = mHandle->module->startVoipCall(mHandle);
-        }
-        else
-            mHandle->module->open(mHandle);
+        mParent->mDeviceList.setUseCase(mHandle,
+                useCaseFor(useCase, useCaseVerbInactive(mHandle->ucMgr)));
+        mHandle->module->route(mHandle, mDevices , mParent->mode());
+        useCaseEnable(mHandle->ucMgr, mHandle->useCase);
+        mHandle->module->open(mHandle);
         if(mHandle->handle == NULL) {
             LOGE("read:: PCM device open failed");
-            mParent->mLock.unlock();
-
+            mStats.xrun(ALSAStreamStats::XRUN_FAILED);
             return 0;
         }
-        mParent->mLock.unlock();
+        mStats.opened();
     }
 
-    period_size = mHandle->periodSize;
+    // VoIP strides through the caller's buffer in its own open-time periods
+    period_size = useCaseIs(mHandle->useCase, UC_VOIP) ? mVoipPeriod : mHandle->periodSize;
+    if (bytes < period_size) {
+        LOGE("read: %d bytes is less than one %d byte period", bytes, period_size);
+        return BAD_VALUE;
+    }
     int read_pending = bytes;
     do {
         if (read_pending < period_size) {
             read_pending = period_size;
         }
 
-        n = pcm_read(mHandle->handle, buffer,
-            period_size);
+        if (useCaseIs(mHandle->useCase, UC_VOIP)) {
+            // Keep a rate switch from reconfiguring the PCM under the read
+            ALSARWLock::AutoRLock routeLock(mParent->mRouteLock);
+            ALSA_TRACE_BEGIN("pcm_read");
+            if (voipResampling() && mHandle->periodSize <= sizeof(mVoipBuffer)) {
+                n = pcm_read(mHandle->handle, mVoipBuffer, mHandle->periodSize);
+                if (n == 0)
+                    resampleVoip(mVoipBuffer, mHandle->periodSize, buffer, period_size);
+            } else {
+                n = pcm_read(mHandle->handle, buffer, period_size);
+            }
+            ALSA_TRACE_END();
+        } else {
+            ALSA_TRACE_BEGIN("pcm_read");
+            n = pcm_read(mHandle->handle, buffer,
+                period_size);
+            ALSA_TRACE_END();
+        }
+        ALSA_TRACE_DELAY("in_delay", mHandle->handle);
         LOGV("pcm_read() returned n = %d", n);
         if (n && (n == -EIO || n == -EAGAIN || n == -EPIPE || n == -EBADFD)) {
-            mParent->mLock.lock();
+            ALSARWLock::AutoWLock routeLock(mParent->mRouteLock);
             LOGW("pcm_read() returned error n %d, Recovering from error\n", n);
             pcm_close(mHandle->handle);
             mHandle->handle = NULL;
-            if((!strncmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL, strlen(SND_USE_CASE_VERB_IP_VOICECALL))) ||
-              (!strncmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP, strlen(SND_USE_CASE_MOD_PLAY_VOIP)))) {
+            if (useCaseIs(mHandle->useCase, UC_VOIP)) {
                  pcm_close(mHandle->rxHandle);
                  mHandle->rxHandle = NULL;
                  mHandle->module->startVoipCall(mHandle);
             }
             else
                  mHandle->module->open(mHandle);
-            mParent->mLock.unlock();
+            mStats.xrun(mHandle->handle ?
+                        ALSAStreamStats::XRUN_REOPENED : ALSAStreamStats::XRUN_FAILED);
             continue;
         }
         else if (n < 0) {
@@ -180,23 +182,123 @@ ssize_t AudioStreamInALSA::read(void *buffer, ssize_t bytes)
             return static_cast<ssize_t>(n);
         }
         else {
+            if (mTap != 0)
+                mTap->write(buffer, period_size);
             read += static_cast<ssize_t>((period_size));
             read_pending -= period_size;
         }
 
     } while (mHandle->handle && read < bytes);
 
+    mStats.transferred(mHandle->handle, read / (mHandle->channels * sizeof(int16_t)),
+                       systemTime() - start);
+    if (mAecEffect != NULL && read > 0) {
+        stampCapture(read);
+        pushEchoReference();
+    }
     return read;
 }
 
+/*
+ * Capture time of the first frame of the buffer read() just returned:
+ * DELAY counts what the DSP captured and we have not read yet.
+ */
+void AudioStreamInALSA::stampCapture(size_t bytes)
+{
+    uint32_t channels = mHandle->channels ? mHandle->channels : 1;
+    snd_pcm_sframes_t delay = 0;
+    nsecs_t now = systemTime();
+
+    mCaptureFrames = bytes / (channels * sizeof(int16_t));
+    if (!mHandle->handle || ioctl(mHandle->handle->fd, SNDRV_PCM_IOCTL_DELAY, &delay))
+        delay = 0;
+    mCaptureTime = now - ((nsecs_t)delay + mCaptureFrames) * 1000000000LL / mHandle->sampleRate;
+}
+
+/*
+ * Give the AEC the reference that was playing while the frames read()
+ * just returned were captured, before AudioFlinger runs the preprocessing
+ * chain on them. Frames with nothing played at that time are silence.
+ */
+void AudioStreamInALSA::pushEchoReference()
+{
+    uint32_t channels = mHandle->channels ? mHandle->channels : 1;
+    size_t bytes = mCaptureFrames * channels * sizeof(int16_t);
+    audio_buffer_t buf;
+
+    if ((*mAecEffect)->process_reverse == NULL)
+        return;
+    if (mEchoRefBufferSize < bytes) {
+        int16_t *p = (int16_t *)realloc(mEchoRefBuffer, bytes);
+        if (p == NULL) {
+            LOGE("pushEchoReference: no memory for %d byte reference", bytes);
+            return;
+        }
+        mEchoRefBuffer = p;
+        mEchoRefBufferSize = bytes;
+    }
+
+    mParent->mEchoRef.read(mEchoRefBuffer, mCaptureFrames, mHandle->sampleRate, mCaptureTime);
+    // The ring is mono, widen from the back so nothing is overwritten early
+    for (size_t i = mCaptureFrames; channels > 1 && i-- > 0; ) {
+        int16_t sample = mEchoRefBuffer[i];
+        for (uint32_t c = 0; c < channels; c++)
+            mEchoRefBuffer[i * channels + c] = sample;
+    }
+
+    buf.frameCount = mCaptureFrames;
+    buf.s16 = mEchoRefBuffer;
+    (*mAecEffect)->process_reverse(mAecEffect, &buf, NULL);
+}
+
+status_t AudioStreamInALSA::addAudioEffect(effect_handle_t effect)
+{
+    effect_descriptor_t desc;
+
+    if ((*effect)->get_descriptor(effect, &desc) != 0 ||
+        memcmp(&desc.type, FX_IID_AEC, sizeof(effect_uuid_t)))
+        return BAD_VALUE;
+
+    ALSAMutex::Autolock ioLock(mIoLock);
+    LOGD("addAudioEffect: AEC fed from the echo reference");
+    if (mAecEffect == NULL)
+        mParent->mEchoRef.start();
+    mAecEffect = effect;
+    mCaptureFrames = 0;
+    return NO_ERROR;
+}
+
+status_t AudioStreamInALSA::removeAudioEffect(effect_handle_t effect)
+{
+    ALSAMutex::Autolock ioLock(mIoLock);
+
+    if (mAecEffect == NULL || effect != mAecEffect)
+        return BAD_VALUE;
+    LOGD("removeAudioEffect: AEC detached");
+    mParent->mEchoRef.stop();
+    mAecEffect = NULL;
+    return NO_ERROR;
+}
+
 status_t AudioStreamInALSA::dump(int fd, const Vector<String16>& args)
 {
+    String8 result("AudioStreamInALSA locks:\n");
+
+    mIoLock.stats().dump(result);
+    {
+        ALSARWLock::AutoRLock routeLock(mParent->mRouteLock);
+        mStats.dump(result, mHandle);
+    }
+    dumpTap(result);
+    mParent->mEchoRef.dump(result);
+    ::write(fd, result.string(), result.size());
     return NO_ERROR;
 }
 
 status_t AudioStreamInALSA::open(int mode)
 {
-    Mutex::Autolock autoLock(mParent->mLock);
+    ALSAMutex::Autolock ioLock(mIoLock);
+    ALSARWLock::AutoWLock routeLock(mParent->mRouteLock);
 
     status_t status = ALSAStreamOps::open(mode);
 
@@ -205,10 +307,10 @@ status_t AudioStreamInALSA::open(int mode)
 
 status_t AudioStreamInALSA::close()
 {
-    Mutex::Autolock autoLock(mParent->mLock);
+    ALSAMutex::Autolock ioLock(mIoLock);
+    ALSARWLock::AutoWLock routeLock(mParent->mRouteLock);
 
-    if((!strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) ||
-        (!strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP))) {
+    if (useCaseIs(mHandle->useCase, UC_VOIP)) {
 
         if((mParent->mVoipStreamCount)) {
                return NO_ERROR;
@@ -225,10 +327,10 @@ status_t AudioStreamInALSA::close()
 
 status_t AudioStreamInALSA::standby()
 {
-    Mutex::Autolock autoLock(mParent->mLock);
+    ALSAMutex::Autolock ioLock(mIoLock);
+    ALSARWLock::AutoWLock routeLock(mParent->mRouteLock);
 
-    if((!strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) ||
-        (!strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP))) {
+    if (useCaseIs(mHandle->useCase, UC_VOIP)) {
          return NO_ERROR;
     }
 
@@ -255,7 +357,7 @@ unsigned int AudioStreamInALSA::getInputFramesLost() const
 
 status_t AudioStreamInALSA::setAcousticParams(void *params)
 {
-    Mutex::Autolock autoLock(mParent->mLock);
+    ALSAMutex::Autolock ioLock(mIoLock);
 
     return (status_t)NO_ERROR;
 }
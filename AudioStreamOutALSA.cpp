@@ -18,6 +18,7 @@
 
 #include <errno.h>
 #include <stdarg.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -31,6 +32,7 @@
 #include <utils/Log.h>
 #include <utils/String8.h>
 
+#include <cutils/atomic.h>
 #include <cutils/properties.h>
 #include <media/AudioRecord.h>
 #include <hardware_legacy/power.h>
@@ -47,19 +49,48 @@ namespace android_audio_legacy
 // ----------------------------------------------------------------------------
 
 static const int DEFAULT_SAMPLE_RATE = ALSA_DEFAULT_SAMPLE_RATE;
+static const int32_t UNITY_GAIN_Q15 = 1 << 15;
+
+static ALSAObjectPool<sizeof(AudioStreamOutALSA), ALSA_STREAM_POOL_SIZE> sStreamPool;
 
 // ----------------------------------------------------------------------------
 
 AudioStreamOutALSA::AudioStreamOutALSA(AudioHardwareALSA *parent, alsa_handle_t *handle) :
     ALSAStreamOps(parent, handle),
     mParent(parent),
-    mFrameCount(0)
+    mFrameCount(0),
+    mRampBuffer(NULL),
+    mRampBufferSize(0),
+    mRampGain(UNITY_GAIN_Q15),
+    mMutedBytes(0),
+    mRouteSeq(handle->routeSeq),
+    mLastWriteTime(0),
+    mRouteGapStart(0),
+    mRouteGapMax(0),
+    mEchoRefToken(ALSAEchoReference::newToken()),
+    mFirstWrite(true),
+    mWarmStarts(0),
+    mWarmStartNs(0),
+    mColdStarts(0),
+    mColdStartNs(0)
 {
 }
 
 AudioStreamOutALSA::~AudioStreamOutALSA()
 {
+    stopJitterBuffer();
     close();
+    free(mRampBuffer);
+}
+
+void *AudioStreamOutALSA::operator new(size_t size)
+{
+    return sStreamPool.alloc(size);
+}
+
+void AudioStreamOutALSA::operator delete(void *ptr)
+{
+    sStreamPool.release(ptr);
 }
 
 uint32_t AudioStreamOutALSA::channels() const
@@ -74,8 +105,7 @@ status_t AudioStreamOutALSA::setVolume(float left, float right)
     float volume;
     status_t status = NO_ERROR;
 
-    if(!strcmp(mHandle->useCase, SND_USE_CASE_VERB_HIFI_LOW_POWER) ||
-       !strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_LPA)) {
+    if (useCaseIs(mHandle->useCase, UC_LPA)) {
         volume = (left + right) / 2;
         if (volume < 0.0) {
             LOGW("AudioSessionOutMSM7xxx::setVolume(%f) under 0.0, assuming 0.0\n", volume);
@@ -84,16 +114,13 @@ status_t AudioStreamOutALSA::setVolume(float left, float right)
             LOGW("AudioSessionOutMSM7xxx::setVolume(%f) over 1.0, assuming 1.0\n", volume);
             volume = 1.0;
         }
-        lpa_vol = lrint((volume * 0x2000)+0.5);
+        lpa_vol = lrint(volume * VOLUME_UNITY);
         LOGD("setLpaVolume(%f)\n", volume);
-        LOGD("Setting LPA volume to %d (available range is 0 to 0x2000)\n", lpa_vol);
-        mHandle->module->setLpaVolume(lpa_vol);
+        mHandle->module->setLpaVolume(mHandle->card, lpa_vol);
 
         return status;
     }
-    else if(!strncmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL,
-            sizeof(mHandle->useCase)) || !strncmp(mHandle->useCase,
-            SND_USE_CASE_MOD_PLAY_VOIP, sizeof(mHandle->useCase))) {
+    else if (useCaseIs(mHandle->useCase, UC_VOIP)) {
         LOGV("Avoid Software volume by returning success\n");
         return status;
     }
@@ -103,7 +130,6 @@ status_t AudioStreamOutALSA::setVolume(float left, float right)
 ssize_t AudioStreamOutALSA::write(const void *buffer, size_t bytes)
 {
     int period_size;
-    char *use_case;
 
     LOGV("write:: buffer %p, bytes %d", buffer, bytes);
 
@@ -113,116 +139,302 @@ ssize_t AudioStreamOutALSA::write(const void *buffer, size_t bytes)
 
     int write_pending = bytes;
 
+    ALSA_TRACE_SCOPE("out_write");
+    ALSAMutex::Autolock ioLock(mIoLock);
+    nsecs_t start = systemTime();
+    bool warm = mHandle->handle != NULL;
+
     if((mHandle->handle == NULL) && (mHandle->rxHandle == NULL) &&
-         (strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) &&
-         (strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP))) {
-        mParent->mLock.lock();
+         !useCaseIs(mHandle->useCase, UC_VOIP)) {
+        ALSARWLock::AutoWLock routeLock(mParent->mRouteLock);
         /* PCM handle might be closed and reopened immediately to flush
          * the buffers, recheck and break if PCM handle is valid */
         if (mHandle->handle == NULL && mHandle->rxHandle == NULL) {
-            snd_use_case_get(mHandle->ucMgr, "_verb", (const char **)&use_case);
-            if ((use_case == NULL) || (!strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
-                 if(!strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)){
-                     strlcpy(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL,sizeof(mHandle->useCase));
-                 }
-                 else {
-                     strlcpy(mHandle->useCase, SND_USE_CASE_VERB_HIFI, sizeof(mHandle->useCase));
-                 }
-            } else {
-                if(!strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP)) {
-                    strlcpy(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP,sizeof(mHandle->useCase));
-                } else {
-                    strlcpy(mHandle->useCase, SND_USE_CASE_MOD_PLAY_MUSIC, sizeof(mHandle->useCase));
-                }
-            }
-            free(use_case);
-            if((!strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) ||
-                (!strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP))) {
-                  mHandle->module->route(mHandle, mDevices , AudioSystem::MODE_IN_COMMUNICATION);
-            } else {
-                  mHandle->module->route(mHandle, mDevices , mParent->mode());
-            }
-            if (!strcmp(mHandle->useCase, SND_USE_CASE_VERB_HIFI) ||
-                !strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) {
-                snd_use_case_set(mHandle->ucMgr, "_verb", mHandle->useCase);
-            } else {
-                snd_use_case_set(mHandle->ucMgr, "_enamod", mHandle->useCase);
-            }
-            if((!strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) ||
-               (!strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP))) {
-                 err = mHandle->module->startVoipCall(mHandle);
-            }
-            else
-                mHandle->module->open(mHandle);
+            openPcm();
             if(mHandle->handle == NULL) {
                 LOGE("write:: device open failed");
-                mParent->mLock.unlock();
+                mStats.xrun(ALSAStreamStats::XRUN_FAILED);
                 return 0;
             }
+            mStats.opened();
         }
-        mParent->mLock.unlock();
     }
 
-    period_size = mHandle->periodSize;
+    // VoIP strides through the caller's buffer in its own open-time periods
+    period_size = useCaseIs(mHandle->useCase, UC_VOIP) ? mVoipPeriod : mHandle->periodSize;
+    if (bytes < (size_t)period_size) {
+        LOGE("write: %d bytes is less than one %d byte period", bytes, period_size);
+        return BAD_VALUE;
+    }
+    // A soft mute switch waits for our ramp until standby
+    android_atomic_release_store(1, &mHandle->playing);
     do {
         if (write_pending < period_size) {
             write_pending = period_size;
         }
         if((mParent->mVoipStreamCount) && (mHandle->rxHandle != 0)) {
-            n = pcm_write(mHandle->rxHandle,
-                     (char *)buffer + sent,
-                      period_size);
+            const void *out = (char *)buffer + sent;
+            size_t outBytes = period_size;
+
+            // Frame size and pitch search are per rate, rebuild after a switch
+            if (mJitterBuffer != 0 && mJitterBuffer->rate() != mHandle->sampleRate)
+                stopJitterBuffer();
+            if (mJitterBuffer == 0 && mParent->mVoipJitterBuffer && mHandle->channels == 1) {
+                mJitterBuffer = new ALSAJitterBuffer(mParent, mHandle);
+                if (mJitterBuffer->initCheck() == NO_ERROR)
+                    mJitterBuffer->run("ALSAJitterBuffer", ANDROID_PRIORITY_URGENT_AUDIO);
+                else
+                    mJitterBuffer.clear();
+            }
+            if (mJitterBuffer != 0) {
+                {
+                    ALSARWLock::AutoRLock routeLock(mParent->mRouteLock);
+                    out = toVoipPcm(out, &outBytes);
+                }
+                n = mJitterBuffer->write(out, outBytes);
+                if (n >= 0 && mTap != 0)
+                    mTap->write((char *)buffer + sent, period_size);
+            } else {
+                // Keep a rate switch from reconfiguring the PCM under the write
+                ALSARWLock::AutoRLock routeLock(mParent->mRouteLock);
+                out = toVoipPcm(out, &outBytes);
+                ALSA_TRACE_BEGIN("pcm_write");
+                n = pcm_write(mHandle->rxHandle, (void *)out, outBytes);
+                ALSA_TRACE_END();
+                ALSA_TRACE_DELAY("out_delay", mHandle->rxHandle);
+                if (n >= 0 && mParent->mEchoRef.active())
+                    mParent->mEchoRef.write(mEchoRefToken, mHandle->rxHandle,
+                            out, outBytes, mHandle->channels, mHandle->sampleRate);
+                if (n >= 0 && mTap != 0)
+                    mTap->write((char *)buffer + sent, period_size);
+            }
         } else if (mHandle->handle != 0){
-            n = pcm_write(mHandle->handle,
-                     (char *)buffer + sent,
-                      period_size);
+            const void *out = (char *)buffer + sent;
+            int32_t softMute = android_atomic_acquire_load(&mHandle->softMute);
+
+            if (softMute != SOFT_MUTE_OFF || mRampGain != UNITY_GAIN_Q15)
+                out = applySoftMute(out, period_size, softMute);
+            ALSA_TRACE_BEGIN("pcm_write");
+            n = pcm_write(mHandle->handle, (void *)out, period_size);
+            ALSA_TRACE_END();
+            ALSA_TRACE_DELAY("out_delay", mHandle->handle);
+            if (n >= 0 && mParent->mEchoRef.active())
+                mParent->mEchoRef.write(mEchoRefToken, mHandle->handle, out, period_size,
+                        mHandle->channels, mHandle->sampleRate);
+            if (n >= 0 && mTap != 0)
+                mTap->write(out, period_size);
+            trackRouteGap(systemTime());
         }
         if (n < 0) {
-	    mParent->mLock.lock();
+            ALSARWLock::AutoWLock routeLock(mParent->mRouteLock);
             LOGE("pcm_write returned error %d, trying to recover\n", n);
             pcm_close(mHandle->handle);
             mHandle->handle = NULL;
-            if((!strncmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL, strlen(SND_USE_CASE_VERB_IP_VOICECALL))) ||
-              (!strncmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP, strlen(SND_USE_CASE_MOD_PLAY_VOIP)))) {
+            if (useCaseIs(mHandle->useCase, UC_VOIP)) {
                  pcm_close(mHandle->rxHandle);
                  mHandle->rxHandle = NULL;
                  mHandle->module->startVoipCall(mHandle);
             }
             else
             mHandle->module->open(mHandle);
-            mParent->mLock.unlock();
+            mStats.xrun((mHandle->handle || mHandle->rxHandle) ?
+                        ALSAStreamStats::XRUN_REOPENED : ALSAStreamStats::XRUN_FAILED);
             continue;
         }
         else {
-            mFrameCount += n;
+            mFrameCount += period_size / (mHandle->channels * sizeof(int16_t));
             sent += static_cast<ssize_t>((period_size));
             write_pending -= period_size;
         }
 
     } while ((mHandle->handle||(mHandle->rxHandle && mParent->mVoipStreamCount)) && sent < bytes);
-
+    nsecs_t elapsed = systemTime() - start;
+
+    mStats.transferred(mHandle->handle ? mHandle->handle : mHandle->rxHandle,
+                       sent / (mHandle->channels * sizeof(int16_t)), elapsed);
+    if (mFirstWrite) {
+        if (warm) {
+            mWarmStarts++;
+            mWarmStartNs += elapsed;
+        } else {
+            mColdStarts++;
+            mColdStartNs += elapsed;
+        }
+        LOGV("write: first write after standby took %lld us, PCM %s",
+             (long long)ns2us(elapsed), warm ? "prewarmed" : "opened inline");
+        mFirstWrite = false;
+    }
     return sent;
 }
 
+status_t AudioStreamOutALSA::openPcm()
+{
+    mParent->mDeviceList.setUseCase(mHandle,
+            useCaseFor(USE_CASE_VERB_HIFI, useCaseVerbInactive(mHandle->ucMgr)));
+    mHandle->module->route(mHandle, mDevices , mParent->mode());
+    useCaseEnable(mHandle->ucMgr, mHandle->useCase);
+    return mHandle->module->open(mHandle);
+}
+
+/*
+ * The policy calls startOutput() a little before AudioFlinger's first
+ * write, so do the route, UCM verb and pcm_open here meanwhile. write()
+ * takes mRouteLock to open an unopened PCM, so whichever side comes
+ * second finds it open.
+ */
+void AudioStreamOutALSA::prewarm()
+{
+    ALSARWLock::AutoWLock routeLock(mParent->mRouteLock);
+    nsecs_t start = systemTime();
+
+    if (mHandle->handle != NULL || mHandle->rxHandle != NULL ||
+        useCaseIs(mHandle->useCase, UC_VOIP) || useCaseIs(mHandle->useCase, UC_LPA))
+        return;
+
+    if (openPcm() == NO_ERROR && mHandle->handle != NULL)
+        mStats.opened();
+    LOGD("prewarm: PCM %s in %lld us", mHandle->handle ? "ready" : "failed",
+         (long long)ns2us(systemTime() - start));
+}
+
+/*
+ * Linear gain ramp used to silence the stream while the backend device is
+ * swapped underneath a running PCM. Once the ramp is at zero and a whole
+ * buffer of silence has been queued, tell doRouting() it may switch.
+ */
+const void *AudioStreamOutALSA::applySoftMute(const void *buffer, size_t bytes, int32_t state)
+{
+    const int16_t *in = (const int16_t *)buffer;
+    int32_t target = (state == SOFT_MUTE_OFF) ? UNITY_GAIN_Q15 : 0;
+    uint32_t channels = mHandle->channels ? mHandle->channels : 1;
+    size_t frames = bytes / (channels * sizeof(int16_t));
+    int32_t step = UNITY_GAIN_Q15 / (mHandle->sampleRate * SOFT_MUTE_RAMP_MS / 1000 + 1) + 1;
+
+    if (mRampBufferSize < bytes) {
+        int16_t *buf = (int16_t *)realloc(mRampBuffer, bytes);
+        if (buf == NULL) {
+            LOGE("applySoftMute: no memory for %d byte ramp buffer", bytes);
+            return buffer;
+        }
+        mRampBuffer = buf;
+        mRampBufferSize = bytes;
+    }
+
+    for (size_t f = 0; f < frames; f++) {
+        if (mRampGain < target)
+            mRampGain = (mRampGain + step < target) ? mRampGain + step : target;
+        else if (mRampGain > target)
+            mRampGain = (mRampGain - step > target) ? mRampGain - step : target;
+        for (uint32_t c = 0; c < channels; c++, in++)
+            mRampBuffer[f * channels + c] = (int16_t)((*in * mRampGain) >> 15);
+    }
+
+    if (state == SOFT_MUTE_RAMP_DOWN && mRampGain == 0) {
+        mMutedBytes += bytes;
+        if (mMutedBytes >= mHandle->handle->buffer_size &&
+            !android_atomic_release_cas(SOFT_MUTE_RAMP_DOWN, SOFT_MUTE_ON, &mHandle->softMute))
+            mParent->signalSoftMute();
+    } else {
+        mMutedBytes = 0;
+    }
+    return mRampBuffer;
+}
+
+/*
+ * Measure the longest stall between two period writes around a device
+ * switch. Setting SOFT_MUTE_SWITCH_PROP to 0 gives the close/reopen
+ * numbers to compare against.
+ */
+void AudioStreamOutALSA::stopPlaying()
+{
+    // Full barrier, so a ramp asked for meanwhile is seen or we are not waited for
+    android_atomic_and(0, &mHandle->playing);
+    if (android_atomic_acquire_load(&mHandle->softMute) == SOFT_MUTE_RAMP_DOWN)
+        mParent->signalSoftMute();
+}
+
+void AudioStreamOutALSA::trackRouteGap(nsecs_t now)
+{
+    int32_t seq = android_atomic_acquire_load(&mHandle->routeSeq);
+
+    if (seq != mRouteSeq) {
+        mRouteSeq = seq;
+        mRouteGapStart = mLastWriteTime ? mLastWriteTime : now;
+        mRouteGapMax = 0;
+    }
+    if (mRouteGapStart) {
+        if (mLastWriteTime && now - mLastWriteTime > mRouteGapMax)
+            mRouteGapMax = now - mLastWriteTime;
+        if (now - mRouteGapStart >= ROUTE_GAP_WINDOW_NS) {
+            LOGD("route switch (%s): longest write gap %lld us",
+                 mParent->mSoftMuteSwitch ? "soft mute" : "close/reopen",
+                 (long long)(mRouteGapMax / 1000));
+            mRouteGapStart = 0;
+        }
+    }
+    mLastWriteTime = now;
+}
+
+// The playout thread takes mRouteLock, so stop it before taking that lock
+void AudioStreamOutALSA::stopJitterBuffer()
+{
+    if (mJitterBuffer != 0) {
+        mJitterBuffer->exit();
+        mJitterBuffer.clear();
+    }
+}
+
 status_t AudioStreamOutALSA::dump(int fd, const Vector<String16>& args)
 {
+    String8 result("AudioStreamOutALSA locks:\n");
+    char buffer[256];
+
+    mIoLock.stats().dump(result);
+    {
+        ALSARWLock::AutoRLock routeLock(mParent->mRouteLock);
+        mStats.dump(result, mHandle);
+    }
+    snprintf(buffer, sizeof(buffer),
+             "  first write: %u prewarmed, avg %lld us; %u opened inline, avg %lld us (%s=%d)\n",
+             mWarmStarts, (long long)ns2us(mWarmStarts ? mWarmStartNs / mWarmStarts : 0),
+             mColdStarts, (long long)ns2us(mColdStarts ? mColdStartNs / mColdStarts : 0),
+             PREWARM_PROP, mParent->mPrewarm);
+    result.append(buffer);
+    dumpTap(result);
+    mParent->mEchoRef.dump(result);
+    if (mJitterBuffer != 0)
+        mJitterBuffer->dump(result);
+    ::write(fd, result.string(), result.size());
     return NO_ERROR;
 }
 
 status_t AudioStreamOutALSA::open(int mode)
 {
-    Mutex::Autolock autoLock(mParent->mLock);
+    ALSAMutex::Autolock ioLock(mIoLock);
+    ALSARWLock::AutoWLock routeLock(mParent->mRouteLock);
 
     return ALSAStreamOps::open(mode);
 }
 
 status_t AudioStreamOutALSA::close()
 {
-    Mutex::Autolock autoLock(mParent->mLock);
+    ALSAMutex::Autolock ioLock(mIoLock);
+
+    // The routing thread holds a raw pointer to us until it has run.
+    // prewarm() takes only mRouteLock, so waiting under mIoLock is safe
+    // and keeps setParameters() from posting another one meanwhile.
+    if (mPrewarmCmd != 0) {
+        mPrewarmCmd->wait();
+        mPrewarmCmd.clear();
+    }
+    stopJitterBuffer();
+    mParent->mEchoRef.release(mEchoRefToken);
+    stopPlaying();
 
+    ALSARWLock::AutoWLock routeLock(mParent->mRouteLock);
 
-    if((!strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) ||
-        (!strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP))) {
+
+    if (useCaseIs(mHandle->useCase, UC_VOIP)) {
          if((mParent->mVoipStreamCount)) {
                 return NO_ERROR;
          }
@@ -238,22 +450,151 @@ status_t AudioStreamOutALSA::close()
 
 status_t AudioStreamOutALSA::standby()
 {
-    Mutex::Autolock autoLock(mParent->mLock);
+    ALSAMutex::Autolock ioLock(mIoLock);
+    stopPlaying();
+    ALSARWLock::AutoWLock routeLock(mParent->mRouteLock);
 
-     if((!strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) ||
-       (!strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP))) {
+     if (useCaseIs(mHandle->useCase, UC_VOIP)) {
          return NO_ERROR;
      }
 
     LOGD("standby");
 
     mHandle->module->standby(mHandle);
+    mParent->mEchoRef.release(mEchoRefToken);
 
     mFrameCount = 0;
+    mRampGain = UNITY_GAIN_Q15;
+    mMutedBytes = 0;
+    mLastWriteTime = 0;
+    mFirstWrite = true;
 
     return NO_ERROR;
 }
 
+status_t AudioStreamOutALSA::setParameters(const String8& keyValuePairs)
+{
+    AudioParameter param = AudioParameter(keyValuePairs);
+    String8 key = String8(STREAM_PREWARM_KEY);
+    int value;
+
+    if (param.getInt(key, value) == NO_ERROR) {
+        ALSAMutex::Autolock ioLock(mIoLock);
+
+        if (value && mParent->mPrewarm && mFirstWrite) {
+            mPrewarmCmd = mParent->mRoutingThread->post(ALSARoutingThread::CMD_PREWARM, 0, this);
+        } else if (!value && mFirstWrite && mHandle->handle != NULL) {
+            // Output stopped before any data came, do not hold the path up
+            ALSARWLock::AutoWLock routeLock(mParent->mRouteLock);
+            LOGD("setParameters(): prewarmed PCM unused, standby");
+            mHandle->module->standby(mHandle);
+        }
+        param.remove(key);
+        if (param.size() == 0)
+            return NO_ERROR;
+        return ALSAStreamOps::setParameters(param.toString());
+    }
+
+    key = String8(STREAM_DRAIN_KEY);
+    if (param.getInt(key, value) == NO_ERROR) {
+        status_t status = value ? drain() : NO_ERROR;
+
+        param.remove(key);
+        if (status != NO_ERROR || param.size() == 0)
+            return status;
+        return ALSAStreamOps::setParameters(param.toString());
+    }
+
+    key = String8(STREAM_FLUSH_KEY);
+    if (param.getInt(key, value) == NO_ERROR) {
+        status_t status = value ? flush() : NO_ERROR;
+
+        param.remove(key);
+        if (status != NO_ERROR || param.size() == 0)
+            return status;
+        return ALSAStreamOps::setParameters(param.toString());
+    }
+    return ALSAStreamOps::setParameters(keyValuePairs);
+}
+
+uint32_t AudioStreamOutALSA::queuedFrames()
+{
+    snd_pcm_sframes_t delay = 0;
+
+    if (mHandle->handle == NULL ||
+        ioctl(mHandle->handle->fd, SNDRV_PCM_IOCTL_DELAY, &delay) || delay < 0)
+        return 0;
+    return (uint32_t)delay < mFrameCount ? (uint32_t)delay : mFrameCount;
+}
+
+status_t AudioStreamOutALSA::drain()
+{
+    ALSAMutex::Autolock ioLock(mIoLock);
+    nsecs_t start = systemTime();
+    status_t err = NO_INIT;
+    struct pcm *pcm;
+    uint32_t queued = 0;
+    int32_t seq = 0;
+    int fd = -1;
+
+    {
+        ALSARWLock::AutoRLock routeLock(mParent->mRouteLock);
+        pcm = useCaseIs(mHandle->useCase, UC_VOIP) ? NULL : mHandle->handle;
+        if (pcm != NULL) {
+            queued = queuedFrames();
+            seq = android_atomic_acquire_load(&mHandle->routeSeq);
+            fd = dup(pcm->fd);
+            android_atomic_release_store(fd, &mHandle->drainFd);
+        }
+    }
+
+    // A headset/speaker switch may close and reopen the PCM while this
+    // blocks, so wait on our own reference to the file rather than the
+    // handle. The switch stops the DMA, which ends the wait, and holds
+    // the reopen until our reference is gone.
+    if (fd >= 0) {
+        ALSA_TRACE_BEGIN("drain");
+        if (ioctl(fd, SNDRV_PCM_IOCTL_DRAIN))
+            LOGW("drain: drain failed, errno %d", errno);
+        ALSA_TRACE_END();
+        ::close(fd);
+        android_atomic_release_store(-1, &mHandle->drainFd);
+
+        ALSARWLock::AutoRLock routeLock(mParent->mRouteLock);
+        if (mHandle->handle == pcm &&
+            android_atomic_acquire_load(&mHandle->routeSeq) == seq)
+            err = mHandle->module->prepare(mHandle);
+        else
+            err = NO_ERROR;     // reopened by the switch, already prepared
+        LOGD("drain: %u frames played out in %lld ms, position %u", queued,
+             (long long)ns2ms(systemTime() - start), mFrameCount);
+    } else if (pcm != NULL) {
+        LOGE("drain: dup failed, errno %d", errno);
+        err = UNKNOWN_ERROR;
+    }
+    return err;
+}
+
+status_t AudioStreamOutALSA::flush()
+{
+    ALSAMutex::Autolock ioLock(mIoLock);
+    ALSARWLock::AutoRLock routeLock(mParent->mRouteLock);
+
+    if (mHandle->handle == NULL || useCaseIs(mHandle->useCase, UC_VOIP))
+        return NO_ERROR;
+
+    // Frames still in the buffer never reach the DAC
+    uint32_t dropped = queuedFrames();
+    status_t err = mHandle->module->flush(mHandle);
+
+    mFrameCount -= dropped;
+    mRampGain = UNITY_GAIN_Q15;
+    mMutedBytes = 0;
+    mLastWriteTime = 0;
+    LOGD("flush: dropped %u frames, position %u", dropped, mFrameCount);
+    return err;
+}
+
 #define USEC_TO_MSEC(x) ((x + 999) / 1000)
 
 uint32_t AudioStreamOutALSA::latency() const
@@ -266,7 +607,9 @@ uint32_t AudioStreamOutALSA::latency() const
 // the output has exited standby
 status_t AudioStreamOutALSA::getRenderPosition(uint32_t *dspFrames)
 {
-    *dspFrames = mFrameCount;
+    ALSARWLock::AutoRLock routeLock(mParent->mRouteLock);
+
+    *dspFrames = mFrameCount - queuedFrames();
     return NO_ERROR;
 }
 
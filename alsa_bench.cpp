@@ -0,0 +1,1121 @@
+/* alsa_bench.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+/*
+ * Latency benchmark for the ALSA module: stream open, device switch,
+ * voice call start, write path CPU, UCM device lookup and xrun recovery.
+ *
+ * The module is linked in and driven through alsa_device_t the way
+ * AudioHardwareALSA drives it. The host build runs against the simulated
+ * libalsa-intf (alsa_sim.h); there, latencies add the modelled device
+ * time to the wall time of our own code. The device build runs against
+ * the real driver, and -d hw:C,D adds raw PCM cases on a node outside the
+ * UCM config, e.g. one from snd-dummy or snd-aloop.
+ *
+ * The device build also links the HAL and the policy manager:
+ * hal_route_switch goes through AudioHardwareALSA::doRouting() with a music
+ * stream open; the hal_route_gap cases measure the audio lost to a headset
+ * switch under a writer thread, with and without soft mute; and the
+ * device_for_strategy cases sweep getDeviceForStrategy() over every device,
+ * forced config and phone state combination on a policy manager of its own,
+ * behind a stub AudioPolicyService, and check the memo against the uncached
+ * decision. They need libmedia and libhardware_legacy, which have no host
+ * build.
+ *
+ * Each case prints one JSON object per line:
+ *   {"bench":"alsa","case":"open_warm","backend":"sim","unit":"us","n":200,
+ *    "mean":..,"p50":..,"p90":..,"p99":..,"max":..}
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+#define LOG_TAG "ALSABench"
+//#define LOG_NDEBUG 0
+#define LOG_NDDEBUG 0
+#include <utils/Log.h>
+
+#include "AudioHardwareALSA.h"
+#ifndef ALSA_SIM
+#include <hardware/audio_policy.h>
+#include "AudioPolicyCompatClient.h"
+#include "AudioPolicyManagerALSA.h"
+#endif
+
+namespace android_audio_legacy
+{
+// alsa_default.cpp
+const char *getUCMDevice(alsa_card_t *card, uint32_t devices, int input);
+status_t setHardwareParams(alsa_handle_t *handle);
+status_t setSoftwareParams(alsa_handle_t *handle);
+}
+
+using namespace android_audio_legacy;
+
+extern "C" const hw_module_t HAL_MODULE_INFO_SYM;
+
+// ----------------------------------------------------------------------------
+
+#define BENCH_ITERATIONS    200
+#define BENCH_MAX_SAMPLES   20000
+#define BENCH_PERIODS       500         // periods per write path sample set
+#define BENCH_LOOKUPS       1000        // getUCMDevice() calls per sample
+#define BENCH_UCM_CARD      "snd_soc_msm_2x"
+#define BENCH_GAP_SWITCHES  20          // switches per route gap case, each takes a window
+#define BENCH_GAP_WINDOW_US 300000      // longer than routeKeepPcm()'s ramp timeout
+#define BENCH_PREWARM_LEAD_US 20000     // startOutput() to the mixer's first write
+
+struct bench_options {
+    int                 iterations;
+    const char *        filter;
+    const char *        rawDevice;
+    int                 realtime;
+    FILE *              out;
+};
+
+struct bench_context {
+    bench_options *     opts;
+    alsa_device_t *     dev;
+    snd_use_case_mgr_t *ucMgr;
+    const char *        backend;
+    int                 failed;         // a case found the HAL misbehaving
+};
+
+class BenchSamples
+{
+public:
+    BenchSamples() : mCount(0) {}
+
+    void                add(double value) { if (mCount < BENCH_MAX_SAMPLES) mValues[mCount++] = value; }
+    int                 count() const { return mCount; }
+    void                report(bench_context *ctx, const char *name, const char *unit);
+
+private:
+    static int          compare(const void *a, const void *b);
+    double              percentile(double q) const { return mValues[(int)(q * (mCount - 1))]; }
+
+    double              mValues[BENCH_MAX_SAMPLES];
+    int                 mCount;
+};
+
+int BenchSamples::compare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void BenchSamples::report(bench_context *ctx, const char *name, const char *unit)
+{
+    double sum = 0;
+
+    if (!mCount) {
+        fprintf(ctx->opts->out, "{\"bench\":\"alsa\",\"case\":\"%s\",\"backend\":\"%s\","
+                "\"skipped\":true}\n", name, ctx->backend);
+        return;
+    }
+    qsort(mValues, mCount, sizeof(mValues[0]), compare);
+    for (int i = 0; i < mCount; i++)
+        sum += mValues[i];
+    fprintf(ctx->opts->out, "{\"bench\":\"alsa\",\"case\":\"%s\",\"backend\":\"%s\","
+            "\"unit\":\"%s\",\"n\":%d,\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,"
+            "\"p99\":%.3f,\"max\":%.3f}\n", name, ctx->backend, unit, mCount,
+            sum / mCount, percentile(0.5), percentile(0.9), percentile(0.99),
+            mValues[mCount - 1]);
+    fflush(ctx->opts->out);
+    fprintf(stderr, "%-24s %8d  mean %10.3f %s  p99 %10.3f %s\n", name, mCount,
+            sum / mCount, unit, percentile(0.99), unit);
+}
+
+// ----------------------------------------------------------------------------
+
+// Wall time plus, in the simulator's virtual mode, the modelled device time
+class BenchTimer
+{
+public:
+    void                start() { mWall = systemTime(); mSim = simNow(); }
+    double              elapsedUs() const { return ((systemTime() - mWall) + (simNow() - mSim)) / 1000.0; }
+
+private:
+    static int64_t      simNow()
+    {
+#ifdef ALSA_SIM
+        return sVirtual ? alsa_sim_now_ns() : 0;
+#else
+        return 0;
+#endif
+    }
+
+    nsecs_t             mWall;
+    int64_t             mSim;
+
+public:
+    static bool         sVirtual;
+};
+
+bool BenchTimer::sVirtual = false;
+
+static int64_t threadCpuNs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void initHandle(bench_context *ctx, alsa_handle_t *h, alsa_use_case_t useCase,
+                       uint32_t devices)
+{
+    bool voice = useCaseIs(useCase, UC_VOICE);
+
+    memset(h, 0, sizeof(*h));
+    h->module = ctx->dev;
+    h->card = ctx->dev->getCard(ctx->dev, 0);
+    h->devices = devices;
+    h->useCase = useCase;
+    h->format = SNDRV_PCM_FORMAT_S16_LE;
+    h->channels = voice ? VOICE_CHANNEL_MODE : DEFAULT_CHANNEL_MODE;
+    h->sampleRate = voice ? VOICE_SAMPLING_RATE : DEFAULT_SAMPLING_RATE;
+    h->latency = voice ? VOICE_LATENCY : PLAYBACK_LATENCY;
+    h->bufferSize = DEFAULT_BUFFER_SIZE;
+    h->ucMgr = ctx->ucMgr;
+    h->softMute = SOFT_MUTE_OFF;
+    h->drainFd = -1;
+}
+
+static alsa_device_t *openModule()
+{
+    const hw_module_t *module = &HAL_MODULE_INFO_SYM;
+    hw_device_t *device = NULL;
+
+    if (module->methods->open(module, ALSA_HARDWARE_NAME, &device))
+        return NULL;
+    return (alsa_device_t *)device;
+}
+
+// What openOutputStream() does for a music stream
+static status_t openMusic(alsa_handle_t *h)
+{
+    h->module->route(h, h->devices, AudioSystem::MODE_NORMAL);
+    useCaseEnable(h->ucMgr, h->useCase);
+    return h->module->open(h);
+}
+
+static void writePeriods(alsa_handle_t *h, int periods)
+{
+    static char buffer[64 * 1024];
+    size_t bytes = h->periodSize < sizeof(buffer) ? h->periodSize : sizeof(buffer);
+
+    for (int i = 0; i < periods && h->handle; i++)
+        pcm_write(h->handle, buffer, bytes);
+}
+
+// Stop the running PCM in XRUN, as the DMA catching up with the writer does
+static int forceXrun(alsa_handle_t *h)
+{
+    if (ioctl(h->handle->fd, SNDRV_PCM_IOCTL_XRUN) < 0) {
+        fprintf(stderr, "cannot force an xrun: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+
+// Fresh module each time: empty hw params cache and UCM node cache
+static void benchOpenCold(bench_context *ctx, BenchSamples& s)
+{
+    alsa_device_t *shared = ctx->dev;
+
+    for (int i = 0; i < ctx->opts->iterations; i++) {
+        alsa_handle_t h;
+        BenchTimer t;
+
+        ctx->dev = openModule();
+        if (!ctx->dev)
+            break;
+        initHandle(ctx, &h, USE_CASE_VERB_HIFI, AudioSystem::DEVICE_OUT_SPEAKER);
+        t.start();
+        status_t err = openMusic(&h);
+        double us = t.elapsedUs();
+        if (err == NO_ERROR && h.handle)
+            s.add(us);
+        ctx->dev->close(&h);
+        ctx->dev->common.close(&ctx->dev->common);
+    }
+    ctx->dev = shared;
+}
+
+static void benchOpenWarm(bench_context *ctx, BenchSamples& s)
+{
+    alsa_handle_t h;
+
+    initHandle(ctx, &h, USE_CASE_VERB_HIFI, AudioSystem::DEVICE_OUT_SPEAKER);
+    openMusic(&h);
+    for (int i = 0; i < ctx->opts->iterations; i++) {
+        BenchTimer t;
+
+        ctx->dev->standby(&h);
+        t.start();
+        status_t err = openMusic(&h);
+        double us = t.elapsedUs();
+        if (err == NO_ERROR && h.handle)
+            s.add(us);
+    }
+    ctx->dev->close(&h);
+}
+
+// The module side of doRouting(): speaker <-> headphones under music
+static void benchRouteSwitch(bench_context *ctx, BenchSamples& s)
+{
+    static const uint32_t kDevices[] = {
+        AudioSystem::DEVICE_OUT_WIRED_HEADPHONE,
+        AudioSystem::DEVICE_OUT_SPEAKER,
+    };
+    alsa_handle_t h;
+
+    initHandle(ctx, &h, USE_CASE_VERB_HIFI, AudioSystem::DEVICE_OUT_SPEAKER);
+    if (openMusic(&h) != NO_ERROR)
+        return;
+    for (int i = 0; i < ctx->opts->iterations; i++) {
+        BenchTimer t;
+
+        writePeriods(&h, 2);
+        h.devices = kDevices[i & 1];
+        t.start();
+        ctx->dev->route(&h, h.devices, AudioSystem::MODE_NORMAL);
+        s.add(t.elapsedUs());
+    }
+    ctx->dev->close(&h);
+}
+
+#ifndef ALSA_SIM
+// doRouting() is protected; the routing thread is what calls it normally
+class BenchHardware : public AudioHardwareALSA
+{
+public:
+    void                routeTo(int device) { doRouting(device); }
+    void                setSoftMuteSwitch(bool on) { mSoftMuteSwitch = on; }
+    void                setPrewarm(bool on) { mPrewarm = on; }
+    int32_t             unmutedSwitches() { return android_atomic_acquire_load(&mUnmutedSwitches); }
+};
+
+// Speaker <-> headphones through the HAL: route lock, handle lookup and the
+// UCM switch, with a music stream open and written to between switches.
+// The HAL loads the installed alsa.msm8960 module, not the one linked here.
+static void benchHalRouteSwitch(bench_context *ctx, BenchSamples& s)
+{
+    static const uint32_t kDevices[] = {
+        AudioSystem::DEVICE_OUT_WIRED_HEADPHONE,
+        AudioSystem::DEVICE_OUT_SPEAKER,
+    };
+    BenchHardware *hw = new BenchHardware();
+    AudioStreamOut *out = NULL;
+    int format = 0;
+    uint32_t channels = 0, rate = 0;
+    status_t err = hw->initCheck();
+
+    if (err == NO_ERROR)
+        out = hw->openOutputStream(AudioSystem::DEVICE_OUT_SPEAKER, &format, &channels,
+                                   &rate, &err);
+    if (out) {
+        size_t bytes = out->bufferSize();
+        char *buffer = (char *)calloc(1, bytes);
+
+        for (int i = 0; i < ctx->opts->iterations; i++) {
+            BenchTimer t;
+
+            out->write(buffer, bytes);
+            t.start();
+            hw->routeTo(kDevices[i & 1]);
+            s.add(t.elapsedUs());
+        }
+        free(buffer);
+        hw->closeOutputStream(out);
+    } else {
+        fprintf(stderr, "hal_route_switch: cannot open a music stream: %d\n", err);
+    }
+    delete hw;
+}
+
+// AudioFlinger's mixer thread: write back to back, keep the longest
+// interval between two write() returns since the last reset
+struct gap_writer {
+    AudioStreamOut *    out;
+    char *              buffer;
+    size_t              bytes;
+    volatile int32_t    stop;
+    volatile int32_t    maxGapUs;
+};
+
+static void *gapWriterLoop(void *arg)
+{
+    gap_writer *w = (gap_writer *)arg;
+    nsecs_t last = systemTime();
+
+    while (!android_atomic_acquire_load(&w->stop)) {
+        w->out->write(w->buffer, w->bytes);
+        nsecs_t now = systemTime();
+        int32_t gap = (int32_t)ns2us(now - last);
+        int32_t max;
+        do {
+            max = android_atomic_acquire_load(&w->maxGapUs);
+        } while (gap > max && android_atomic_cmpxchg(max, gap, &w->maxGapUs));
+        last = now;
+    }
+    return NULL;
+}
+
+/*
+ * Audio lost around a headset <-> speaker+headset switch: how much longer
+ * than one write's worth of audio the longest write takes while the route
+ * changes under a playing stream. Soft mute keeps the PCM running; the
+ * other case closes and reopens it, as SOFT_MUTE_SWITCH_PROP=0 does.
+ * With soft mute every switch has to wait for the ramp to finish, or the
+ * case fails.
+ */
+static void benchHalRouteGap(bench_context *ctx, BenchSamples& s, bool softMute)
+{
+    static const uint32_t kDevices[] = {
+        AudioSystem::DEVICE_OUT_SPEAKER | AudioSystem::DEVICE_OUT_WIRED_HEADSET,
+        AudioSystem::DEVICE_OUT_WIRED_HEADSET,
+    };
+    int switches = ctx->opts->iterations < BENCH_GAP_SWITCHES ?
+                   ctx->opts->iterations : BENCH_GAP_SWITCHES;
+    BenchHardware *hw = new BenchHardware();
+    AudioStreamOut *out = NULL;
+    int format = 0;
+    uint32_t channels = 0, rate = 0;
+    status_t err = hw->initCheck();
+    gap_writer w;
+    pthread_t thread;
+
+    if (err == NO_ERROR)
+        out = hw->openOutputStream(AudioSystem::DEVICE_OUT_WIRED_HEADSET, &format,
+                                   &channels, &rate, &err);
+    if (!out) {
+        fprintf(stderr, "hal_route_gap: cannot open a music stream: %d\n", err);
+        delete hw;
+        return;
+    }
+    hw->setSoftMuteSwitch(softMute);
+    hw->routeTo(AudioSystem::DEVICE_OUT_WIRED_HEADSET);
+
+    memset(&w, 0, sizeof(w));
+    w.out = out;
+    w.bytes = out->bufferSize();
+    w.buffer = (char *)calloc(1, w.bytes);
+    int64_t nominalUs = (int64_t)w.bytes * 1000000 / (out->frameSize() * out->sampleRate());
+    if (pthread_create(&thread, NULL, gapWriterLoop, &w) == 0) {
+        usleep(BENCH_GAP_WINDOW_US);
+        for (int i = 0; i < switches; i++) {
+            android_atomic_release_store(0, &w.maxGapUs);
+            hw->routeTo(kDevices[i & 1]);
+            usleep(BENCH_GAP_WINDOW_US);
+            int64_t gap = android_atomic_acquire_load(&w.maxGapUs) - nominalUs;
+            s.add(gap > 0 ? gap : 0);
+        }
+        android_atomic_release_store(1, &w.stop);
+        pthread_join(thread, NULL);
+        if (softMute && hw->unmutedSwitches()) {
+            fprintf(stderr, "hal_route_gap: %d of %d switches made before the ramp finished\n",
+                    hw->unmutedSwitches(), switches);
+            ctx->failed = 1;
+        }
+    }
+    free(w.buffer);
+    hw->closeOutputStream(out);
+    delete hw;
+}
+
+static void benchHalRouteGapSoftMute(bench_context *ctx, BenchSamples& s)
+{
+    benchHalRouteGap(ctx, s, true);
+}
+
+static void benchHalRouteGapReopen(bench_context *ctx, BenchSamples& s)
+{
+    benchHalRouteGap(ctx, s, false);
+}
+
+/*
+ * First write() after standby, with the policy's prewarm hint sent one
+ * mixer buffer ahead as startOutput() does. With prewarm off the hint is
+ * ignored, as with PREWARM_PROP=0, and the write opens the PCM itself.
+ */
+static void benchHalFirstWrite(bench_context *ctx, BenchSamples& s, bool prewarm)
+{
+    BenchHardware *hw = new BenchHardware();
+    AudioStreamOut *out = NULL;
+    int format = 0;
+    uint32_t channels = 0, rate = 0;
+    status_t err = hw->initCheck();
+
+    if (err == NO_ERROR)
+        out = hw->openOutputStream(AudioSystem::DEVICE_OUT_SPEAKER, &format, &channels,
+                                   &rate, &err);
+    if (out) {
+        AudioParameter param;
+        size_t bytes = out->bufferSize();
+        char *buffer = (char *)calloc(1, bytes);
+
+        param.addInt(String8(STREAM_PREWARM_KEY), 1);
+        hw->setPrewarm(prewarm);
+        for (int i = 0; i < ctx->opts->iterations; i++) {
+            BenchTimer t;
+
+            out->standby();
+            out->setParameters(param.toString());
+            usleep(BENCH_PREWARM_LEAD_US);
+            t.start();
+            out->write(buffer, bytes);
+            s.add(t.elapsedUs());
+        }
+        free(buffer);
+        hw->closeOutputStream(out);
+    } else {
+        fprintf(stderr, "hal_first_write: cannot open a music stream: %d\n", err);
+    }
+    delete hw;
+}
+
+static void benchHalFirstWritePrewarm(bench_context *ctx, BenchSamples& s)
+{
+    benchHalFirstWrite(ctx, s, true);
+}
+
+static void benchHalFirstWriteCold(bench_context *ctx, BenchSamples& s)
+{
+    benchHalFirstWrite(ctx, s, false);
+}
+#endif
+
+static void benchVoiceCallStart(bench_context *ctx, BenchSamples& s)
+{
+    for (int i = 0; i < ctx->opts->iterations; i++) {
+        alsa_handle_t h;
+        BenchTimer t;
+
+        initHandle(ctx, &h, USE_CASE_VERB_VOICECALL, AudioSystem::DEVICE_OUT_EARPIECE);
+        t.start();
+        ctx->dev->route(&h, h.devices, AudioSystem::MODE_IN_CALL);
+        status_t err = ctx->dev->startVoiceCall(&h);
+        double us = t.elapsedUs();
+        if (err == NO_ERROR)
+            s.add(us);
+        // As setMode(MODE_NORMAL) ends the call
+        ctx->dev->close(&h);
+        ctx->dev->route(&h, AudioSystem::DEVICE_OUT_SPEAKER, AudioSystem::MODE_NORMAL);
+    }
+}
+
+// CPU, not latency: a blocking write sleeps for most of its wall time
+static void benchWriteCpu(bench_context *ctx, BenchSamples& s, alsa_handle_t *h)
+{
+    static char buffer[64 * 1024];
+    size_t bytes = h->periodSize < sizeof(buffer) ? h->periodSize : sizeof(buffer);
+    int periods = ctx->opts->iterations > BENCH_PERIODS ? ctx->opts->iterations : BENCH_PERIODS;
+
+    for (int i = 0; i < periods && h->handle; i++) {
+        int64_t start = threadCpuNs();
+        if (pcm_write(h->handle, buffer, bytes) == 0)
+            s.add((threadCpuNs() - start) / 1000.0);
+    }
+}
+
+static void benchWritePeriodCpu(bench_context *ctx, BenchSamples& s)
+{
+    alsa_handle_t h;
+
+    initHandle(ctx, &h, USE_CASE_VERB_HIFI, AudioSystem::DEVICE_OUT_SPEAKER);
+    if (openMusic(&h) == NO_ERROR)
+        benchWriteCpu(ctx, s, &h);
+    ctx->dev->close(&h);
+}
+
+static void benchUcmDevice(bench_context *ctx, BenchSamples& s)
+{
+    static const uint32_t kDevices[] = {
+        AudioSystem::DEVICE_OUT_EARPIECE,
+        AudioSystem::DEVICE_OUT_SPEAKER,
+        AudioSystem::DEVICE_OUT_WIRED_HEADSET,
+        AudioSystem::DEVICE_OUT_WIRED_HEADPHONE,
+        AudioSystem::DEVICE_OUT_BLUETOOTH_SCO,
+        AudioSystem::DEVICE_OUT_AUX_DIGITAL,
+        AudioSystem::DEVICE_OUT_SPEAKER | AudioSystem::DEVICE_OUT_WIRED_HEADSET,
+        AudioSystem::DEVICE_IN_BUILTIN_MIC,
+        AudioSystem::DEVICE_IN_WIRED_HEADSET,
+        AudioSystem::DEVICE_IN_BLUETOOTH_SCO_HEADSET,
+    };
+    const int numDevices = sizeof(kDevices) / sizeof(kDevices[0]);
+    alsa_card_t *card = ctx->dev->getCard(ctx->dev, 0);
+    uintptr_t sink = 0;
+
+    for (int i = 0; i < ctx->opts->iterations; i++) {
+        nsecs_t start = systemTime();
+        for (int j = 0; j < BENCH_LOOKUPS; j++) {
+            uint32_t devices = kDevices[j % numDevices];
+            sink += (uintptr_t)getUCMDevice(card, devices,
+                                            (devices & AudioSystem::DEVICE_IN_ALL) != 0);
+        }
+        s.add((double)(systemTime() - start) / BENCH_LOOKUPS);
+    }
+    if (sink == 1)
+        fprintf(stderr, "\n");
+}
+
+#ifndef ALSA_SIM
+// ----------------------------------------------------------------------------
+// Policy decisions, on a policy manager behind a stub AudioPolicyService
+
+static audio_io_handle_t stubOpenOutput(void *service, uint32_t *pDevices,
+                                        uint32_t *pSamplingRate, audio_format_t *pFormat,
+                                        uint32_t *pChannels, uint32_t *pLatencyMs,
+                                        audio_policy_output_flags_t flags)
+{
+    return 1;
+}
+
+static audio_io_handle_t stubOpenDuplicateOutput(void *service, audio_io_handle_t output1,
+                                                 audio_io_handle_t output2)
+{
+    return 2;
+}
+
+static int stubCloseIo(void *service, audio_io_handle_t io)
+{
+    return 0;
+}
+
+static audio_io_handle_t stubOpenInput(void *service, uint32_t *pDevices,
+                                       uint32_t *pSamplingRate, audio_format_t *pFormat,
+                                       uint32_t *pChannels, audio_in_acoustics_t acoustics)
+{
+    return 3;
+}
+
+static int stubSetStreamVolume(void *service, audio_stream_type_t stream, float volume,
+                               audio_io_handle_t output, int delay_ms)
+{
+    return 0;
+}
+
+static int stubSetStreamOutput(void *service, audio_stream_type_t stream,
+                               audio_io_handle_t output)
+{
+    return 0;
+}
+
+static void stubSetParameters(void *service, audio_io_handle_t io_handle,
+                              const char *kv_pairs, int delay_ms)
+{
+}
+
+// service is the HAL when a case has one. The client frees the result.
+static char *stubGetParameters(void *service, audio_io_handle_t io_handle, const char *keys)
+{
+    AudioHardwareALSA *hw = (AudioHardwareALSA *)service;
+
+    return strdup(hw ? hw->getParameters(String8(keys)).string() : "");
+}
+
+static int stubStartTone(void *service, audio_policy_tone_t tone, audio_stream_type_t stream)
+{
+    return 0;
+}
+
+static int stubStopTone(void *service)
+{
+    return 0;
+}
+
+static int stubSetVoiceVolume(void *service, float volume, int delay_ms)
+{
+    return 0;
+}
+
+static int stubMoveEffects(void *service, int session, audio_io_handle_t src_output,
+                           audio_io_handle_t dst_output)
+{
+    return 0;
+}
+
+static audio_policy_service_ops *stubServiceOps()
+{
+    static audio_policy_service_ops ops;
+
+    memset(&ops, 0, sizeof(ops));
+    ops.open_output = stubOpenOutput;
+    ops.open_duplicate_output = stubOpenDuplicateOutput;
+    ops.close_output = stubCloseIo;
+    ops.suspend_output = stubCloseIo;
+    ops.restore_output = stubCloseIo;
+    ops.open_input = stubOpenInput;
+    ops.close_input = stubCloseIo;
+    ops.set_stream_volume = stubSetStreamVolume;
+    ops.set_stream_output = stubSetStreamOutput;
+    ops.set_parameters = stubSetParameters;
+    ops.get_parameters = stubGetParameters;
+    ops.start_tone = stubStartTone;
+    ops.stop_tone = stubStopTone;
+    ops.set_voice_volume = stubSetVoiceVolume;
+    ops.move_effects = stubMoveEffects;
+    return &ops;
+}
+
+class BenchPolicy : public AudioPolicyManager
+{
+public:
+    enum decision_cost {
+        DECISION_UNCACHED,              // computeDeviceForStrategy()
+        DECISION_FIRST,                 // getDeviceForStrategy() after a state change
+        DECISION_REPEATED,              // and again with the state unchanged
+    };
+
+    BenchPolicy(AudioPolicyClientInterface *client) : AudioPolicyManager(client) {}
+
+    uint32_t            sweepDecisions(int iterations, decision_cost cost, BenchSamples& s);
+    void                halQueries(int iterations, bool shared, BenchSamples& s);
+};
+
+/*
+ * Walk every combination of the inputs getDeviceForStrategy() looks at:
+ * the output devices it tests, both forced configs, the phone state and
+ * A2DP, for each strategy. Each combination is evaluated uncached, then
+ * twice through the memo, and the results must agree; the mismatches are
+ * returned. One sample is the per call mean over a block of device masks.
+ */
+uint32_t BenchPolicy::sweepDecisions(int iterations, decision_cost cost, BenchSamples& s)
+{
+    static const uint32_t kDevices[] = {
+        AudioSystem::DEVICE_OUT_EARPIECE,
+        AudioSystem::DEVICE_OUT_SPEAKER,
+        AudioSystem::DEVICE_OUT_WIRED_HEADSET,
+        AudioSystem::DEVICE_OUT_WIRED_HEADPHONE,
+        AudioSystem::DEVICE_OUT_BLUETOOTH_SCO,
+        AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_HEADSET,
+        AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_CARKIT,
+        AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP,
+        AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP_HEADPHONES,
+        AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP_SPEAKER,
+        AudioSystem::DEVICE_OUT_AUX_DIGITAL,
+        AudioSystem::DEVICE_OUT_ANC_HEADSET,
+        AudioSystem::DEVICE_OUT_ANC_HEADPHONE,
+        AudioSystem::DEVICE_OUT_FM,
+        AudioSystem::DEVICE_OUT_FM_TX,
+        AudioSystem::DEVICE_OUT_PROXY,
+    };
+    static const AudioSystem::forced_config kComm[] = {
+        AudioSystem::FORCE_NONE, AudioSystem::FORCE_SPEAKER, AudioSystem::FORCE_BT_SCO,
+    };
+    static const AudioSystem::forced_config kMedia[] = {
+        AudioSystem::FORCE_NONE, AudioSystem::FORCE_SPEAKER,
+    };
+    const int numDevices = sizeof(kDevices) / sizeof(kDevices[0]);
+    const uint32_t numMasks = 1u << numDevices;
+    uint32_t block = (numMasks + iterations - 1) / iterations;
+    uint32_t mismatches = 0;
+
+    for (uint32_t first = 0; first < numMasks; first += block) {
+        nsecs_t ns = 0;
+        uint32_t calls = 0;
+
+        for (uint32_t mask = first; mask < first + block && mask < numMasks; mask++) {
+            mAvailableOutputDevices = 0;
+            for (int i = 0; i < numDevices; i++)
+                if (mask & (1u << i))
+                    mAvailableOutputDevices |= kDevices[i];
+
+            for (size_t c = 0; c < sizeof(kComm) / sizeof(kComm[0]); c++)
+            for (size_t m = 0; m < sizeof(kMedia) / sizeof(kMedia[0]); m++)
+            for (int phone = AudioSystem::MODE_NORMAL; phone < AudioSystem::NUM_MODES; phone++)
+            for (int a2dp = 0; a2dp < 2; a2dp++) {
+                mForceUse[AudioSystem::FOR_COMMUNICATION] = kComm[c];
+                mForceUse[AudioSystem::FOR_MEDIA] = kMedia[m];
+                mPhoneState = phone;
+#ifdef WITH_A2DP
+                mA2dpOutput = a2dp;
+#else
+                if (a2dp)
+                    continue;
+#endif
+                mDeviceForStrategy[STRATEGY_PHONE] = computeDeviceForStrategy(STRATEGY_PHONE);
+
+                uint32_t expected[NUM_STRATEGIES], cold[NUM_STRATEGIES], warm[NUM_STRATEGIES];
+                nsecs_t t0 = systemTime();
+                for (int st = 0; st < NUM_STRATEGIES; st++)
+                    expected[st] = computeDeviceForStrategy((routing_strategy)st);
+                nsecs_t t1 = systemTime();
+                for (int st = 0; st < NUM_STRATEGIES; st++)
+                    cold[st] = getDeviceForStrategy((routing_strategy)st, false);
+                nsecs_t t2 = systemTime();
+                for (int st = 0; st < NUM_STRATEGIES; st++)
+                    warm[st] = getDeviceForStrategy((routing_strategy)st, false);
+                nsecs_t t3 = systemTime();
+
+                ns += cost == DECISION_UNCACHED ? t1 - t0 :
+                      cost == DECISION_FIRST ? t2 - t1 : t3 - t2;
+                calls += NUM_STRATEGIES;
+                for (int st = 0; st < NUM_STRATEGIES; st++) {
+                    if ((cold[st] != expected[st] || warm[st] != expected[st]) &&
+                        mismatches++ < 8)
+                        fprintf(stderr, "strategy %d devices %x: %x/%x, expected %x\n",
+                                st, mAvailableOutputDevices, cold[st], warm[st], expected[st]);
+                }
+            }
+        }
+        if (calls)
+            s.add((double)ns / calls);
+    }
+    return mismatches;
+}
+
+/*
+ * One SCO volume query through the shared state, or through the
+ * getParameters() string round trip it replaces. The stub service hands
+ * the keys to a HAL instance of the benchmark's own.
+ */
+void BenchPolicy::halQueries(int iterations, bool shared, BenchSamples& s)
+{
+    int hits = 0;
+
+    if (shared && halState() == NULL)
+        return;
+    for (int i = 0; i < iterations; i++) {
+        nsecs_t start = systemTime();
+        for (int j = 0; j < BENCH_LOOKUPS; j++) {
+            if (shared) {
+                hits += halValue(ALSA_STATE_BT_HEADSET_VGS) != 0;
+            } else {
+                AudioParameter param(mpClientInterface->getParameters(0,
+                        String8(BTHEADSET_VGS_KEY)));
+                int value;
+                hits += param.getInt(String8("isVGS"), value) == NO_ERROR;
+            }
+        }
+        s.add((double)(systemTime() - start) / BENCH_LOOKUPS);
+    }
+    if (hits == -1)
+        fprintf(stderr, "\n");
+}
+
+static void benchDeviceForStrategy(bench_context *ctx, BenchSamples& s,
+                                   BenchPolicy::decision_cost cost)
+{
+    AudioPolicyCompatClient client(stubServiceOps(), NULL);
+    BenchPolicy *policy = new BenchPolicy(&client);
+
+    uint32_t mismatches = policy->sweepDecisions(ctx->opts->iterations, cost, s);
+    if (mismatches)
+        fprintf(stderr, "device_for_strategy: %u cached decisions differ\n", mismatches);
+    delete policy;
+}
+
+static void benchDeviceForStrategyUncached(bench_context *ctx, BenchSamples& s)
+{
+    benchDeviceForStrategy(ctx, s, BenchPolicy::DECISION_UNCACHED);
+}
+
+static void benchDeviceForStrategyFirst(bench_context *ctx, BenchSamples& s)
+{
+    benchDeviceForStrategy(ctx, s, BenchPolicy::DECISION_FIRST);
+}
+
+static void benchDeviceForStrategyRepeated(bench_context *ctx, BenchSamples& s)
+{
+    benchDeviceForStrategy(ctx, s, BenchPolicy::DECISION_REPEATED);
+}
+
+static void benchHalQuery(bench_context *ctx, BenchSamples& s, bool shared)
+{
+    AudioHardwareALSA *hw = new AudioHardwareALSA();
+    AudioPolicyCompatClient client(stubServiceOps(), hw);
+    BenchPolicy *policy = new BenchPolicy(&client);
+
+    policy->halQueries(ctx->opts->iterations, shared, s);
+    delete policy;
+    delete hw;
+}
+
+static void benchHalQueryShared(bench_context *ctx, BenchSamples& s)
+{
+    benchHalQuery(ctx, s, true);
+}
+
+static void benchHalQueryParameters(bench_context *ctx, BenchSamples& s)
+{
+    benchHalQuery(ctx, s, false);
+}
+#endif
+
+// Underrun absorbed inside libalsa-intf: the next write re-prepares
+static void benchXrunPrepare(bench_context *ctx, BenchSamples& s)
+{
+    static char buffer[64 * 1024];
+    alsa_handle_t h;
+
+    initHandle(ctx, &h, USE_CASE_VERB_HIFI, AudioSystem::DEVICE_OUT_SPEAKER);
+    if (openMusic(&h) != NO_ERROR)
+        return;
+    size_t bytes = h.periodSize < sizeof(buffer) ? h.periodSize : sizeof(buffer);
+    for (int i = 0; i < ctx->opts->iterations && h.handle; i++) {
+        BenchTimer t;
+
+        writePeriods(&h, 4);
+        if (forceXrun(&h))
+            break;
+        int underruns = h.handle->underruns;
+        t.start();
+        int n = pcm_write(h.handle, buffer, bytes);
+        double us = t.elapsedUs();
+        if (n == 0 && h.handle->underruns != underruns)
+            s.add(us);
+    }
+    ctx->dev->close(&h);
+}
+
+// Hard error: the stream closes and reopens the PCM, as write() does. The
+// simulator fails the write with EIO; the driver has no such fault, so on
+// the device the PCM is put in XRUN and the same recovery runs from there.
+static void benchXrunReopen(bench_context *ctx, BenchSamples& s)
+{
+    static char buffer[64 * 1024];
+    alsa_handle_t h;
+
+    initHandle(ctx, &h, USE_CASE_VERB_HIFI, AudioSystem::DEVICE_OUT_SPEAKER);
+    if (openMusic(&h) != NO_ERROR)
+        return;
+    size_t bytes = h.periodSize < sizeof(buffer) ? h.periodSize : sizeof(buffer);
+    for (int i = 0; i < ctx->opts->iterations && h.handle; i++) {
+        BenchTimer t;
+
+        writePeriods(&h, 2);
+#ifdef ALSA_SIM
+        alsa_sim_inject_fault(ALSA_SIM_FAULT_EIO, 1);
+#else
+        if (forceXrun(&h))
+            break;
+#endif
+        t.start();
+#ifdef ALSA_SIM
+        if (pcm_write(h.handle, buffer, bytes) >= 0)
+            continue;
+#endif
+        pcm_close(h.handle);
+        h.handle = NULL;
+        status_t err = ctx->dev->open(&h);
+        if (err == NO_ERROR && h.handle && pcm_write(h.handle, buffer, bytes) == 0)
+            s.add(t.elapsedUs());
+    }
+    ctx->dev->close(&h);
+}
+
+// ----------------------------------------------------------------------------
+// Raw PCM cases on -d, no UCM involved
+
+static struct pcm *openRaw(bench_context *ctx, alsa_handle_t *h)
+{
+    initHandle(ctx, h, USE_CASE_VERB_HIFI, AudioSystem::DEVICE_OUT_SPEAKER);
+    h->handle = pcm_open(PCM_OUT | PCM_STEREO, (char *)ctx->opts->rawDevice);
+    if (!h->handle)
+        return NULL;
+    if (!pcm_ready(h->handle) || setHardwareParams(h) != NO_ERROR ||
+        setSoftwareParams(h) != NO_ERROR || pcm_prepare(h->handle)) {
+        pcm_close(h->handle);
+        h->handle = NULL;
+    }
+    return h->handle;
+}
+
+static void benchRawOpen(bench_context *ctx, BenchSamples& s)
+{
+    for (int i = 0; i < ctx->opts->iterations; i++) {
+        alsa_handle_t h;
+        BenchTimer t;
+
+        t.start();
+        if (!openRaw(ctx, &h))
+            break;
+        s.add(t.elapsedUs());
+        pcm_close(h.handle);
+    }
+}
+
+static void benchRawWriteCpu(bench_context *ctx, BenchSamples& s)
+{
+    alsa_handle_t h;
+
+    if (!openRaw(ctx, &h))
+        return;
+    benchWriteCpu(ctx, s, &h);
+    pcm_close(h.handle);
+}
+
+// ----------------------------------------------------------------------------
+
+enum bench_needs {
+    NEEDS_UCM,                          // the UCM config
+    NEEDS_RAW,                          // a PCM node from -d
+    NEEDS_NOTHING,
+};
+
+struct bench_case {
+    const char *        name;
+    const char *        unit;
+    bench_needs         needs;
+    void                (*run)(bench_context *, BenchSamples&);
+};
+
+static const bench_case sCases[] = {
+    { "open_cold",          "us", NEEDS_UCM, benchOpenCold },
+    { "open_warm",          "us", NEEDS_UCM, benchOpenWarm },
+    { "route_switch",       "us", NEEDS_UCM, benchRouteSwitch },
+#ifndef ALSA_SIM
+    { "hal_route_switch",   "us", NEEDS_UCM, benchHalRouteSwitch },
+    { "hal_route_gap_soft_mute", "us", NEEDS_UCM, benchHalRouteGapSoftMute },
+    { "hal_route_gap_reopen", "us", NEEDS_UCM, benchHalRouteGapReopen },
+    { "hal_first_write_prewarm", "us", NEEDS_UCM, benchHalFirstWritePrewarm },
+    { "hal_first_write_cold", "us", NEEDS_UCM, benchHalFirstWriteCold },
+#endif
+    { "voice_call_start",   "us", NEEDS_UCM, benchVoiceCallStart },
+    { "write_period_cpu",   "us", NEEDS_UCM, benchWritePeriodCpu },
+    { "ucm_device_lookup",  "ns", NEEDS_UCM, benchUcmDevice },
+#ifndef ALSA_SIM
+    { "device_for_strategy_uncached", "ns", NEEDS_NOTHING, benchDeviceForStrategyUncached },
+    { "device_for_strategy_first", "ns", NEEDS_NOTHING, benchDeviceForStrategyFirst },
+    { "device_for_strategy_repeated", "ns", NEEDS_NOTHING, benchDeviceForStrategyRepeated },
+    { "hal_query_shared_state", "ns", NEEDS_NOTHING, benchHalQueryShared },
+    { "hal_query_parameters", "ns", NEEDS_NOTHING, benchHalQueryParameters },
+#endif
+    { "xrun_recover_prepare", "us", NEEDS_UCM, benchXrunPrepare },
+    { "xrun_recover_reopen", "us", NEEDS_UCM, benchXrunReopen },
+    { "raw_pcm_open",       "us", NEEDS_RAW, benchRawOpen },
+    { "raw_write_period_cpu", "us", NEEDS_RAW, benchRawWriteCpu },
+};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-n iterations] [-c case] [-o file] [-d hw:C,D] [-r]\n"
+            "  -n  samples per case, default %d\n"
+            "  -c  only run cases whose name contains this\n"
+            "  -o  write results to a file instead of stdout\n"
+            "  -d  PCM node for the raw cases, e.g. one from snd-dummy or snd-aloop\n"
+            "  -r  simulator only: real time instead of the virtual clock\n",
+            prog, BENCH_ITERATIONS);
+}
+
+int main(int argc, char **argv)
+{
+    bench_options opts;
+    bench_context ctx;
+    ALSAHandleList list;
+    int c;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.iterations = BENCH_ITERATIONS;
+    opts.out = stdout;
+    while ((c = getopt(argc, argv, "n:c:o:d:rh")) != -1) {
+        switch (c) {
+        case 'n':
+            opts.iterations = atoi(optarg);
+            if (opts.iterations <= 0 || opts.iterations > BENCH_MAX_SAMPLES) {
+                fprintf(stderr, "iterations must be 1 to %d\n", BENCH_MAX_SAMPLES);
+                return 1;
+            }
+            break;
+        case 'c':
+            opts.filter = optarg;
+            break;
+        case 'o':
+            opts.out = fopen(optarg, "w");
+            if (!opts.out) {
+                fprintf(stderr, "cannot open %s: %s\n", optarg, strerror(errno));
+                return 1;
+            }
+            break;
+        case 'd':
+            opts.rawDevice = optarg;
+            break;
+        case 'r':
+            opts.realtime = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.opts = &opts;
+#ifdef ALSA_SIM
+    alsa_sim_config_t config;
+    alsa_sim_default_config(&config);
+    config.realtime = opts.realtime;
+    alsa_sim_configure(&config);
+    BenchTimer::sVirtual = !opts.realtime;
+    ctx.backend = opts.realtime ? "sim-realtime" : "sim";
+#else
+    ctx.backend = "device";
+#endif
+
+    ctx.dev = openModule();
+    if (!ctx.dev) {
+        fprintf(stderr, "cannot open the ALSA module\n");
+        return 1;
+    }
+    ctx.dev->init(ctx.dev, list);
+    snd_use_case_mgr_open(&ctx.ucMgr, BENCH_UCM_CARD);
+    if (!ctx.ucMgr)
+        fprintf(stderr, "no UCM config for %s, only raw cases can run\n", BENCH_UCM_CARD);
+
+    for (size_t i = 0; i < sizeof(sCases) / sizeof(sCases[0]); i++) {
+        const bench_case *bc = &sCases[i];
+        BenchSamples *samples;
+
+        if (opts.filter && !strstr(bc->name, opts.filter))
+            continue;
+        // Sample arrays are large, keep them off the stack
+        samples = new BenchSamples();
+        if (bc->needs == NEEDS_UCM ? ctx.ucMgr != NULL :
+            bc->needs == NEEDS_RAW ? opts.rawDevice != NULL : true)
+            bc->run(&ctx, *samples);
+        samples->report(&ctx, bc->name, bc->unit);
+        delete samples;
+    }
+
+#ifdef ALSA_SIM
+    alsa_sim_counters_t counters;
+    alsa_sim_get_counters(&counters);
+    fprintf(stderr, "simulator: %u transfers, %u xruns, %u ucm sets, %u pcm opens\n",
+            counters.transfers, counters.xruns, counters.calls[ALSA_SIM_UCM_SET],
+            counters.calls[ALSA_SIM_PCM_OPEN]);
+#endif
+
+    if (ctx.ucMgr)
+        snd_use_case_mgr_close(ctx.ucMgr);
+    ctx.dev->common.close(&ctx.dev->common);
+    if (opts.out != stdout)
+        fclose(opts.out);
+    return ctx.failed;
+}
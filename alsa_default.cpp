@@ -19,6 +19,10 @@
 #define LOG_TAG "ALSAModule"
 //#define LOG_NDEBUG 0
 #define LOG_NDDEBUG 0
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <utils/Log.h>
 #include <cutils/properties.h>
 #include <linux/ioctl.h>
@@ -30,6 +34,7 @@
 #endif
 
 #define BTSCO_RATE_16KHZ 16000
+#define PARAMS_CACHE_ENTRIES 16
 
 namespace android_audio_legacy
 {
@@ -37,33 +42,60 @@ namespace android_audio_legacy
 static int      s_device_open(const hw_module_t*, const char*, hw_device_t**);
 static int      s_device_close(hw_device_t*);
 static status_t s_init(alsa_device_t *, ALSAHandleList &);
+static alsa_card_t *s_get_card(alsa_device_t *, int);
 static status_t s_open(alsa_handle_t *);
 static status_t s_close(alsa_handle_t *);
 static status_t s_standby(alsa_handle_t *);
+static status_t s_prepare(alsa_handle_t *);
+static status_t s_flush(alsa_handle_t *);
 static status_t s_route(alsa_handle_t *, uint32_t, int);
 static status_t s_start_voice_call(alsa_handle_t *);
 static status_t s_start_voip_call(alsa_handle_t *);
+static status_t s_set_voip_rate(alsa_handle_t *, uint32_t);
 static status_t s_start_fm(alsa_handle_t *);
-static void     s_set_voice_volume(int);
-static void     s_set_voip_volume(int);
-static void     s_set_mic_mute(int);
-static void     s_set_voip_mic_mute(int);
-static status_t s_set_fm_vol(int);
-static void     s_set_btsco_rate(int);
-static status_t s_set_lpa_vol(int);
-static void     s_enable_wide_voice(bool flag);
-static void     s_enable_fens(bool flag);
-static void     s_set_flags(uint32_t flags);
-
-static char mic_type[25];
-static char curRxUCMDevice[50];
-static char curTxUCMDevice[50];
-static int fluence_mode;
-static int fmVolume;
-static uint32_t mDevSettingsFlag = TTY_OFF;
-static int btsco_samplerate = 8000;
-static bool pflag = false; // flag to check pcm close
- 
+static void     s_set_voice_volume(alsa_card_t *, int);
+static void     s_set_voip_volume(alsa_card_t *, int);
+static void     s_set_mic_mute(alsa_card_t *, int);
+static void     s_set_voip_mic_mute(alsa_card_t *, int);
+static status_t s_set_fm_vol(alsa_card_t *, int);
+static void     s_set_btsco_rate(alsa_card_t *, int);
+static status_t s_set_lpa_vol(alsa_card_t *, int);
+static void     s_enable_wide_voice(alsa_card_t *, bool flag);
+static void     s_enable_fens(alsa_card_t *, bool flag);
+static void     s_set_flags(alsa_card_t *, uint32_t flags);
+
+/*
+ * Hardware params that the driver accepted for a given stream setup. The
+ * refined struct written back by SNDRV_PCM_IOCTL_HW_PARAMS describes one
+ * exact configuration, so handing it back to the same PCM node skips the
+ * refine round trip on every reopen after standby or an xrun.
+ */
+struct alsa_params_entry {
+    bool                     valid;
+    alsa_use_case_t          useCase;            // selects the PCM node via UCM
+    unsigned                 flags;              // direction and channel layout
+    uint32_t                 sampleRate;
+    uint32_t                 channels;
+    unsigned long            reqBuffSize;
+    struct snd_pcm_hw_params params;
+    unsigned                 bufferSize;         // in bytes, as negotiated
+    unsigned                 periodSize;
+};
+
+struct alsa_params_cache {
+    Mutex                    lock;
+    int                      next;               // round robin replacement
+    uint32_t                 hits;
+    uint32_t                 misses;
+    alsa_params_entry        entries[PARAMS_CACHE_ENTRIES];
+};
+
+// Volume to mixer value tables, the policy manager builds the same ones
+static ALSAVolumeCurves sVolumeCurves;
+
+// Guards creating module->cards[], see s_get_card()
+static Mutex sCardLock;
+
 static hw_module_methods_t s_module_methods = {
     open            : s_device_open
 };
@@ -83,7 +115,6 @@ extern "C" const hw_module_t HAL_MODULE_INFO_SYM = {
 static int s_device_open(const hw_module_t* module, const char* name,
         hw_device_t** device)
 {
-    char value[128];
     alsa_device_t *dev;
     dev = (alsa_device_t *) malloc(sizeof(*dev));
     if (!dev) return -ENOMEM;
@@ -96,12 +127,16 @@ static int s_device_open(const hw_module_t* module, const char* name,
     dev->common.module = (hw_module_t *) module;
     dev->common.close = s_device_close;
     dev->init = s_init;
+    dev->getCard = s_get_card;
     dev->open = s_open;
     dev->close = s_close;
     dev->route = s_route;
     dev->standby = s_standby;
+    dev->prepare = s_prepare;
+    dev->flush = s_flush;
     dev->startVoiceCall = s_start_voice_call;
     dev->startVoipCall = s_start_voip_call;
+    dev->setVoipRate = s_set_voip_rate;
     dev->startFm = s_start_fm;
     dev->setVoiceVolume = s_set_voice_volume;
     dev->setVoipVolume = s_set_voip_volume;
@@ -114,18 +149,13 @@ static int s_device_open(const hw_module_t* module, const char* name,
     dev->enableFENS = s_enable_fens;
     dev->setFlags = s_set_flags;
 
-    *device = &dev->common;
-
-    property_get("persist.audio.handset.mic",value,"0");
-    strlcpy(mic_type, value, sizeof(mic_type));
-    property_get("persist.audio.fluence.mode",value,"0");
-    if (!strcmp("broadside", value)) {
-        fluence_mode = FLUENCE_MODE_BROADSIDE;
-    } else {
-        fluence_mode = FLUENCE_MODE_ENDFIRE;
+    // The primary codec card is always there; others are created on demand
+    if (s_get_card(dev, 0) == NULL) {
+        free(dev);
+        return -ENOMEM;
     }
-    strlcpy(curRxUCMDevice, "None", sizeof(curRxUCMDevice));
-    strlcpy(curTxUCMDevice, "None", sizeof(curTxUCMDevice));
+
+    *device = &dev->common;
     LOGD("ALSA module opened");
 
     return 0;
@@ -133,110 +163,275 @@ static int s_device_open(const hw_module_t* module, const char* name,
 
 static int s_device_close(hw_device_t* device)
 {
+    alsa_device_t *dev = (alsa_device_t *)device;
+
+    for (int i = 0; i < ALSA_MAX_CARDS; i++) {
+        if (dev->cards[i]) {
+            delete dev->cards[i]->paramsCache;
+            delete dev->cards[i]->control;
+            free(dev->cards[i]);
+            dev->cards[i] = NULL;
+        }
+    }
     free(device);
     device = NULL;
     return 0;
 }
 
+static alsa_card_t *s_get_card(alsa_device_t *module, int id)
+{
+    char value[PROPERTY_VALUE_MAX];
+    alsa_card_t *card;
+
+    if (id < 0 || id >= ALSA_MAX_CARDS) {
+        LOGE("s_get_card: invalid card %d", id);
+        return NULL;
+    }
+    // Any thread may ask for a card first, create it only once
+    Mutex::Autolock lock(sCardLock);
+    if (module->cards[id])
+        return module->cards[id];
+
+    card = (alsa_card_t *) calloc(1, sizeof(*card));
+    if (!card)
+        return NULL;
+
+    card->id = id;
+    snprintf(card->controlPath, sizeof(card->controlPath), "/dev/snd/controlC%d", id);
+    card->control = new ALSAControl(card->controlPath);
+    card->paramsCache = new alsa_params_cache();
+    strlcpy(card->curRxUCMDevice, "None", sizeof(card->curRxUCMDevice));
+    strlcpy(card->curTxUCMDevice, "None", sizeof(card->curTxUCMDevice));
+    card->devSettingsFlag = TTY_OFF;
+    card->callMode = AudioSystem::MODE_NORMAL;
+    card->btscoSampleRate = 8000;
+
+    property_get("persist.audio.handset.mic",value,"0");
+    strlcpy(card->micType, value, sizeof(card->micType));
+    property_get("persist.audio.fluence.mode",value,"0");
+    if (!strcmp("broadside", value)) {
+        card->fluenceMode = FLUENCE_MODE_BROADSIDE;
+    } else {
+        card->fluenceMode = FLUENCE_MODE_ENDFIRE;
+    }
+
+    module->cards[id] = card;
+    LOGD("s_get_card: card %d control %s", id, card->controlPath);
+    return card;
+}
+
 // ----------------------------------------------------------------------------
 
 static const int DEFAULT_SAMPLE_RATE = ALSA_DEFAULT_SAMPLE_RATE;
 
 static void switchDevice(alsa_handle_t *handle, uint32_t devices, uint32_t mode);
-static char *getUCMDevice(uint32_t devices, int input);
+const char *getUCMDevice(alsa_card_t *card, uint32_t devices, int input);
 static void disableDevice(alsa_handle_t *handle);
 
-static int callMode = AudioSystem::MODE_NORMAL;
 // ----------------------------------------------------------------------------
 
-int deviceName(alsa_handle_t *handle, unsigned flags, char **value)
+/*
+ * The PCM node behind a use case is fixed by the UCM config, so ask UCM
+ * once per card and copy the cached string out afterwards. The routing
+ * thread and the stream threads both get here, so the cache is only
+ * touched under sNodeLock. value must hold ALSA_PCM_NODE_LEN bytes.
+ */
+static Mutex sNodeLock;
+
+int deviceName(alsa_handle_t *handle, unsigned flags, char *value)
 {
     int ret = 0;
     char ident[70];
+    char *node = handle->card->pcmNode[handle->useCase][(flags & PCM_IN) ? 1 : 0];
+    char *ucmValue = NULL;
 
-    if (flags & PCM_IN) {
-        strlcpy(ident, "CapturePCM/", sizeof(ident));
-    } else {
-        strlcpy(ident, "PlaybackPCM/", sizeof(ident));
+    Mutex::Autolock autoLock(sNodeLock);
+    if (node[0] == '\0') {
+        if (flags & PCM_IN) {
+            strlcpy(ident, "CapturePCM/", sizeof(ident));
+        } else {
+            strlcpy(ident, "PlaybackPCM/", sizeof(ident));
+        }
+        strlcat(ident, useCaseName(handle->useCase), sizeof(ident));
+        ret = snd_use_case_get(handle->ucMgr, ident, (const char **)&ucmValue);
+        if (ret < 0 || ucmValue == NULL) {
+            value[0] = '\0';
+            return ret < 0 ? ret : -EINVAL;
+        }
+        if (strlcpy(node, ucmValue, ALSA_PCM_NODE_LEN) >= ALSA_PCM_NODE_LEN) {
+            LOGE("deviceName: PCM node '%s' too long", ucmValue);
+            node[0] = '\0';
+            value[0] = '\0';
+            free(ucmValue);
+            return -ENAMETOOLONG;
+        }
+        free(ucmValue);
     }
-    strlcat(ident, handle->useCase, sizeof(ident));
-    ret = snd_use_case_get(handle->ucMgr, ident, (const char **)value);
-    LOGD("Device value returned is %s", (*value));
+    strlcpy(value, node, ALSA_PCM_NODE_LEN);
+    LOGD_RATELIMIT("Device value returned is %s", value);
     return ret;
 }
 
-status_t setHardwareParams(alsa_handle_t *handle)
+static bool paramsMatch(const alsa_params_entry *entry, alsa_handle_t *handle,
+                        struct pcm *pcm, unsigned long reqBuffSize)
 {
-    struct snd_pcm_hw_params *params;
-    unsigned long bufferSize, reqBuffSize;
-    unsigned int periodTime, bufferTime;
-    unsigned int requestedRate = handle->sampleRate;
-    int status = 0;
-
-    params = (snd_pcm_hw_params*) calloc(1, sizeof(struct snd_pcm_hw_params));
-    if (!params) {
-		//SMANI:: Commented to fix build issues. FIX IT.
-        //LOG_ALWAYS_FATAL("Failed to allocate ALSA hardware parameters!");
-        return NO_INIT;
+    return entry->valid &&
+           entry->useCase == handle->useCase &&
+           entry->flags == pcm->flags &&
+           entry->sampleRate == handle->sampleRate &&
+           entry->channels == handle->channels &&
+           entry->reqBuffSize == reqBuffSize;
+}
+
+// Replay cached params for this setup; false if there is nothing usable
+static bool setCachedHardwareParams(alsa_handle_t *handle, struct pcm *pcm,
+                                    unsigned long reqBuffSize)
+{
+    alsa_params_cache *cache = handle->card ? handle->card->paramsCache : NULL;
+    struct snd_pcm_hw_params params;
+    unsigned bufferSize, periodSize;
+    int i;
+
+    if (!cache)
+        return false;
+
+    // Copy everything out under the lock, the entry may be evicted and
+    // reused by another open while the ioctl runs
+    {
+        Mutex::Autolock autoLock(cache->lock);
+
+        for (i = 0; i < PARAMS_CACHE_ENTRIES; i++) {
+            if (paramsMatch(&cache->entries[i], handle, pcm, reqBuffSize))
+                break;
+        }
+        if (i == PARAMS_CACHE_ENTRIES) {
+            cache->misses++;
+            return false;
+        }
+        // The ioctl writes back into the struct, keep the cached copy intact
+        params = cache->entries[i].params;
+        bufferSize = cache->entries[i].bufferSize;
+        periodSize = cache->entries[i].periodSize;
+    }
+
+    if (param_set_hw_params(pcm, &params)) {
+        LOGW("setHardwareParams: cached params for %s rejected, renegotiating",
+             useCaseName(handle->useCase));
+        Mutex::Autolock autoLock(cache->lock);
+        for (i = 0; i < PARAMS_CACHE_ENTRIES; i++) {
+            if (paramsMatch(&cache->entries[i], handle, pcm, reqBuffSize))
+                cache->entries[i].valid = false;
+        }
+        return false;
     }
 
-    reqBuffSize = handle->bufferSize;
+    pcm->buffer_size = bufferSize;
+    pcm->period_size = periodSize;
+    Mutex::Autolock autoLock(cache->lock);
+    cache->hits++;
+    LOGV("setHardwareParams: replayed cached params for %s (%u hits, %u misses)",
+         useCaseName(handle->useCase), cache->hits, cache->misses);
+    return true;
+}
+
+static void cacheHardwareParams(alsa_handle_t *handle, struct pcm *pcm,
+                                unsigned long reqBuffSize,
+                                const struct snd_pcm_hw_params *params)
+{
+    alsa_params_cache *cache = handle->card ? handle->card->paramsCache : NULL;
+    alsa_params_entry *entry;
+
+    if (!cache)
+        return;
+
+    Mutex::Autolock autoLock(cache->lock);
+    entry = &cache->entries[cache->next];
+    cache->next = (cache->next + 1) % PARAMS_CACHE_ENTRIES;
+
+    entry->valid = true;
+    entry->useCase = handle->useCase;
+    entry->flags = pcm->flags;
+    entry->sampleRate = handle->sampleRate;
+    entry->channels = handle->channels;
+    entry->reqBuffSize = reqBuffSize;
+    entry->params = *params;
+    entry->bufferSize = pcm->buffer_size;
+    entry->periodSize = pcm->period_size;
+}
+
+/*
+ * Negotiate hw params on one PCM of the handle. Only reads the handle, so
+ * the two directions of a call can be set up from different threads.
+ */
+static status_t setPcmHardwareParams(alsa_handle_t *handle, struct pcm *pcm,
+                                     unsigned long reqBuffSize)
+{
+    struct snd_pcm_hw_params params;
+
     LOGD("setHardwareParams: reqBuffSize %d channels %d sampleRate %d",
          (int) reqBuffSize, handle->channels, handle->sampleRate);
 
-    param_init(params);
-    param_set_mask(params, SNDRV_PCM_HW_PARAM_ACCESS,
-                   SNDRV_PCM_ACCESS_RW_INTERLEAVED);
-    param_set_mask(params, SNDRV_PCM_HW_PARAM_FORMAT,
-                   SNDRV_PCM_FORMAT_S16_LE);
-    param_set_mask(params, SNDRV_PCM_HW_PARAM_SUBFORMAT,
-                   SNDRV_PCM_SUBFORMAT_STD);
-    param_set_min(params, SNDRV_PCM_HW_PARAM_PERIOD_BYTES, reqBuffSize);
-    param_set_int(params, SNDRV_PCM_HW_PARAM_SAMPLE_BITS, 16);
-    param_set_int(params, SNDRV_PCM_HW_PARAM_FRAME_BITS,
-                   handle->channels - 1 ? 32 : 16);
-    param_set_int(params, SNDRV_PCM_HW_PARAM_CHANNELS,
-                  handle->channels);
-    param_set_int(params, SNDRV_PCM_HW_PARAM_RATE, handle->sampleRate);
-    param_set_hw_refine(handle->handle, params);
-
-    if (param_set_hw_params(handle->handle, params)) {
-        LOGE("cannot set hw params");
-        return NO_INIT;
+    if (!setCachedHardwareParams(handle, pcm, reqBuffSize)) {
+        memset(&params, 0, sizeof(params));
+        param_init(&params);
+        param_set_mask(&params, SNDRV_PCM_HW_PARAM_ACCESS,
+                       SNDRV_PCM_ACCESS_RW_INTERLEAVED);
+        param_set_mask(&params, SNDRV_PCM_HW_PARAM_FORMAT,
+                       SNDRV_PCM_FORMAT_S16_LE);
+        param_set_mask(&params, SNDRV_PCM_HW_PARAM_SUBFORMAT,
+                       SNDRV_PCM_SUBFORMAT_STD);
+        param_set_min(&params, SNDRV_PCM_HW_PARAM_PERIOD_BYTES, reqBuffSize);
+        param_set_int(&params, SNDRV_PCM_HW_PARAM_SAMPLE_BITS, 16);
+        param_set_int(&params, SNDRV_PCM_HW_PARAM_FRAME_BITS,
+                       handle->channels - 1 ? 32 : 16);
+        param_set_int(&params, SNDRV_PCM_HW_PARAM_CHANNELS,
+                      handle->channels);
+        param_set_int(&params, SNDRV_PCM_HW_PARAM_RATE, handle->sampleRate);
+        param_set_hw_refine(pcm, &params);
+
+        if (param_set_hw_params(pcm, &params)) {
+            LOGE("cannot set hw params");
+            return NO_INIT;
+        }
+        param_dump(&params);
+
+        pcm->buffer_size = pcm_buffer_size(&params);
+        pcm->period_size = pcm_period_size(&params);
+        cacheHardwareParams(handle, pcm, reqBuffSize, &params);
     }
-    param_dump(params);
 
-    handle->handle->buffer_size = pcm_buffer_size(params);
-    handle->handle->period_size = pcm_period_size(params);
-    handle->handle->period_cnt = handle->handle->buffer_size/handle->handle->period_size;
+    pcm->period_cnt = pcm->buffer_size/pcm->period_size;
     LOGD("setHardwareParams: buffer_size %d, period_size %d, period_cnt %d",
-        handle->handle->buffer_size, handle->handle->period_size,
-        handle->handle->period_cnt);
-    handle->handle->rate = handle->sampleRate;
-    handle->handle->channels = handle->channels;
-    handle->periodSize = handle->handle->period_size;
-    handle->bufferSize = handle->handle->period_size;
+        pcm->buffer_size, pcm->period_size, pcm->period_cnt);
+    pcm->rate = handle->sampleRate;
+    pcm->channels = handle->channels;
     return NO_ERROR;
 }
 
-status_t setSoftwareParams(alsa_handle_t *handle)
+status_t setHardwareParams(alsa_handle_t *handle)
+{
+    status_t err = setPcmHardwareParams(handle, handle->handle, handle->bufferSize);
+
+    if (err == NO_ERROR) {
+        handle->periodSize = handle->handle->period_size;
+        handle->bufferSize = handle->handle->period_size;
+    }
+    return err;
+}
+
+static status_t setPcmSoftwareParams(alsa_handle_t *handle, struct pcm *pcm)
 {
-    struct snd_pcm_sw_params* params;
-    struct pcm* pcm = handle->handle;
+    struct snd_pcm_sw_params swParams;
+    struct snd_pcm_sw_params* params = &swParams;
 
     unsigned long periodSize = pcm->period_size;
 
-    params = (snd_pcm_sw_params*) calloc(1, sizeof(struct snd_pcm_sw_params));
-    if (!params) {
-        LOG_ALWAYS_FATAL("Failed to allocate ALSA software parameters!");
-        return NO_INIT;
-    }
+    memset(params, 0, sizeof(*params));
 
     // Get the current software parameters
     params->tstamp_mode = SNDRV_PCM_TSTAMP_NONE;
     params->period_step = 1;
-    if(((!strcmp(handle->useCase,SND_USE_CASE_MOD_PLAY_VOIP)) ||
-        (!strcmp(handle->useCase,SND_USE_CASE_VERB_IP_VOICECALL)))){
+    if (useCaseIs(handle->useCase, UC_VOIP)) {
           LOGV("setparam:  start & stop threshold for Voip ");
           params->avail_min = handle->channels - 1 ? periodSize/4 : periodSize/2;
           params->start_threshold = periodSize/2;
@@ -249,17 +444,46 @@ status_t setSoftwareParams(alsa_handle_t *handle)
     params->silence_threshold = 0;
     params->silence_size = 0;
 
-    if (param_set_sw_params(handle->handle, params)) {
+    if (param_set_sw_params(pcm, params)) {
         LOGE("cannot set sw params");
         return NO_INIT;
     }
     return NO_ERROR;
 }
 
+status_t setSoftwareParams(alsa_handle_t *handle)
+{
+    return setPcmSoftwareParams(handle, handle->handle);
+}
+
+/*
+ * AudioStreamOutALSA::drain() waits on a dup of the PCM fd without the
+ * route lock, and that keeps the substream open: a reopen would fail
+ * with EBUSY. Stop the DMA, which ends the drain, and give the stream a
+ * bounded time to close its copy. Caller holds the route lock for writing.
+ */
+static void endDrain(alsa_handle_t *handle)
+{
+    if (android_atomic_acquire_load(&handle->drainFd) < 0)
+        return;
+    if (ioctl(handle->handle->fd, SNDRV_PCM_IOCTL_DROP))
+        LOGW("endDrain: drop failed, errno %d", errno);
+    for (int i = 0; i < DRAIN_CLOSE_WAIT_MS; i++) {
+        if (android_atomic_acquire_load(&handle->drainFd) < 0)
+            return;
+        usleep(1000);
+    }
+    LOGW("endDrain: drain still holds the PCM after %d ms, reopen may fail",
+         DRAIN_CLOSE_WAIT_MS);
+}
+
 void switchDevice(alsa_handle_t *handle, uint32_t devices, uint32_t mode)
 {
+    ALSA_TRACE_SCOPE("switchDevice");
+    alsa_card_t *card = handle->card;
     bool inCallDevSwitch = false;
-    char *rxDevice, *txDevice, ident[70];
+    const char *rxDevice, *txDevice;
+    char ident[70];
     LOGV("%s: device %d", __FUNCTION__, devices);
 
     if ((mode == AudioSystem::MODE_IN_CALL)  || (mode == AudioSystem::MODE_IN_COMMUNICATION)) {
@@ -298,86 +522,84 @@ void switchDevice(alsa_handle_t *handle, uint32_t devices, uint32_t mode)
         }
     }
 
-    rxDevice = getUCMDevice(devices & AudioSystem::DEVICE_OUT_ALL, 0);
-    txDevice = getUCMDevice(devices & AudioSystem::DEVICE_IN_ALL, 1);
+    rxDevice = getUCMDevice(card, devices & AudioSystem::DEVICE_OUT_ALL, 0);
+    txDevice = getUCMDevice(card, devices & AudioSystem::DEVICE_IN_ALL, 1);
 
     if (rxDevice != NULL) {
-        if ((handle->handle) && (((!strncmp(rxDevice, DEVICE_SPEAKER_HEADSET, strlen(DEVICE_SPEAKER_HEADSET))) &&
-            ((!strncmp(curRxUCMDevice, DEVICE_HEADPHONES, strlen(DEVICE_HEADPHONES))) ||
-            (!strncmp(curRxUCMDevice, DEVICE_HEADSET, strlen(DEVICE_HEADSET))))) ||
-            (((!strncmp(curRxUCMDevice, DEVICE_SPEAKER_HEADSET, strlen(DEVICE_SPEAKER_HEADSET))) &&
+        if ((handle->handle) && (handle->softMute == SOFT_MUTE_OFF) &&
+            (((!strncmp(rxDevice, DEVICE_SPEAKER_HEADSET, strlen(DEVICE_SPEAKER_HEADSET))) &&
+            ((!strncmp(card->curRxUCMDevice, DEVICE_HEADPHONES, strlen(DEVICE_HEADPHONES))) ||
+            (!strncmp(card->curRxUCMDevice, DEVICE_HEADSET, strlen(DEVICE_HEADSET))))) ||
+            (((!strncmp(card->curRxUCMDevice, DEVICE_SPEAKER_HEADSET, strlen(DEVICE_SPEAKER_HEADSET))) &&
             ((!strncmp(rxDevice, DEVICE_HEADPHONES, strlen(DEVICE_HEADPHONES))) ||
             (!strncmp(rxDevice, DEVICE_HEADSET, strlen(DEVICE_HEADSET))))))) &&
-            ((!strncmp(handle->useCase, SND_USE_CASE_VERB_HIFI, strlen(SND_USE_CASE_VERB_HIFI))) ||
-            (!strncmp(handle->useCase, SND_USE_CASE_MOD_PLAY_MUSIC, strlen(SND_USE_CASE_MOD_PLAY_MUSIC))))) {
+            useCaseIs(handle->useCase, UC_MUSIC)) {
+            endDrain(handle);
             pcm_close(handle->handle);
             handle->handle=NULL;
             handle->rxHandle=NULL;
-            pflag = true;
+            card->pcmClosed = true;
         }
     }
 
     if ((rxDevice != NULL) && (txDevice != NULL)) {
-        if (((strcmp(rxDevice, curRxUCMDevice)) || (strcmp(txDevice, curTxUCMDevice))) &&
+        if (((strcmp(rxDevice, card->curRxUCMDevice)) || (strcmp(txDevice, card->curTxUCMDevice))) &&
             (mode == AudioSystem::MODE_IN_CALL))
             inCallDevSwitch = true;
     }
     if (rxDevice != NULL) {
-        if (strcmp(curRxUCMDevice, "None")) {
-            if ((!strcmp(rxDevice, curRxUCMDevice)) && (inCallDevSwitch != true)){
+        ALSA_TRACE_BEGIN("ucm_rx_device");
+        if (strcmp(card->curRxUCMDevice, "None")) {
+            if ((!strcmp(rxDevice, card->curRxUCMDevice)) && (inCallDevSwitch != true)){
                 LOGV("Required device is already set, ignoring device enable");
                 snd_use_case_set(handle->ucMgr, "_enadev", rxDevice);
             } else {
                 strlcpy(ident, "_swdev/", sizeof(ident));
-                strlcat(ident, curRxUCMDevice, sizeof(ident));
+                strlcat(ident, card->curRxUCMDevice, sizeof(ident));
                 snd_use_case_set(handle->ucMgr, ident, rxDevice);
             }
         } else {
             snd_use_case_set(handle->ucMgr, "_enadev", rxDevice);
         }
-        strlcpy(curRxUCMDevice, rxDevice, sizeof(curRxUCMDevice));
+        ALSA_TRACE_END();
+        if (rxDevice != card->curRxUCMDevice)
+            strlcpy(card->curRxUCMDevice, rxDevice, sizeof(card->curRxUCMDevice));
         if (devices & AudioSystem::DEVICE_OUT_FM)
-            s_set_fm_vol(fmVolume);
+            s_set_fm_vol(card, card->fmVolume);
     }
     if (txDevice != NULL) {
-       if (strcmp(curTxUCMDevice, "None")) {
-           if ((!strcmp(txDevice, curTxUCMDevice)) && (inCallDevSwitch != true)){
+       ALSA_TRACE_BEGIN("ucm_tx_device");
+       if (strcmp(card->curTxUCMDevice, "None")) {
+           if ((!strcmp(txDevice, card->curTxUCMDevice)) && (inCallDevSwitch != true)){
                 LOGV("Required device is already set, ignoring device enable");
                 snd_use_case_set(handle->ucMgr, "_enadev", txDevice);
             } else {
                 strlcpy(ident, "_swdev/", sizeof(ident));
-                strlcat(ident, curTxUCMDevice, sizeof(ident));
+                strlcat(ident, card->curTxUCMDevice, sizeof(ident));
                 snd_use_case_set(handle->ucMgr, ident, txDevice);
             }
         } else {
             snd_use_case_set(handle->ucMgr, "_enadev", txDevice);
         }
-        strlcpy(curTxUCMDevice, txDevice, sizeof(curTxUCMDevice));
+        ALSA_TRACE_END();
+        if (txDevice != card->curTxUCMDevice)
+            strlcpy(card->curTxUCMDevice, txDevice, sizeof(card->curTxUCMDevice));
     }
 
     if (rxDevice != NULL) {
-        if (pflag && (((!strncmp(rxDevice, DEVICE_SPEAKER_HEADSET, strlen(DEVICE_SPEAKER_HEADSET))) &&
-            ((!strncmp(curRxUCMDevice, DEVICE_HEADPHONES, strlen(DEVICE_HEADPHONES))) ||
-            (!strncmp(curRxUCMDevice, DEVICE_HEADSET, strlen(DEVICE_HEADSET))))) ||
-            (((!strncmp(curRxUCMDevice, DEVICE_SPEAKER_HEADSET, strlen(DEVICE_SPEAKER_HEADSET))) &&
+        if (card->pcmClosed && (((!strncmp(rxDevice, DEVICE_SPEAKER_HEADSET, strlen(DEVICE_SPEAKER_HEADSET))) &&
+            ((!strncmp(card->curRxUCMDevice, DEVICE_HEADPHONES, strlen(DEVICE_HEADPHONES))) ||
+            (!strncmp(card->curRxUCMDevice, DEVICE_HEADSET, strlen(DEVICE_HEADSET))))) ||
+            (((!strncmp(card->curRxUCMDevice, DEVICE_SPEAKER_HEADSET, strlen(DEVICE_SPEAKER_HEADSET))) &&
             ((!strncmp(rxDevice, DEVICE_HEADPHONES, strlen(DEVICE_HEADPHONES))) ||
             (!strncmp(rxDevice, DEVICE_HEADSET, strlen(DEVICE_HEADSET))))))) &&
-            ((!strncmp(handle->useCase, SND_USE_CASE_VERB_HIFI, strlen(SND_USE_CASE_VERB_HIFI))) ||
-            (!strncmp(handle->useCase, SND_USE_CASE_MOD_PLAY_MUSIC, strlen(SND_USE_CASE_MOD_PLAY_MUSIC))))) {
+            useCaseIs(handle->useCase, UC_MUSIC)) {
             s_open(handle);
-            pflag = false;
+            card->pcmClosed = false;
         }
     }
 
-    if (rxDevice != NULL) {
-        free(rxDevice);
-        rxDevice = NULL;
-    }
-    if (txDevice != NULL) {
-        free(txDevice);
-        txDevice = NULL;
-    }
-    LOGD("switchDevice: curTxUCMDevivce %s curRxDevDevice %s", curTxUCMDevice, curRxUCMDevice);
+    LOGD("switchDevice: curTxUCMDevivce %s curRxDevDevice %s", card->curTxUCMDevice, card->curRxUCMDevice);
 }
 
 // ----------------------------------------------------------------------------
@@ -393,19 +615,20 @@ static status_t s_init(alsa_device_t *module, ALSAHandleList &list)
 
 static status_t s_open(alsa_handle_t *handle)
 {
-    char *devName;
+    char devName[ALSA_PCM_NODE_LEN];
     unsigned flags = 0;
     int err = NO_ERROR;
 
     /* No need to call s_close for LPA as pcm device open and close is handled by LPAPlayer in stagefright */
-    if((!strcmp(handle->useCase, SND_USE_CASE_VERB_HIFI_LOW_POWER)) || (!strcmp(handle->useCase, SND_USE_CASE_MOD_PLAY_LPA))) {
+    if (useCaseIs(handle->useCase, UC_LPA)) {
         LOGD("s_open: Opening LPA playback");
         return NO_ERROR;
     }
 
+    ALSA_TRACE_SCOPE("s_open");
     s_close(handle);
 
-    LOGD("s_open: handle %p", handle);
+    LOGD_RATELIMIT("s_open: handle %p", handle);
 
     // ASoC multicomponent requires a valid path (frontend/backend) for
     // the device to be opened
@@ -413,8 +636,7 @@ static status_t s_open(alsa_handle_t *handle)
     // The PCM stream is opened in blocking mode, per ALSA defaults.  The
     // AudioFlinger seems to assume blocking mode too, so asynchronous mode
     // should not be used.
-    if ((!strcmp(handle->useCase, SND_USE_CASE_VERB_HIFI)) ||
-        (!strcmp(handle->useCase, SND_USE_CASE_MOD_PLAY_MUSIC))) {
+    if (useCaseIs(handle->useCase, UC_MUSIC)) {
         flags = PCM_OUT;
     } else {
         flags = PCM_IN;
@@ -424,39 +646,42 @@ static status_t s_open(alsa_handle_t *handle)
     } else {
         flags |= PCM_STEREO;
     }
-    if (deviceName(handle, flags, &devName) < 0) {
-        LOGE("Failed to get pcm device node: %s", devName);
+    if (deviceName(handle, flags, devName) < 0) {
+        LOGE("Failed to get pcm device node for %s", useCaseName(handle->useCase));
         return NO_INIT;
     }
+    ALSA_TRACE_BEGIN("pcm_open");
     handle->handle = pcm_open(flags, (char*)devName);
+    ALSA_TRACE_END();
 
     if (!handle->handle) {
         LOGE("s_open: Failed to initialize ALSA device '%s'", devName);
-        free(devName);
         return NO_INIT;
     }
 
     handle->handle->flags = flags;
+    ALSA_TRACE_BEGIN("pcm_params");
     err = setHardwareParams(handle);
 
     if (err == NO_ERROR) {
         err = setSoftwareParams(handle);
     }
+    ALSA_TRACE_END();
 
     if(err != NO_ERROR) {
         LOGE("Set HW/SW params failed: Closing the pcm stream");
         s_standby(handle);
     }
 
-    free(devName);
     return NO_ERROR;
 }
 
 static status_t s_start_voip_call(alsa_handle_t *handle)
 {
+    ALSA_TRACE_SCOPE("s_start_voip_call");
 
-    char* devName;
-    char* devName1;
+    char devName[ALSA_PCM_NODE_LEN];
+    char devName1[ALSA_PCM_NODE_LEN];
     unsigned flags = 0;
     int err = NO_ERROR;
     uint8_t voc_pkt[VOIP_BUFFER_MAX_SIZE];
@@ -466,7 +691,7 @@ static status_t s_start_voip_call(alsa_handle_t *handle)
     flags |= PCM_MONO;
     LOGV("s_open:s_start_voip_call  handle %p", handle);
 
-    if (deviceName(handle, flags, &devName) < 0) {
+    if (deviceName(handle, flags, devName) < 0) {
          LOGE("Failed to get pcm device node");
          return NO_INIT;
     }
@@ -474,7 +699,6 @@ static status_t s_start_voip_call(alsa_handle_t *handle)
      handle->handle = pcm_open(flags, (char*)devName);
 
      if (!handle->handle) {
-          free(devName);
           LOGE("s_open: Failed to initialize ALSA device '%s'", devName);
           return NO_INIT;
      }
@@ -499,20 +723,18 @@ static status_t s_start_voip_call(alsa_handle_t *handle)
      memset(&voc_pkt,0,sizeof(voc_pkt));
      pcm_write(handle->handle,&voc_pkt,handle->handle->period_size);
      handle->rxHandle = handle->handle;
-     free(devName);
      LOGV("s_open: DEVICE_IN_COMMUNICATION ");
      flags = PCM_IN;
      flags |= PCM_MONO;
      handle->handle = 0;
 
-     if (deviceName(handle, flags, &devName1) < 0) {
+     if (deviceName(handle, flags, devName1) < 0) {
         LOGE("Failed to get pcm device node");
         return NO_INIT;
      }
      handle->handle = pcm_open(flags, (char*)devName1);
 
      if (!handle->handle) {
-         free(devName);
          LOGE("s_open: Failed to initialize ALSA device '%s'", devName);
          return NO_INIT;
      }
@@ -541,213 +763,321 @@ static status_t s_start_voip_call(alsa_handle_t *handle)
      return NO_ERROR;
 }
 
-static status_t s_start_voice_call(alsa_handle_t *handle)
+/*
+ * Reprogram one VoIP PCM in place: drop what is queued, renegotiate
+ * hw/sw params at the new rate and prepare it again. The PCM stays open,
+ * so the DSP keeps its VoIP session and only restarts the stream.
+ */
+static status_t reconfigVoipPcm(alsa_handle_t *handle, struct pcm *pcm, unsigned bufferSize)
 {
-    char* devName;
-    unsigned flags = 0;
-    int err = NO_ERROR;
-
-    LOGD("s_start_voice_call: handle %p", handle);
-    // ASoC multicomponent requires a valid path (frontend/backend) for
-    // the device to be opened
-
-    flags = PCM_OUT | PCM_MONO;
-    if (deviceName(handle, flags, &devName) < 0) {
-        LOGE("Failed to get pcm device node");
-        return NO_INIT;
-    }
-    handle->handle = pcm_open(flags, (char*)devName);
-    if (!handle->handle) {
-        LOGE("s_start_voicecall: could not open PCM device");
-        goto Error;
-    }
-
-    handle->handle->flags = flags;
-    err = setHardwareParams(handle);
-    if(err != NO_ERROR) {
-        LOGE("s_start_voice_call: setHardwareParams failed");
-        goto Error;
-    }
-
-    err = setSoftwareParams(handle);
-    if(err != NO_ERROR) {
-        LOGE("s_start_voice_call: setSoftwareParams failed");
-        goto Error;
-    }
+    status_t err;
 
-    err = pcm_prepare(handle->handle);
-    if(err != NO_ERROR) {
-        LOGE("s_start_voice_call: pcm_prepare failed");
-        goto Error;
+    if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_DROP)) {
+        LOGE("reconfigVoipPcm: drop failed, errno %d", errno);
+        return UNKNOWN_ERROR;
     }
 
-    if (ioctl(handle->handle->fd, SNDRV_PCM_IOCTL_START)) {
-        LOGE("s_start_voice_call:SNDRV_PCM_IOCTL_START failed\n");
-        goto Error;
+    err = setPcmHardwareParams(handle, pcm, bufferSize);
+    if (err == NO_ERROR)
+        err = setPcmSoftwareParams(handle, pcm);
+    if (err == NO_ERROR && pcm_prepare(pcm))
+        err = UNKNOWN_ERROR;
+    if (err == NO_ERROR) {
+        handle->periodSize = pcm->period_size;
+        handle->bufferSize = pcm->period_size;
     }
+    return err;
+}
 
-    // Store the PCM playback device pointer in rxHandle
-    handle->rxHandle = handle->handle;
-    free(devName);
+static status_t s_set_voip_rate(alsa_handle_t *handle, uint32_t rate)
+{
+    ALSA_TRACE_SCOPE("s_set_voip_rate");
+    uint8_t voc_pkt[VOIP_BUFFER_MAX_SIZE];
+    unsigned bufferSize;
+    nsecs_t start = systemTime();
+    status_t err;
+
+    if (rate == VOIP_SAMPLING_RATE_8K)
+        bufferSize = VOIP_BUFFER_SIZE_8K;
+    else if (rate == VOIP_SAMPLING_RATE_16K)
+        bufferSize = VOIP_BUFFER_SIZE_16K;
+    else
+        return BAD_VALUE;
+
+    if (handle->sampleRate == rate)
+        return NO_ERROR;
 
-    // Open PCM capture device
-    flags = PCM_IN | PCM_MONO;
-    if (deviceName(handle, flags, &devName) < 0) {
-        LOGE("Failed to get pcm device node");
-        goto Error;
-    }
-    handle->handle = pcm_open(flags, (char*)devName);
-    if (!handle->handle) {
-        free(devName);
-        goto Error;
-    }
+    LOGD("s_set_voip_rate: %d -> %d", handle->sampleRate, rate);
+    handle->sampleRate = rate;
+    if (!handle->handle || !handle->rxHandle)
+        goto restart;
 
-    handle->handle->flags = flags;
-    err = setHardwareParams(handle);
-    if(err != NO_ERROR) {
-        LOGE("s_start_voice_call: setHardwareParams failed");
-        goto Error;
+    // msm-pcm-voip picks the NB/WB network from the rx hw_params, so the
+    // rx side goes first exactly as s_start_voip_call() orders it.
+    err = reconfigVoipPcm(handle, handle->rxHandle, bufferSize);
+    if (err == NO_ERROR) {
+        memset(&voc_pkt, 0, sizeof(voc_pkt));
+        pcm_write(handle->rxHandle, &voc_pkt, handle->rxHandle->period_size);
+        err = reconfigVoipPcm(handle, handle->handle, bufferSize);
     }
+    if (err != NO_ERROR)
+        goto restart;
 
-    err = setSoftwareParams(handle);
-    if(err != NO_ERROR) {
-        LOGE("s_start_voice_call: setSoftwareParams failed");
-        goto Error;
-    }
+    memset(&voc_pkt, 0, sizeof(voc_pkt));
+    pcm_read(handle->handle, &voc_pkt, handle->handle->period_size);
+    LOGD("s_set_voip_rate: switched in %lld us",
+         (long long)((systemTime() - start) / 1000));
+    return NO_ERROR;
 
-    err = pcm_prepare(handle->handle);
-    if(err != NO_ERROR) {
-        LOGE("s_start_voice_call: pcm_prepare failed");
-        goto Error;
+restart:
+    // Same recovery as a failed VoIP write: close both and start over,
+    // with the PCMs already gone s_close() leaves the UCM device alone.
+    LOGE("s_set_voip_rate: in place switch failed, restarting VoIP call");
+    if (handle->rxHandle) {
+        pcm_close(handle->rxHandle);
+        handle->rxHandle = NULL;
     }
-
-    if (ioctl(handle->handle->fd, SNDRV_PCM_IOCTL_START)) {
-        LOGE("s_start_voice_call:SNDRV_PCM_IOCTL_START failed\n");
-        goto Error;
+    if (handle->handle) {
+        pcm_close(handle->handle);
+        handle->handle = NULL;
     }
-
-    free(devName);
-    return NO_ERROR;
-
-Error:
-    LOGE("s_start_voice_call: Failed to initialize ALSA device '%s'", devName);
-    free(devName);
-    s_close(handle);
-    return NO_INIT;
+    handle->bufferSize = bufferSize;
+    return s_start_voip_call(handle);
 }
 
-static status_t s_start_fm(alsa_handle_t *handle)
-{
-    char *devName;
-    unsigned flags = 0;
-    int err = NO_ERROR;
-
-    LOGE("s_start_fm: handle %p", handle);
+/*
+ * Bring-up of one direction of a voice or FM call. Opening the PCM and
+ * negotiating its params does not depend on the use case verb on msm8960,
+ * so both directions do that on their own thread while the caller applies
+ * the verb. Prepare and START need the FE connected to its backends and
+ * wait for the verb to be in.
+ *
+ * ASoC multicomponent in general requires a valid path (frontend/backend)
+ * for the device to be opened, so if the early open fails the caller
+ * retries in the classic order, with the verb already applied.
+ */
+struct call_gate {
+    Mutex                   lock;
+    Condition               cond;
+    bool                    open;
+};
 
-    // ASoC multicomponent requires a valid path (frontend/backend) for
-    // the device to be opened
+struct pcm_bringup {
+    alsa_handle_t *         handle;
+    call_gate *             gate;
+    unsigned                flags;
+    struct pcm *            pcm;
+    status_t                err;
+    nsecs_t                 openNs;
+    nsecs_t                 paramsNs;
+    nsecs_t                 waitNs;
+    nsecs_t                 startNs;
+};
 
-    flags = PCM_OUT | PCM_STEREO;
-    if (deviceName(handle, flags, &devName) < 0) {
-        LOGE("Failed to get pcm device node");
-        goto Error;
+static void *bringUpPcm(void *arg)
+{
+    pcm_bringup *b = (pcm_bringup *)arg;
+    alsa_handle_t *handle = b->handle;
+    const char *dir = (b->flags & PCM_IN) ? "tx" : "rx";
+    char devName[ALSA_PCM_NODE_LEN];
+    nsecs_t t = systemTime(), now;
+
+    b->err = NO_INIT;
+    if (deviceName(handle, b->flags, devName) < 0) {
+        LOGE("bringUpPcm: no %s pcm device node", dir);
+        return NULL;
     }
-    handle->handle = pcm_open(flags, (char*)devName);
-    if (!handle->handle) {
-        LOGE("s_start_fm: could not open PCM device");
-        goto Error;
+    b->pcm = pcm_open(b->flags, (char *)devName);
+    if (!b->pcm) {
+        LOGE("bringUpPcm: could not open %s PCM device '%s'", dir, devName);
+        return NULL;
     }
-
-    handle->handle->flags = flags;
-    err = setHardwareParams(handle);
-    if(err != NO_ERROR) {
-        LOGE("s_start_fm: setHardwareParams failed");
-        goto Error;
+    b->pcm->flags = b->flags;
+    now = systemTime();
+    b->openNs = now - t;
+    t = now;
+
+    if (setPcmHardwareParams(handle, b->pcm, handle->bufferSize) != NO_ERROR) {
+        LOGE("bringUpPcm: %s setHardwareParams failed", dir);
+        return NULL;
     }
-
-    err = setSoftwareParams(handle);
-    if(err != NO_ERROR) {
-        LOGE("s_start_fm: setSoftwareParams failed");
-        goto Error;
+    if (setPcmSoftwareParams(handle, b->pcm) != NO_ERROR) {
+        LOGE("bringUpPcm: %s setSoftwareParams failed", dir);
+        return NULL;
     }
-
-    err = pcm_prepare(handle->handle);
-    if(err != NO_ERROR) {
-        LOGE("s_start_fm: setSoftwareParams failed");
-        goto Error;
+    now = systemTime();
+    b->paramsNs = now - t;
+    t = now;
+
+    {
+        Mutex::Autolock autoLock(b->gate->lock);
+        while (!b->gate->open)
+            b->gate->cond.wait(b->gate->lock);
     }
-
-    if (ioctl(handle->handle->fd, SNDRV_PCM_IOCTL_START)) {
-        LOGE("s_start_fm: SNDRV_PCM_IOCTL_START failed\n");
-        goto Error;
+    now = systemTime();
+    b->waitNs = now - t;
+    t = now;
+
+    {
+        ALSA_TRACE_SCOPE((b->flags & PCM_IN) ? "tx_prepare_start" : "rx_prepare_start");
+        if (pcm_prepare(b->pcm) != NO_ERROR) {
+            LOGE("bringUpPcm: %s pcm_prepare failed", dir);
+            return NULL;
+        }
+        if (ioctl(b->pcm->fd, SNDRV_PCM_IOCTL_START)) {
+            LOGE("bringUpPcm: %s SNDRV_PCM_IOCTL_START failed", dir);
+            return NULL;
+        }
     }
+    b->startNs = systemTime() - t;
+    b->err = NO_ERROR;
+    return NULL;
+}
 
-    // Store the PCM playback device pointer in rxHandle
-    handle->rxHandle = handle->handle;
-    free(devName);
-
-    // Open PCM capture device
-    flags = PCM_IN | PCM_STEREO;
-    if (deviceName(handle, flags, &devName) < 0) {
-        LOGE("Failed to get pcm device node");
-        goto Error;
-    }
-    handle->handle = pcm_open(flags, (char*)devName);
-    if (!handle->handle) {
-        goto Error;
+/*
+ * Start both PCMs of a hostless call use case and apply its verb. The
+ * caller has routed the devices but not enabled handle->useCase.
+ */
+static status_t startCallPcms(alsa_handle_t *handle, unsigned channelFlags, const char *tag)
+{
+    call_gate gate;
+    pcm_bringup dirs[2];
+    pthread_t threads[2];
+    bool threaded[2];
+    nsecs_t start = systemTime();
+    nsecs_t verbNs;
+
+    gate.open = false;
+    memset(dirs, 0, sizeof(dirs));
+    dirs[0].flags = PCM_OUT | channelFlags;
+    dirs[1].flags = PCM_IN | channelFlags;
+    for (int i = 0; i < 2; i++) {
+        dirs[i].handle = handle;
+        dirs[i].gate = &gate;
+        threaded[i] = !pthread_create(&threads[i], NULL, bringUpPcm, &dirs[i]);
+        if (!threaded[i])
+            LOGW("%s: no bring-up thread, errno %d", tag, errno);
     }
 
-    handle->handle->flags = flags;
-    err = setHardwareParams(handle);
-    if(err != NO_ERROR) {
-        LOGE("s_start_fm: setHardwareParams failed");
-        goto Error;
+    ALSA_TRACE_BEGIN("call_verb");
+    useCaseEnable(handle->ucMgr, handle->useCase);
+    ALSA_TRACE_END();
+    verbNs = systemTime() - start;
+    {
+        Mutex::Autolock autoLock(gate.lock);
+        gate.open = true;
+        gate.cond.broadcast();
     }
 
-    err = setSoftwareParams(handle);
-    if(err != NO_ERROR) {
-        LOGE("s_start_fm: setSoftwareParams failed");
-        goto Error;
+    for (int i = 0; i < 2; i++) {
+        if (threaded[i])
+            pthread_join(threads[i], NULL);
+        else
+            bringUpPcm(&dirs[i]);
     }
 
-    err = pcm_prepare(handle->handle);
-    if(err != NO_ERROR) {
-        LOGE("s_start_fm: pcm_prepare failed");
-        goto Error;
+    if (dirs[0].err != NO_ERROR || dirs[1].err != NO_ERROR) {
+        LOGW("%s: early bring-up of %s failed, retrying after the verb", tag,
+             useCaseName(handle->useCase));
+        for (int i = 0; i < 2; i++) {
+            if (dirs[i].pcm)
+                pcm_close(dirs[i].pcm);
+            dirs[i].pcm = NULL;
+            bringUpPcm(&dirs[i]);
+        }
     }
 
-    if (ioctl(handle->handle->fd, SNDRV_PCM_IOCTL_START)) {
-        LOGE("s_start_fm: SNDRV_PCM_IOCTL_START failed\n");
-        goto Error;
+    // Same layout as before: playback in rxHandle, capture in handle
+    handle->rxHandle = dirs[0].pcm;
+    handle->handle = dirs[1].pcm;
+    if (dirs[0].err != NO_ERROR || dirs[1].err != NO_ERROR) {
+        LOGE("%s: failed to start %s", tag, useCaseName(handle->useCase));
+        // s_close() only disables the use case along with a capture PCM
+        bool txOpen = handle->handle != NULL;
+        s_close(handle);
+        if (!txOpen)
+            disableDevice(handle);
+        return NO_INIT;
     }
+    handle->periodSize = handle->handle->period_size;
+    handle->bufferSize = handle->handle->period_size;
 
-    s_set_fm_vol(fmVolume);
-    free(devName);
+    LOGD("%s: %s up in %lld us, verb %lld us, "
+         "rx open/params/wait/start %lld/%lld/%lld/%lld us, "
+         "tx %lld/%lld/%lld/%lld us", tag, useCaseName(handle->useCase),
+         (long long)((systemTime() - start) / 1000), (long long)(verbNs / 1000),
+         (long long)(dirs[0].openNs / 1000), (long long)(dirs[0].paramsNs / 1000),
+         (long long)(dirs[0].waitNs / 1000), (long long)(dirs[0].startNs / 1000),
+         (long long)(dirs[1].openNs / 1000), (long long)(dirs[1].paramsNs / 1000),
+         (long long)(dirs[1].waitNs / 1000), (long long)(dirs[1].startNs / 1000));
     return NO_ERROR;
+}
 
-Error:
-    free(devName);
-    s_close(handle);
-    return NO_INIT;
+static status_t s_start_voice_call(alsa_handle_t *handle)
+{
+    LOGD("s_start_voice_call: handle %p", handle);
+    return startCallPcms(handle, PCM_MONO, "s_start_voice_call");
 }
 
-static status_t s_set_fm_vol(int value)
+static status_t s_start_fm(alsa_handle_t *handle)
+{
+    status_t err;
+
+    LOGD("s_start_fm: handle %p", handle);
+    err = startCallPcms(handle, PCM_STEREO, "s_start_fm");
+    if (err == NO_ERROR)
+        s_set_fm_vol(handle->card, handle->card->fmVolume);
+    return err;
+}
+
+static alsa_volume_device volumeDevice(alsa_card_t *card)
+{
+    const char *dev = card->curRxUCMDevice;
+
+    if (!strcmp(dev, SND_USE_CASE_DEV_EARPIECE) ||
+        !strcmp(dev, SND_USE_CASE_DEV_EARPIECE_VOICE))
+        return VOLUME_DEVICE_EARPIECE;
+    if (!strcmp(dev, SND_USE_CASE_DEV_SPEAKER) ||
+        !strcmp(dev, SND_USE_CASE_DEV_SPEAKER_VOICE))
+        return VOLUME_DEVICE_SPEAKER;
+    if (!strcmp(dev, SND_USE_CASE_DEV_HEADPHONES) ||
+        !strcmp(dev, SND_USE_CASE_DEV_HEADSET) ||
+        !strcmp(dev, SND_USE_CASE_DEV_ANC_HEADSET) ||
+        !strcmp(dev, SND_USE_CASE_DEV_SPEAKER_HEADSET) ||
+        !strcmp(dev, SND_USE_CASE_DEV_SPEAKER_ANC_HEADSET) ||
+        !strcmp(dev, SND_USE_CASE_DEV_TTY_HEADSET_RX) ||
+        !strcmp(dev, SND_USE_CASE_DEV_TTY_FULL_RX))
+        return VOLUME_DEVICE_HEADSET;
+    if (!strcmp(dev, SND_USE_CASE_DEV_BTSCO_NB_RX) ||
+        !strcmp(dev, SND_USE_CASE_DEV_BTSCO_WB_RX))
+        return VOLUME_DEVICE_BT_SCO;
+    return VOLUME_DEVICE_OTHER;
+}
+
+static int volumeControl(alsa_card_t *card, alsa_volume_curve curve, int value)
+{
+    return lrintf(sVolumeCurves.valueAt(curve, volumeDevice(card), value));
+}
+
+static status_t s_set_fm_vol(alsa_card_t *card, int value)
 {
     status_t err = NO_ERROR;
+    int vol = volumeControl(card, VOLUME_CURVE_FM, value);
 
-    ALSAControl control("/dev/snd/controlC0");
-    control.set("Internal FM RX Volume",value,0);
-    fmVolume = value;
+    LOGD("s_set_fm_vol: volume %d, control %d", value, vol);
+    card->control->set("Internal FM RX Volume",vol,0);
+    card->fmVolume = value;
 
     return err;
 }
 
-static status_t s_set_lpa_vol(int value)
+static status_t s_set_lpa_vol(alsa_card_t *card, int value)
 {
     status_t err = NO_ERROR;
+    int vol = volumeControl(card, VOLUME_CURVE_LPA, value);
 
-    ALSAControl control("/dev/snd/controlC0");
-    control.set("LPA RX Volume",value,0);
+    LOGD("s_set_lpa_vol: volume %d, control %d", value, vol);
+    card->control->set("LPA RX Volume",vol,0);
 
     return err;
 }
@@ -772,8 +1102,9 @@ static status_t s_close(alsa_handle_t *handle)
     status_t err = NO_ERROR;
      struct pcm *h = handle->rxHandle;
 
+    ALSA_TRACE_SCOPE("s_close");
     handle->rxHandle = 0;
-    LOGD("s_close: handle %p h %p", handle, h);
+    LOGD_RATELIMIT("s_close: handle %p h %p", handle, h);
     if (h) {
         LOGV("s_close rxHandle\n");
         err = pcm_close(h);
@@ -792,14 +1123,50 @@ static status_t s_close(alsa_handle_t *handle)
             LOGE("s_close: pcm_close failed for handle with err %d", err);
         }
         disableDevice(handle);
-    } else if((!strcmp(handle->useCase, SND_USE_CASE_VERB_HIFI_LOW_POWER)) ||
-              (!strcmp(handle->useCase, SND_USE_CASE_MOD_PLAY_LPA))) {
+    } else if (useCaseIs(handle->useCase, UC_LPA)) {
         disableDevice(handle);
     }
 
     return err;
 }
 
+/*
+ * DRAIN blocks until the DMA has played every queued frame and DROP stops
+ * it at once. Both leave the PCM in SETUP, so prepare it again and the
+ * next write starts it without a reopen. The route is not touched. The
+ * stream issues DRAIN itself, outside the route lock, see
+ * AudioStreamOutALSA::drain().
+ */
+static status_t s_prepare(alsa_handle_t *handle)
+{
+    ALSA_TRACE_SCOPE("s_prepare");
+    struct pcm *pcm = handle->handle;
+
+    if (pcm == NULL || useCaseIs(handle->useCase, UC_LPA))
+        return NO_INIT;
+    if (pcm_prepare(pcm)) {
+        LOGE("s_prepare: prepare failed, errno %d", errno);
+        return UNKNOWN_ERROR;
+    }
+    return NO_ERROR;
+}
+
+static status_t s_flush(alsa_handle_t *handle)
+{
+    ALSA_TRACE_SCOPE("s_flush");
+    struct pcm *pcm = handle->handle;
+
+    if (pcm == NULL || useCaseIs(handle->useCase, UC_LPA))
+        return NO_INIT;
+    if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_DROP))
+        LOGW("s_flush: drop failed, errno %d", errno);
+    if (pcm_prepare(pcm)) {
+        LOGE("s_flush: prepare failed, errno %d", errno);
+        return UNKNOWN_ERROR;
+    }
+    return NO_ERROR;
+}
+
 /*
     this is same as s_close, but don't discard
     the device/mode info. This way we can still
@@ -811,10 +1178,11 @@ static status_t s_standby(alsa_handle_t *handle)
     int ret;
     status_t err = NO_ERROR;  
     struct pcm *h = handle->rxHandle;
+    ALSA_TRACE_SCOPE("s_standby");
     handle->rxHandle = 0;
     LOGD("s_standby: handle %p h %p", handle, h);
     if (h) {
-        LOGE("s_standby  rxHandle\n");
+        LOGV("s_standby  rxHandle\n");
         err = pcm_close(h);
         if(err != NO_ERROR) {
             LOGE("s_standby: pcm_close failed for rxHandle with err %d", err);
@@ -825,14 +1193,13 @@ static status_t s_standby(alsa_handle_t *handle)
     handle->handle = 0;
 
     if (h) {
-          LOGE("s_standby handle h %p\n", h);
+          LOGV("s_standby handle h %p\n", h);
         err = pcm_close(h);
         if(err != NO_ERROR) {
             LOGE("s_standby: pcm_close failed for handle with err %d", err);
         }
         disableDevice(handle);
-    } else if((!strcmp(handle->useCase, SND_USE_CASE_VERB_HIFI_LOW_POWER)) ||
-              (!strcmp(handle->useCase, SND_USE_CASE_MOD_PLAY_LPA))) {
+    } else if (useCaseIs(handle->useCase, UC_LPA)) {
         disableDevice(handle);
     }
 
@@ -844,169 +1211,171 @@ static status_t s_route(alsa_handle_t *handle, uint32_t devices, int mode)
     status_t status = NO_ERROR;
 
     LOGD("s_route: devices 0x%x in mode %d", devices, mode);
-    callMode = mode;
+    handle->card->callMode = mode;
     switchDevice(handle, devices, mode);
     return status;
 }
 
 static void disableDevice(alsa_handle_t *handle)
 {
+    ALSA_TRACE_SCOPE("disableDevice");
+    alsa_card_t *card = handle->card;
     char *useCase;
 
     snd_use_case_get(handle->ucMgr, "_verb", (const char **)&useCase);
     if (useCase != NULL) {
-        if (!strcmp(useCase, handle->useCase)) {
+        if (!strcmp(useCase, useCaseName(handle->useCase))) {
             snd_use_case_set(handle->ucMgr, "_verb", SND_USE_CASE_VERB_INACTIVE);
         } else {
-            snd_use_case_set(handle->ucMgr, "_dismod", handle->useCase);
+            snd_use_case_set(handle->ucMgr, "_dismod", useCaseName(handle->useCase));
         }
     } else {
         LOGE("Invalid state, no valid use case found to disable");
     }
     free(useCase);
-    if (strcmp(curTxUCMDevice, "None"))
-        snd_use_case_set(handle->ucMgr, "_disdev", curTxUCMDevice);
-    if (strcmp(curRxUCMDevice, "None"))
-        snd_use_case_set(handle->ucMgr, "_disdev", curRxUCMDevice);
+    if (strcmp(card->curTxUCMDevice, "None"))
+        snd_use_case_set(handle->ucMgr, "_disdev", card->curTxUCMDevice);
+    if (strcmp(card->curRxUCMDevice, "None"))
+        snd_use_case_set(handle->ucMgr, "_disdev", card->curRxUCMDevice);
 }
 
-char *getUCMDevice(uint32_t devices, int input)
+const char *getUCMDevice(alsa_card_t *card, uint32_t devices, int input)
 {
     if (!input) {
-        if (!(mDevSettingsFlag & TTY_OFF) &&
-            (callMode == AudioSystem::MODE_IN_CALL) &&
+        if (!(card->devSettingsFlag & TTY_OFF) &&
+            (card->callMode == AudioSystem::MODE_IN_CALL) &&
             ((devices & AudioSystem::DEVICE_OUT_WIRED_HEADSET) ||
              (devices & AudioSystem::DEVICE_OUT_WIRED_HEADPHONE) ||
              (devices & AudioSystem::DEVICE_OUT_ANC_HEADSET) ||
              (devices & AudioSystem::DEVICE_OUT_ANC_HEADPHONE))) {
-             if (mDevSettingsFlag & TTY_VCO) {
-                 return strdup(SND_USE_CASE_DEV_TTY_HEADSET_RX);
-             } else if (mDevSettingsFlag & TTY_FULL) {
-                 return strdup(SND_USE_CASE_DEV_TTY_FULL_RX);
-             } else if (mDevSettingsFlag & TTY_HCO) {
-                 return strdup(SND_USE_CASE_DEV_EARPIECE); /* HANDSET RX */
+             if (card->devSettingsFlag & TTY_VCO) {
+                 return SND_USE_CASE_DEV_TTY_HEADSET_RX;
+             } else if (card->devSettingsFlag & TTY_FULL) {
+                 return SND_USE_CASE_DEV_TTY_FULL_RX;
+             } else if (card->devSettingsFlag & TTY_HCO) {
+                 return SND_USE_CASE_DEV_EARPIECE; /* HANDSET RX */
              }
         } else if ((devices & AudioSystem::DEVICE_OUT_SPEAKER) &&
             ((devices & AudioSystem::DEVICE_OUT_WIRED_HEADSET) ||
             (devices & AudioSystem::DEVICE_OUT_WIRED_HEADPHONE))) {
-            if (mDevSettingsFlag & ANC_FLAG) {
-                return strdup(SND_USE_CASE_DEV_SPEAKER_ANC_HEADSET); /* COMBO SPEAKER+ANC HEADSET RX */
+            if (card->devSettingsFlag & ANC_FLAG) {
+                return SND_USE_CASE_DEV_SPEAKER_ANC_HEADSET; /* COMBO SPEAKER+ANC HEADSET RX */
             } else {
-                return strdup(SND_USE_CASE_DEV_SPEAKER_HEADSET); /* COMBO SPEAKER+HEADSET RX */
+                return SND_USE_CASE_DEV_SPEAKER_HEADSET; /* COMBO SPEAKER+HEADSET RX */
             }
         } else if ((devices & AudioSystem::DEVICE_OUT_SPEAKER) &&
             ((devices & AudioSystem::DEVICE_OUT_ANC_HEADSET) ||
             (devices & AudioSystem::DEVICE_OUT_ANC_HEADPHONE))) {
-            return strdup(SND_USE_CASE_DEV_SPEAKER_ANC_HEADSET); /* COMBO SPEAKER+ANC HEADSET RX */
+            return SND_USE_CASE_DEV_SPEAKER_ANC_HEADSET; /* COMBO SPEAKER+ANC HEADSET RX */
         } else if ((devices & AudioSystem::DEVICE_OUT_SPEAKER) &&
                  (devices & AudioSystem::DEVICE_OUT_FM_TX)) {
-            return strdup(SND_USE_CASE_DEV_SPEAKER_FM_TX); /* COMBO SPEAKER+FM_TX RX */
-        } else if ((callMode == AudioSystem::MODE_IN_CALL) &&
+            return SND_USE_CASE_DEV_SPEAKER_FM_TX; /* COMBO SPEAKER+FM_TX RX */
+        } else if ((card->callMode == AudioSystem::MODE_IN_CALL) &&
                    (devices & AudioSystem::DEVICE_OUT_EARPIECE)) {
-            return strdup(SND_USE_CASE_DEV_EARPIECE_VOICE);
+            return SND_USE_CASE_DEV_EARPIECE_VOICE;
         } else if (devices & AudioSystem::DEVICE_OUT_EARPIECE) {
-            return strdup(SND_USE_CASE_DEV_EARPIECE); /* HANDSET RX */
-        } else if ((callMode == AudioSystem::MODE_IN_CALL) &&
+            return SND_USE_CASE_DEV_EARPIECE; /* HANDSET RX */
+        } else if ((card->callMode == AudioSystem::MODE_IN_CALL) &&
                    (devices & AudioSystem::DEVICE_OUT_SPEAKER)) {
-            return strdup(SND_USE_CASE_DEV_SPEAKER_VOICE);
+            return SND_USE_CASE_DEV_SPEAKER_VOICE;
         } else if (devices & AudioSystem::DEVICE_OUT_SPEAKER) {
-            return strdup(SND_USE_CASE_DEV_SPEAKER); /* SPEAKER RX */
+            return SND_USE_CASE_DEV_SPEAKER; /* SPEAKER RX */
         } else if ((devices & AudioSystem::DEVICE_OUT_WIRED_HEADSET) ||
                    (devices & AudioSystem::DEVICE_OUT_WIRED_HEADPHONE)) {
-            if (mDevSettingsFlag & ANC_FLAG) {
-                return strdup(SND_USE_CASE_DEV_ANC_HEADSET); /* ANC HEADSET RX */
+            if (card->devSettingsFlag & ANC_FLAG) {
+                return SND_USE_CASE_DEV_ANC_HEADSET; /* ANC HEADSET RX */
             } else {
-                return strdup(SND_USE_CASE_DEV_HEADPHONES); /* HEADSET RX */
+                return SND_USE_CASE_DEV_HEADPHONES; /* HEADSET RX */
             }
         } else if ((devices & AudioSystem::DEVICE_OUT_ANC_HEADSET) ||
                    (devices & AudioSystem::DEVICE_OUT_ANC_HEADPHONE)) {
-            return strdup(SND_USE_CASE_DEV_ANC_HEADSET); /* ANC HEADSET RX */
+            return SND_USE_CASE_DEV_ANC_HEADSET; /* ANC HEADSET RX */
         } else if ((devices & AudioSystem::DEVICE_OUT_BLUETOOTH_SCO) ||
                   (devices & AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_HEADSET) ||
                   (devices & AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_CARKIT)) {
-            if (btsco_samplerate == BTSCO_RATE_16KHZ)
-                return strdup(SND_USE_CASE_DEV_BTSCO_WB_RX); /* BTSCO RX*/
+            if (card->btscoSampleRate == BTSCO_RATE_16KHZ)
+                return SND_USE_CASE_DEV_BTSCO_WB_RX; /* BTSCO RX*/
             else
-                return strdup(SND_USE_CASE_DEV_BTSCO_NB_RX); /* BTSCO RX*/
+                return SND_USE_CASE_DEV_BTSCO_NB_RX; /* BTSCO RX*/
         } else if ((devices & AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP) ||
                    (devices & AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP_HEADPHONES) ||
                    (devices & AudioSystem::DEVICE_OUT_DIRECTOUTPUT) ||
                    (devices & AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP_SPEAKER)) {
             /* Nothing to be done, use current active device */
-            return strdup(curRxUCMDevice);
+            return card->curRxUCMDevice;
         } else if (devices & AudioSystem::DEVICE_OUT_AUX_DIGITAL) {
-            return strdup(SND_USE_CASE_DEV_HDMI); /* HDMI RX */
+            return SND_USE_CASE_DEV_HDMI; /* HDMI RX */
         } else if (devices & AudioSystem::DEVICE_OUT_PROXY) {
-            return strdup(SND_USE_CASE_DEV_PROXY_RX); /* PROXY RX */
+            return SND_USE_CASE_DEV_PROXY_RX; /* PROXY RX */
         } else if (devices & AudioSystem::DEVICE_OUT_FM_TX) {
-            return strdup(SND_USE_CASE_DEV_FM_TX); /* FM Tx */
+            return SND_USE_CASE_DEV_FM_TX; /* FM Tx */
         } else if (devices & AudioSystem::DEVICE_OUT_DEFAULT) {
-            return strdup(SND_USE_CASE_DEV_SPEAKER); /* SPEAKER RX */
+            return SND_USE_CASE_DEV_SPEAKER; /* SPEAKER RX */
         } else {
             LOGD("No valid output device: %u", devices);
         }
     } else {
-        if (!(mDevSettingsFlag & TTY_OFF) &&
-            (callMode == AudioSystem::MODE_IN_CALL) &&
+        if (!(card->devSettingsFlag & TTY_OFF) &&
+            (card->callMode == AudioSystem::MODE_IN_CALL) &&
             ((devices & AudioSystem::DEVICE_IN_WIRED_HEADSET) ||
              (devices & AudioSystem::DEVICE_IN_ANC_HEADSET))) {
-             if (mDevSettingsFlag & TTY_HCO) {
-                 return strdup(SND_USE_CASE_DEV_TTY_HEADSET_TX);
-             } else if (mDevSettingsFlag & TTY_FULL) {
-                 return strdup(SND_USE_CASE_DEV_TTY_FULL_TX);
-             } else if (mDevSettingsFlag & TTY_VCO) {
-                 if (!strncmp(mic_type, "analog", 6)) {
-                     return strdup(SND_USE_CASE_DEV_HANDSET); /* HANDSET TX */
+             if (card->devSettingsFlag & TTY_HCO) {
+                 return SND_USE_CASE_DEV_TTY_HEADSET_TX;
+             } else if (card->devSettingsFlag & TTY_FULL) {
+                 return SND_USE_CASE_DEV_TTY_FULL_TX;
+             } else if (card->devSettingsFlag & TTY_VCO) {
+                 if (!strncmp(card->micType, "analog", 6)) {
+                     return SND_USE_CASE_DEV_HANDSET; /* HANDSET TX */
                  } else {
-                     return strdup(SND_USE_CASE_DEV_LINE); /* BUILTIN-MIC TX */
+                     return SND_USE_CASE_DEV_LINE; /* BUILTIN-MIC TX */
                  }
              }
-        } else if ((callMode == AudioSystem::MODE_IN_CALL) &&
+        } else if ((card->callMode == AudioSystem::MODE_IN_CALL) &&
                    (devices & AudioSystem::DEVICE_IN_BUILTIN_MIC)) {
-            return strdup(SND_USE_CASE_DEV_HANDSET_VOICE);
+            return SND_USE_CASE_DEV_HANDSET_VOICE;
         } else if (devices & AudioSystem::DEVICE_IN_BUILTIN_MIC) {
-            if (!strncmp(mic_type, "analog", 6)) {
-                return strdup(SND_USE_CASE_DEV_HANDSET); /* HANDSET TX */
+            if (!strncmp(card->micType, "analog", 6)) {
+                return SND_USE_CASE_DEV_HANDSET; /* HANDSET TX */
             } else {
-                if (mDevSettingsFlag & DMIC_FLAG) {
-                    if (fluence_mode == FLUENCE_MODE_ENDFIRE) {
-                        return strdup(SND_USE_CASE_DEV_DUAL_MIC_ENDFIRE); /* DUALMIC EF TX */
-                    } else if (fluence_mode == FLUENCE_MODE_BROADSIDE) {
-                        return strdup(SND_USE_CASE_DEV_DUAL_MIC_BROADSIDE); /* DUALMIC BS TX */
+                if (card->devSettingsFlag & DMIC_FLAG) {
+                    if (card->fluenceMode == FLUENCE_MODE_ENDFIRE) {
+                        return SND_USE_CASE_DEV_DUAL_MIC_ENDFIRE; /* DUALMIC EF TX */
+                    } else if (card->fluenceMode == FLUENCE_MODE_BROADSIDE) {
+                        return SND_USE_CASE_DEV_DUAL_MIC_BROADSIDE; /* DUALMIC BS TX */
                     }
-                } else if (mDevSettingsFlag & QMIC_FLAG){
-                    return strdup(SND_USE_CASE_DEV_QUAD_MIC);
+                } else if (card->devSettingsFlag & QMIC_FLAG){
+                    return SND_USE_CASE_DEV_QUAD_MIC;
                 } else {
-                    return strdup(SND_USE_CASE_DEV_LINE); /* BUILTIN-MIC TX */
+                    return SND_USE_CASE_DEV_LINE; /* BUILTIN-MIC TX */
                 }
             }
         } else if (devices & AudioSystem::DEVICE_IN_AUX_DIGITAL) {
-            return strdup(SND_USE_CASE_DEV_HDMI_TX); /* HDMI TX */
+            return SND_USE_CASE_DEV_HDMI_TX; /* HDMI TX */
         } else if ((devices & AudioSystem::DEVICE_IN_WIRED_HEADSET) ||
                    (devices & AudioSystem::DEVICE_IN_ANC_HEADSET)) {
-            return strdup(SND_USE_CASE_DEV_HEADSET); /* HEADSET TX */
+            return SND_USE_CASE_DEV_HEADSET; /* HEADSET TX */
         } else if (devices & AudioSystem::DEVICE_IN_BLUETOOTH_SCO_HEADSET) {
-             if (btsco_samplerate == BTSCO_RATE_16KHZ)
-                 return strdup(SND_USE_CASE_DEV_BTSCO_WB_TX); /* BTSCO TX*/
+             if (card->btscoSampleRate == BTSCO_RATE_16KHZ)
+                 return SND_USE_CASE_DEV_BTSCO_WB_TX; /* BTSCO TX*/
              else
-                 return strdup(SND_USE_CASE_DEV_BTSCO_NB_TX); /* BTSCO TX*/
-        } else if ((callMode == AudioSystem::MODE_IN_CALL) &&
+                 return SND_USE_CASE_DEV_BTSCO_NB_TX; /* BTSCO TX*/
+        } else if ((card->callMode == AudioSystem::MODE_IN_CALL) &&
                    (devices & AudioSystem::DEVICE_IN_DEFAULT)) {
-            return strdup(SND_USE_CASE_DEV_LINE_VOICE);
+            return SND_USE_CASE_DEV_LINE_VOICE;
         } else if (devices & AudioSystem::DEVICE_IN_DEFAULT) {
-            if (!strncmp(mic_type, "analog", 6)) {
-                return strdup(SND_USE_CASE_DEV_HANDSET); /* HANDSET TX */
+            if (!strncmp(card->micType, "analog", 6)) {
+                return SND_USE_CASE_DEV_HANDSET; /* HANDSET TX */
             } else {
-                if (mDevSettingsFlag & DMIC_FLAG) {
-                    if (fluence_mode == FLUENCE_MODE_ENDFIRE) {
-                        return strdup(SND_USE_CASE_DEV_SPEAKER_DUAL_MIC_ENDFIRE); /* DUALMIC EF TX */
-                    } else if (fluence_mode == FLUENCE_MODE_BROADSIDE) {
-                        return strdup(SND_USE_CASE_DEV_SPEAKER_DUAL_MIC_BROADSIDE); /* DUALMIC BS TX */
+                if (card->devSettingsFlag & DMIC_FLAG) {
+                    if (card->fluenceMode == FLUENCE_MODE_ENDFIRE) {
+                        return SND_USE_CASE_DEV_SPEAKER_DUAL_MIC_ENDFIRE; /* DUALMIC EF TX */
+                    } else if (card->fluenceMode == FLUENCE_MODE_BROADSIDE) {
+                        return SND_USE_CASE_DEV_SPEAKER_DUAL_MIC_BROADSIDE; /* DUALMIC BS TX */
                     }
-                } else if (mDevSettingsFlag & QMIC_FLAG){
-                    return strdup(SND_USE_CASE_DEV_QUAD_MIC);
+                } else if (card->devSettingsFlag & QMIC_FLAG){
+                    return SND_USE_CASE_DEV_QUAD_MIC;
                 } else {
-                    return strdup(SND_USE_CASE_DEV_LINE); /* BUILTIN-MIC TX */
+                    return SND_USE_CASE_DEV_LINE; /* BUILTIN-MIC TX */
                 }
             }
         } else if ((devices & AudioSystem::DEVICE_IN_COMMUNICATION) ||
@@ -1014,16 +1383,16 @@ char *getUCMDevice(uint32_t devices, int input)
                    (devices & AudioSystem::DEVICE_IN_FM_RX_A2DP) ||
                    (devices & AudioSystem::DEVICE_IN_VOICE_CALL)) {
             /* Nothing to be done, use current active device */
-            return strdup(curTxUCMDevice);
+            return card->curTxUCMDevice;
         } else if ((devices & AudioSystem::DEVICE_IN_COMMUNICATION) ||
                    (devices & AudioSystem::DEVICE_IN_AMBIENT) ||
                    (devices & AudioSystem::DEVICE_IN_BACK_MIC) ||
                    (devices & AudioSystem::DEVICE_IN_AUX_DIGITAL)) {
             LOGI("No proper mapping found with UCM device list, setting default");
-            if (!strncmp(mic_type, "analog", 6)) {
-                return strdup(SND_USE_CASE_DEV_HANDSET); /* HANDSET TX */
+            if (!strncmp(card->micType, "analog", 6)) {
+                return SND_USE_CASE_DEV_HANDSET; /* HANDSET TX */
             } else {
-                return strdup(SND_USE_CASE_DEV_LINE); /* BUILTIN-MIC TX */
+                return SND_USE_CASE_DEV_LINE; /* BUILTIN-MIC TX */
             }
         } else {
             LOGD("No valid input device: %u", devices);
@@ -1032,64 +1401,62 @@ char *getUCMDevice(uint32_t devices, int input)
     return NULL;
 }
 
-void s_set_voice_volume(int vol)
+void s_set_voice_volume(alsa_card_t *card, int value)
 {
-    LOGD("s_set_voice_volume: volume %d", vol);
-    ALSAControl control("/dev/snd/controlC0");
-    control.set("Voice Rx Volume", vol, 0);
+    int vol = volumeControl(card, VOLUME_CURVE_VOICE, value);
+
+    LOGD("s_set_voice_volume: volume %d, control %d", value, vol);
+    card->control->set("Voice Rx Volume", vol, 0);
 }
 
-void s_set_voip_volume(int vol)
+void s_set_voip_volume(alsa_card_t *card, int value)
 {
-    LOGD("s_set_voip_volume: volume %d", vol);
-    ALSAControl control("/dev/snd/controlC0");
-    control.set("Voip Rx Volume", vol, 0);
+    int vol = volumeControl(card, VOLUME_CURVE_VOIP, value);
+
+    LOGD("s_set_voip_volume: volume %d, control %d", value, vol);
+    card->control->set("Voip Rx Volume", vol, 0);
 }
-void s_set_mic_mute(int state)
+void s_set_mic_mute(alsa_card_t *card, int state)
 {
     LOGD("s_set_mic_mute: state %d", state);
-    ALSAControl control("/dev/snd/controlC0");
-    control.set("Voice Tx Mute", state, 0);
+    card->control->set("Voice Tx Mute", state, 0);
 }
 
-void s_set_voip_mic_mute(int state)
+void s_set_voip_mic_mute(alsa_card_t *card, int state)
 {
     LOGD("s_set_voip_mic_mute: state %d", state);
-    ALSAControl control("/dev/snd/controlC0");
-    control.set("Voip Tx Mute", state, 0);
+    card->control->set("Voip Tx Mute", state, 0);
 }
 
-void s_set_btsco_rate(int rate)
+void s_set_btsco_rate(alsa_card_t *card, int rate)
 {
-    btsco_samplerate = rate;
+    card->btscoSampleRate = rate;
 }
 
-void s_enable_wide_voice(bool flag)
+void s_enable_wide_voice(alsa_card_t *card, bool flag)
 {
     LOGD("s_enable_wide_voice: flag %d", flag);
-    ALSAControl control("/dev/snd/controlC0");
     if(flag == true) {
-        control.set("Widevoice Enable", 1, 0);
+        card->control->set("Widevoice Enable", 1, 0);
     } else {
-        control.set("Widevoice Enable", 0, 0);
+        card->control->set("Widevoice Enable", 0, 0);
     }
 }
 
-void s_enable_fens(bool flag)
+void s_enable_fens(alsa_card_t *card, bool flag)
 {
     LOGD("s_enable_fens: flag %d", flag);
-    ALSAControl control("/dev/snd/controlC0");
     if(flag == true) {
-        control.set("FENS Enable", 1, 0);
+        card->control->set("FENS Enable", 1, 0);
     } else {
-        control.set("FENS Enable", 0, 0);
+        card->control->set("FENS Enable", 0, 0);
     }
 }
 
-void s_set_flags(uint32_t flags)
+void s_set_flags(alsa_card_t *card, uint32_t flags)
 {
     LOGV("s_set_flags: flags %d", flags);
-    mDevSettingsFlag = flags;
+    card->devSettingsFlag = flags;
 }
 
 }
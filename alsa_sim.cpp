@@ -0,0 +1,857 @@
+/* alsa_sim.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define LOG_TAG "ALSASim"
+//#define LOG_NDEBUG 0
+#define LOG_NDDEBUG 0
+#include <utils/Log.h>
+
+extern "C" {
+   #include <sound/asound.h>
+   #include "alsa_audio.h"
+   #include "msm8960_use_cases.h"
+}
+
+#include "alsa_sim.h"
+
+// The real one, for descriptors that are not ours
+#undef ioctl
+
+#define SIM_MAX_PCMS        16
+#define SIM_MAX_CTLS        256
+#define SIM_MAX_DEVICES     8
+#define SIM_NAME_LEN        64
+#define SIM_DEFAULT_RATE    48000
+
+struct sim_pcm {
+    struct pcm          pcm;            // handed out, so it comes first
+    int                 used;
+    int                 peer;           // write end of the pipe behind pcm.fd
+    ino_t               ino;            // matches dup()s of pcm.fd
+    uint32_t            rate;
+    uint32_t            frameBytes;
+    int64_t             bufferFrames;
+    int                 running;
+    int                 paused;
+    int                 xrun;           // SNDRV_PCM_IOCTL_XRUN, next transfer fails
+    int64_t             baseNs;         // clock when the DMA was at hwBase
+    int64_t             hwBase;
+    int64_t             appFrames;      // written or read by the caller
+};
+
+struct mixer_ctl {
+    char                name[SIM_NAME_LEN];
+    unsigned            index;
+    unsigned            value;
+    char                select[SIM_NAME_LEN];
+};
+
+struct mixer {
+    struct mixer_ctl    ctls[SIM_MAX_CTLS];
+    unsigned            count;
+};
+
+struct snd_use_case_mgr {
+    char                card[SIM_NAME_LEN];
+    char                verb[SIM_NAME_LEN];
+    char                devices[SIM_MAX_DEVICES][SIM_NAME_LEN];
+    char                modifiers[SIM_MAX_DEVICES][SIM_NAME_LEN];
+};
+
+static pthread_mutex_t sLock = PTHREAD_MUTEX_INITIALIZER;
+static struct alsa_sim_config_t sConfig;
+static int sConfigured;
+static struct alsa_sim_counters_t sCounters;
+static int64_t sClockNs;
+static int sFaults[ALSA_SIM_FAULTS];
+static uint32_t sRand;
+static struct sim_pcm sPcms[SIM_MAX_PCMS];
+static struct snd_use_case_mgr *sUcMgr;    // last opened, for alsa_sim_ucm_state()
+
+// ----------------------------------------------------------------------------
+
+static void setDefaults(struct alsa_sim_config_t *config)
+{
+    static const struct alsa_sim_latency_t latency[ALSA_SIM_OPS] = {
+        { 2500, 1500 },     // ALSA_SIM_PCM_OPEN, DSP session setup
+        { 800,  400 },      // ALSA_SIM_PCM_CLOSE
+        { 300,  200 },      // ALSA_SIM_HW_PARAMS
+        { 50,   20 },       // ALSA_SIM_SW_PARAMS
+        { 400,  300 },      // ALSA_SIM_PREPARE
+        { 1200, 2000 },     // ALSA_SIM_UCM_SET, a batch of codec register writes
+        { 150,  100 },      // ALSA_SIM_MIXER_SET
+    };
+
+    memset(config, 0, sizeof(*config));
+    config->periodUs = 20000;
+    config->periodCount = 4;
+    config->seed = 1;
+    memcpy(config->latency, latency, sizeof(latency));
+}
+
+static void ensureConfigured()
+{
+    if (!sConfigured) {
+        setDefaults(&sConfig);
+        sRand = sConfig.seed;
+        sConfigured = 1;
+    }
+}
+
+static int64_t simNow()
+{
+    if (sConfig.realtime) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+    return sClockNs;
+}
+
+// Called with sLock held, which real time mode drops while it sleeps
+static void simSleep(int64_t ns)
+{
+    if (ns <= 0)
+        return;
+    if (!sConfig.realtime) {
+        sClockNs += ns;
+        return;
+    }
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    pthread_mutex_unlock(&sLock);
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+        ;
+    pthread_mutex_lock(&sLock);
+}
+
+static uint32_t simRandom(uint32_t range)
+{
+    if (!range)
+        return 0;
+    sRand = sRand * 1103515245 + 12345;
+    return (sRand >> 8) % (range + 1);
+}
+
+static void charge(int op)
+{
+    const struct alsa_sim_latency_t *l = &sConfig.latency[op];
+    int64_t ns = ((int64_t)l->baseUs + simRandom(l->jitterUs)) * 1000;
+
+    sCounters.calls[op]++;
+    sCounters.busyNs[op] += ns;
+    simSleep(ns);
+}
+
+static struct sim_pcm *simPcm(struct pcm *pcm)
+{
+    return (struct sim_pcm *)pcm;
+}
+
+/*
+ * Every PCM fd is the read end of its own pipe, a real descriptor that
+ * the caller can dup(). A dup shares the pipe's inode, so ioctls on it
+ * reach the same PCM for as long as that PCM is open.
+ */
+static struct sim_pcm *simPcmForFd(int fd)
+{
+    struct stat st;
+
+    for (int i = 0; i < SIM_MAX_PCMS; i++) {
+        if (sPcms[i].used && sPcms[i].pcm.fd == fd)
+            return &sPcms[i];
+    }
+    if (fstat(fd, &st) || !S_ISFIFO(st.st_mode))
+        return NULL;
+    for (int i = 0; i < SIM_MAX_PCMS; i++) {
+        if (sPcms[i].used && sPcms[i].ino == st.st_ino)
+            return &sPcms[i];
+    }
+    return NULL;
+}
+
+// Frames the DMA has moved by now
+static int64_t hwFrames(struct sim_pcm *p, int64_t now)
+{
+    if (!p->running || p->paused)
+        return p->hwBase;
+    return p->hwBase + (int64_t)((double)(now - p->baseNs) * p->rate *
+                                 (1.0 + sConfig.driftPpm / 1e6) / 1e9);
+}
+
+static int64_t framesToNs(struct sim_pcm *p, int64_t frames)
+{
+    return (int64_t)((double)frames * 1e9 / (p->rate * (1.0 + sConfig.driftPpm / 1e6)));
+}
+
+static void rebase(struct sim_pcm *p, int64_t now)
+{
+    p->hwBase = hwFrames(p, now);
+    p->baseNs = now;
+}
+
+static void start(struct sim_pcm *p)
+{
+    p->running = 1;
+    p->paused = 0;
+    p->baseNs = simNow();
+}
+
+static void reset(struct sim_pcm *p)
+{
+    p->running = 0;
+    p->paused = 0;
+    p->xrun = 0;
+    p->hwBase = 0;
+    p->appFrames = 0;
+}
+
+// What the library does on EPIPE: count it, prepare and carry on
+static void recoverXrun(struct sim_pcm *p)
+{
+    p->pcm.underruns++;
+    sCounters.xruns++;
+    reset(p);
+    charge(ALSA_SIM_PREPARE);
+}
+
+// Returns the injected fault for this transfer, or -1
+static int nextFault()
+{
+    sCounters.transfers++;
+    if (sConfig.xrunEvery && (sCounters.transfers % sConfig.xrunEvery) == 0)
+        return ALSA_SIM_FAULT_XRUN;
+    for (int f = 0; f < ALSA_SIM_FAULTS; f++) {
+        if (sFaults[f]) {
+            sFaults[f]--;
+            return f;
+        }
+    }
+    return -1;
+}
+
+// ----------------------------------------------------------------------------
+
+void alsa_sim_default_config(struct alsa_sim_config_t *config)
+{
+    setDefaults(config);
+}
+
+void alsa_sim_configure(const struct alsa_sim_config_t *config)
+{
+    pthread_mutex_lock(&sLock);
+    sConfig = *config;
+    if (!sConfig.periodCount)
+        sConfig.periodCount = 2;
+    sRand = sConfig.seed;
+    sConfigured = 1;
+    memset(&sCounters, 0, sizeof(sCounters));
+    memset(sFaults, 0, sizeof(sFaults));
+    pthread_mutex_unlock(&sLock);
+}
+
+void alsa_sim_get_counters(struct alsa_sim_counters_t *counters)
+{
+    pthread_mutex_lock(&sLock);
+    *counters = sCounters;
+    pthread_mutex_unlock(&sLock);
+}
+
+int64_t alsa_sim_now_ns()
+{
+    pthread_mutex_lock(&sLock);
+    ensureConfigured();
+    int64_t now = simNow();
+    pthread_mutex_unlock(&sLock);
+    return now;
+}
+
+void alsa_sim_advance_ns(int64_t ns)
+{
+    pthread_mutex_lock(&sLock);
+    ensureConfigured();
+    simSleep(ns);
+    pthread_mutex_unlock(&sLock);
+}
+
+void alsa_sim_inject_fault(int fault, int count)
+{
+    if (fault < 0 || fault >= ALSA_SIM_FAULTS)
+        return;
+    pthread_mutex_lock(&sLock);
+    sFaults[fault] += count;
+    pthread_mutex_unlock(&sLock);
+}
+
+int alsa_sim_ucm_state(char *buffer, size_t size)
+{
+    pthread_mutex_lock(&sLock);
+    if (!sUcMgr) {
+        pthread_mutex_unlock(&sLock);
+        return -ENODEV;
+    }
+    snprintf(buffer, size, "%s", sUcMgr->verb);
+    for (int i = 0; i < SIM_MAX_DEVICES; i++) {
+        if (sUcMgr->devices[i][0]) {
+            size_t len = strlen(buffer);
+            snprintf(buffer + len, size - len, "|%s", sUcMgr->devices[i]);
+        }
+    }
+    for (int i = 0; i < SIM_MAX_DEVICES; i++) {
+        if (sUcMgr->modifiers[i][0]) {
+            size_t len = strlen(buffer);
+            snprintf(buffer + len, size - len, "+%s", sUcMgr->modifiers[i]);
+        }
+    }
+    pthread_mutex_unlock(&sLock);
+    return 0;
+}
+
+int alsa_sim_ioctl(int fd, unsigned long request, ...)
+{
+    va_list ap;
+    void *arg;
+
+    va_start(ap, request);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    pthread_mutex_lock(&sLock);
+    struct sim_pcm *p = simPcmForFd(fd);
+    if (!p) {
+        pthread_mutex_unlock(&sLock);
+        return ioctl(fd, request, arg);
+    }
+
+    int64_t now = simNow();
+    int ret = 0;
+
+    switch (request) {
+    case SNDRV_PCM_IOCTL_DELAY: {
+        int64_t hw = hwFrames(p, now);
+        int64_t delay = (p->pcm.flags & PCM_IN) ? hw - p->appFrames : p->appFrames - hw;
+        *(snd_pcm_sframes_t *)arg = delay > 0 ? delay : 0;
+        break;
+    }
+    case SNDRV_PCM_IOCTL_START:
+        start(p);
+        break;
+    case SNDRV_PCM_IOCTL_DROP:
+        reset(p);
+        break;
+    case SNDRV_PCM_IOCTL_DRAIN:
+        if (!(p->pcm.flags & PCM_IN) && p->running) {
+            int64_t left = p->appFrames - hwFrames(p, now);
+            simSleep(framesToNs(p, left));
+        }
+        reset(p);
+        break;
+    case SNDRV_PCM_IOCTL_PAUSE:
+        if (!p->running) {
+            ret = -EBADFD;
+        } else if ((long)arg && !p->paused) {
+            rebase(p, now);
+            p->paused = 1;
+        } else if (!(long)arg && p->paused) {
+            p->paused = 0;
+            p->baseNs = now;
+        }
+        break;
+    case SNDRV_PCM_IOCTL_PREPARE:
+        charge(ALSA_SIM_PREPARE);
+        reset(p);
+        break;
+    case SNDRV_PCM_IOCTL_XRUN:
+        if (p->running)
+            p->xrun = 1;
+        else
+            ret = -EBADFD;
+        break;
+    default:
+        LOGV("alsa_sim_ioctl: request 0x%lx not modelled", request);
+        break;
+    }
+    pthread_mutex_unlock(&sLock);
+
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// PCM
+
+struct pcm *pcm_open(unsigned flags, char *device)
+{
+    struct sim_pcm *p = NULL;
+
+    pthread_mutex_lock(&sLock);
+    ensureConfigured();
+    charge(ALSA_SIM_PCM_OPEN);
+    for (int i = 0; i < SIM_MAX_PCMS; i++) {
+        if (!sPcms[i].used) {
+            p = &sPcms[i];
+            break;
+        }
+    }
+    if (!p) {
+        pthread_mutex_unlock(&sLock);
+        LOGE("pcm_open: no free PCM for %s", device);
+        return NULL;
+    }
+
+    int fds[2];
+    struct stat st;
+    if (pipe(fds)) {
+        pthread_mutex_unlock(&sLock);
+        LOGE("pcm_open: no descriptor for %s, errno %d", device, errno);
+        return NULL;
+    }
+    fstat(fds[0], &st);
+    memset(p, 0, sizeof(*p));
+    p->used = 1;
+    p->pcm.fd = fds[0];
+    p->peer = fds[1];
+    p->ino = st.st_ino;
+
+    p->pcm.flags = flags;
+    p->pcm.channels = (flags & PCM_MONO) ? 1 : (flags & PCM_QUAD) ? 4 : 2;
+    p->pcm.rate = SIM_DEFAULT_RATE;
+    p->rate = SIM_DEFAULT_RATE;
+    p->frameBytes = p->pcm.channels * sizeof(int16_t);
+    pthread_mutex_unlock(&sLock);
+
+    LOGV("pcm_open: %s %s as fd %d", (flags & PCM_IN) ? "capture" : "playback",
+         device, p->pcm.fd);
+    return &p->pcm;
+}
+
+int pcm_close(struct pcm *pcm)
+{
+    if (!pcm)
+        return -EINVAL;
+    pthread_mutex_lock(&sLock);
+    charge(ALSA_SIM_PCM_CLOSE);
+    simPcm(pcm)->used = 0;
+    close(simPcm(pcm)->peer);
+    close(pcm->fd);
+    pthread_mutex_unlock(&sLock);
+    return 0;
+}
+
+int pcm_ready(struct pcm *pcm)
+{
+    return pcm->fd >= 0;
+}
+
+int pcm_prepare(struct pcm *pcm)
+{
+    pthread_mutex_lock(&sLock);
+    charge(ALSA_SIM_PREPARE);
+    reset(simPcm(pcm));
+    pthread_mutex_unlock(&sLock);
+    return 0;
+}
+
+int pcm_write(struct pcm *pcm, void *data, unsigned count)
+{
+    struct sim_pcm *p = simPcm(pcm);
+    int64_t frames = count / p->frameBytes;
+
+    pthread_mutex_lock(&sLock);
+    int fault = nextFault();
+    if (fault == ALSA_SIM_FAULT_EIO) {
+        sCounters.xruns++;
+        sCounters.errors++;
+        pthread_mutex_unlock(&sLock);
+        errno = EIO;
+        return -EIO;
+    }
+
+    int64_t now = simNow();
+    if (fault == ALSA_SIM_FAULT_XRUN || p->xrun ||
+        (p->running && !p->paused && hwFrames(p, now) >= p->appFrames)) {
+        recoverXrun(p);
+        now = simNow();
+    }
+
+    // Block until the DMA has made room, like the kernel does
+    int64_t room = p->bufferFrames - (p->appFrames - hwFrames(p, now));
+    if (p->running && !p->paused && frames > room) {
+        int64_t wait = framesToNs(p, frames - room) + simRandom(sConfig.wakeJitterUs) * 1000LL;
+        sCounters.blockedNs += wait;
+        simSleep(wait);
+    }
+    p->appFrames += frames;
+    if (!p->running)
+        start(p);
+    pthread_mutex_unlock(&sLock);
+    return 0;
+}
+
+int pcm_read(struct pcm *pcm, void *data, unsigned count)
+{
+    struct sim_pcm *p = simPcm(pcm);
+    int64_t frames = count / p->frameBytes;
+
+    pthread_mutex_lock(&sLock);
+    int fault = nextFault();
+    if (fault == ALSA_SIM_FAULT_EIO) {
+        sCounters.xruns++;
+        sCounters.errors++;
+        pthread_mutex_unlock(&sLock);
+        errno = EIO;
+        return -EIO;
+    }
+
+    int64_t now = simNow();
+    if (fault == ALSA_SIM_FAULT_XRUN || p->xrun ||
+        (p->running && hwFrames(p, now) - p->appFrames > p->bufferFrames)) {
+        recoverXrun(p);
+        now = simNow();
+    }
+    if (!p->running)
+        start(p);
+
+    // Wait for the ADC to fill the period
+    int64_t avail = hwFrames(p, now) - p->appFrames;
+    if (frames > avail) {
+        int64_t wait = framesToNs(p, frames - avail) + simRandom(sConfig.wakeJitterUs) * 1000LL;
+        sCounters.blockedNs += wait;
+        simSleep(wait);
+    }
+    p->appFrames += frames;
+    pthread_mutex_unlock(&sLock);
+
+    memset(data, 0, count);
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Hardware and software parameters, kept to what alsa_default.cpp uses
+
+static struct snd_mask *paramToMask(struct snd_pcm_hw_params *p, int n)
+{
+    return &p->masks[n - SNDRV_PCM_HW_PARAM_FIRST_MASK];
+}
+
+static struct snd_interval *paramToInterval(struct snd_pcm_hw_params *p, int n)
+{
+    return &p->intervals[n - SNDRV_PCM_HW_PARAM_FIRST_INTERVAL];
+}
+
+void param_init(struct snd_pcm_hw_params *p)
+{
+    memset(p, 0, sizeof(*p));
+    for (int n = SNDRV_PCM_HW_PARAM_FIRST_MASK; n <= SNDRV_PCM_HW_PARAM_LAST_MASK; n++)
+        memset(paramToMask(p, n), 0xff, sizeof(struct snd_mask));
+    for (int n = SNDRV_PCM_HW_PARAM_FIRST_INTERVAL; n <= SNDRV_PCM_HW_PARAM_LAST_INTERVAL; n++) {
+        paramToInterval(p, n)->min = 0;
+        paramToInterval(p, n)->max = ~0U;
+    }
+    p->rmask = ~0U;
+    p->info = ~0U;
+}
+
+void param_set_mask(struct snd_pcm_hw_params *p, int n, unsigned bit)
+{
+    struct snd_mask *m = paramToMask(p, n);
+
+    if (bit >= SNDRV_MASK_MAX)
+        return;
+    memset(m, 0, sizeof(*m));
+    m->bits[bit >> 5] |= 1U << (bit & 31);
+}
+
+void param_set_min(struct snd_pcm_hw_params *p, int n, unsigned val)
+{
+    paramToInterval(p, n)->min = val;
+}
+
+void param_set_max(struct snd_pcm_hw_params *p, int n, unsigned val)
+{
+    paramToInterval(p, n)->max = val;
+}
+
+void param_set_int(struct snd_pcm_hw_params *p, int n, unsigned val)
+{
+    struct snd_interval *i = paramToInterval(p, n);
+
+    i->min = val;
+    i->max = val;
+    i->integer = 1;
+}
+
+void param_dump(struct snd_pcm_hw_params *p)
+{
+    LOGV("param_dump: rate %u channels %u period %u bytes, buffer %u bytes",
+         paramToInterval(p, SNDRV_PCM_HW_PARAM_RATE)->min,
+         paramToInterval(p, SNDRV_PCM_HW_PARAM_CHANNELS)->min,
+         paramToInterval(p, SNDRV_PCM_HW_PARAM_PERIOD_BYTES)->min,
+         paramToInterval(p, SNDRV_PCM_HW_PARAM_BUFFER_BYTES)->min);
+}
+
+int param_set_hw_refine(struct pcm *pcm, struct snd_pcm_hw_params *params)
+{
+    return 0;
+}
+
+int param_set_hw_params(struct pcm *pcm, struct snd_pcm_hw_params *params)
+{
+    struct sim_pcm *p = simPcm(pcm);
+    struct snd_interval *rate = paramToInterval(params, SNDRV_PCM_HW_PARAM_RATE);
+    struct snd_interval *channels = paramToInterval(params, SNDRV_PCM_HW_PARAM_CHANNELS);
+    struct snd_interval *period = paramToInterval(params, SNDRV_PCM_HW_PARAM_PERIOD_BYTES);
+    struct snd_interval *buffer = paramToInterval(params, SNDRV_PCM_HW_PARAM_BUFFER_BYTES);
+
+    pthread_mutex_lock(&sLock);
+    charge(ALSA_SIM_HW_PARAMS);
+    if (rate->min && rate->min == rate->max)
+        p->rate = rate->min;
+    if (channels->min && channels->min == channels->max)
+        pcm->channels = channels->min;
+    p->frameBytes = pcm->channels * sizeof(int16_t);
+
+    unsigned periodBytes = period->min;
+    if (!periodBytes || periodBytes == ~0U)
+        periodBytes = (uint64_t)sConfig.periodUs * p->rate / 1000000 * p->frameBytes;
+    periodBytes = (periodBytes + p->frameBytes - 1) / p->frameBytes * p->frameBytes;
+
+    period->min = period->max = periodBytes;
+    buffer->min = buffer->max = periodBytes * sConfig.periodCount;
+    pcm->period_size = periodBytes;
+    pcm->buffer_size = buffer->min;
+    p->bufferFrames = buffer->min / p->frameBytes;
+    reset(p);
+    pthread_mutex_unlock(&sLock);
+    return 0;
+}
+
+int param_set_sw_params(struct pcm *pcm, struct snd_pcm_sw_params *sparams)
+{
+    pthread_mutex_lock(&sLock);
+    charge(ALSA_SIM_SW_PARAMS);
+    pthread_mutex_unlock(&sLock);
+    return 0;
+}
+
+long pcm_buffer_size(struct snd_pcm_hw_params *params)
+{
+    return paramToInterval(params, SNDRV_PCM_HW_PARAM_BUFFER_BYTES)->min;
+}
+
+long pcm_period_size(struct snd_pcm_hw_params *params)
+{
+    return paramToInterval(params, SNDRV_PCM_HW_PARAM_PERIOD_BYTES)->min;
+}
+
+// ----------------------------------------------------------------------------
+// Mixer
+
+struct mixer *mixer_open(const char *device)
+{
+    struct mixer *mixer = (struct mixer *)calloc(1, sizeof(struct mixer));
+
+    LOGV("mixer_open: %s", device);
+    return mixer;
+}
+
+void mixer_close(struct mixer *mixer)
+{
+    free(mixer);
+}
+
+// Every control exists; the first lookup creates it
+struct mixer_ctl *mixer_get_control(struct mixer *mixer, const char *name, unsigned index)
+{
+    struct mixer_ctl *ctl = NULL;
+
+    pthread_mutex_lock(&sLock);
+    for (unsigned i = 0; i < mixer->count; i++) {
+        if (mixer->ctls[i].index == index && !strcmp(mixer->ctls[i].name, name)) {
+            ctl = &mixer->ctls[i];
+            break;
+        }
+    }
+    if (!ctl && mixer->count < SIM_MAX_CTLS) {
+        ctl = &mixer->ctls[mixer->count++];
+        snprintf(ctl->name, sizeof(ctl->name), "%s", name);
+        ctl->index = index;
+    }
+    pthread_mutex_unlock(&sLock);
+    return ctl;
+}
+
+int mixer_ctl_set(struct mixer_ctl *ctl, unsigned percent)
+{
+    pthread_mutex_lock(&sLock);
+    charge(ALSA_SIM_MIXER_SET);
+    ctl->value = percent;
+    pthread_mutex_unlock(&sLock);
+    return 0;
+}
+
+int mixer_ctl_select(struct mixer_ctl *ctl, const char *value)
+{
+    pthread_mutex_lock(&sLock);
+    charge(ALSA_SIM_MIXER_SET);
+    snprintf(ctl->select, sizeof(ctl->select), "%s", value);
+    pthread_mutex_unlock(&sLock);
+    return 0;
+}
+
+void mixer_ctl_get(struct mixer_ctl *ctl, unsigned *value)
+{
+    pthread_mutex_lock(&sLock);
+    *value = ctl->value;
+    pthread_mutex_unlock(&sLock);
+}
+
+// ----------------------------------------------------------------------------
+// Use case manager
+
+static int listAdd(char list[][SIM_NAME_LEN], const char *name)
+{
+    int slot = -1;
+
+    for (int i = 0; i < SIM_MAX_DEVICES; i++) {
+        if (!strcmp(list[i], name))
+            return 0;
+        if (slot < 0 && !list[i][0])
+            slot = i;
+    }
+    if (slot < 0)
+        return -ENOSPC;
+    snprintf(list[slot], SIM_NAME_LEN, "%s", name);
+    return 0;
+}
+
+static int listRemove(char list[][SIM_NAME_LEN], const char *name)
+{
+    for (int i = 0; i < SIM_MAX_DEVICES; i++) {
+        if (!strcmp(list[i], name)) {
+            list[i][0] = '\0';
+            return 0;
+        }
+    }
+    return -ENODEV;
+}
+
+int snd_use_case_mgr_open(snd_use_case_mgr_t **uc_mgr, const char *card_name)
+{
+    snd_use_case_mgr_t *mgr = (snd_use_case_mgr_t *)calloc(1, sizeof(snd_use_case_mgr_t));
+
+    if (!mgr) {
+        *uc_mgr = NULL;
+        return -ENOMEM;
+    }
+    snprintf(mgr->card, sizeof(mgr->card), "%s", card_name);
+    snprintf(mgr->verb, sizeof(mgr->verb), "%s", SND_USE_CASE_VERB_INACTIVE);
+    pthread_mutex_lock(&sLock);
+    ensureConfigured();
+    sUcMgr = mgr;
+    pthread_mutex_unlock(&sLock);
+    *uc_mgr = mgr;
+    return 0;
+}
+
+int snd_use_case_mgr_close(snd_use_case_mgr_t *uc_mgr)
+{
+    pthread_mutex_lock(&sLock);
+    if (sUcMgr == uc_mgr)
+        sUcMgr = NULL;
+    pthread_mutex_unlock(&sLock);
+    free(uc_mgr);
+    return 0;
+}
+
+/*
+ * "_verb" and the PCM node of a use case; the node is derived from the
+ * name so that every use case gets a stable, distinct device.
+ */
+int snd_use_case_get(snd_use_case_mgr_t *uc_mgr, const char *identifier, const char **value)
+{
+    const char *name;
+    char node[SIM_NAME_LEN];
+    unsigned hash = 0;
+
+    *value = NULL;
+    if (!uc_mgr)
+        return -EINVAL;
+    if (!strcmp(identifier, "_verb")) {
+        pthread_mutex_lock(&sLock);
+        *value = strdup(uc_mgr->verb);
+        pthread_mutex_unlock(&sLock);
+        return 0;
+    }
+    if (!strncmp(identifier, "PlaybackPCM/", 12))
+        name = identifier + 12;
+    else if (!strncmp(identifier, "CapturePCM/", 11))
+        name = identifier + 11;
+    else
+        return -ENOENT;
+
+    for (const char *c = name; *c; c++)
+        hash = hash * 31 + (unsigned char)*c;
+    snprintf(node, sizeof(node), "hw:0,%u", hash % 32);
+    *value = strdup(node);
+    return 0;
+}
+
+int snd_use_case_set(snd_use_case_mgr_t *uc_mgr, const char *identifier, const char *value)
+{
+    int ret = 0;
+
+    if (!uc_mgr || !value)
+        return -EINVAL;
+
+    pthread_mutex_lock(&sLock);
+    charge(ALSA_SIM_UCM_SET);
+    if (!strcmp(identifier, "_verb")) {
+        snprintf(uc_mgr->verb, sizeof(uc_mgr->verb), "%s", value);
+        if (!strcmp(value, SND_USE_CASE_VERB_INACTIVE))
+            memset(uc_mgr->modifiers, 0, sizeof(uc_mgr->modifiers));
+    } else if (!strcmp(identifier, "_enadev")) {
+        ret = listAdd(uc_mgr->devices, value);
+    } else if (!strcmp(identifier, "_disdev")) {
+        ret = listRemove(uc_mgr->devices, value);
+    } else if (!strncmp(identifier, "_swdev/", 7)) {
+        listRemove(uc_mgr->devices, identifier + 7);
+        ret = listAdd(uc_mgr->devices, value);
+    } else if (!strcmp(identifier, "_enamod")) {
+        ret = listAdd(uc_mgr->modifiers, value);
+    } else if (!strcmp(identifier, "_dismod")) {
+        ret = listRemove(uc_mgr->modifiers, value);
+    } else {
+        LOGV("snd_use_case_set: %s=%s ignored", identifier, value);
+    }
+    pthread_mutex_unlock(&sLock);
+    return ret;
+}
@@ -0,0 +1,108 @@
+/* alsa_sim.h
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#ifndef ANDROID_ALSA_SIM_H
+#define ANDROID_ALSA_SIM_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/*
+ * Simulated libalsa-intf for host builds. alsa_sim.cpp implements the
+ * PCM, mixer and UCM calls of alsa_audio.h against an in-process model
+ * instead of /dev/snd, so alsa_default.cpp runs unchanged on a Linux box.
+ *
+ * The model runs on its own clock. In virtual mode, which is the default,
+ * a blocking call moves the clock forward instead of sleeping, so an hour
+ * of playback takes a fraction of a second and every run sees the same
+ * timeline. Real time mode sleeps for the same intervals.
+ *
+ * Sources built with ALSA_SIM route their direct ioctl() calls on PCM
+ * file descriptors through alsa_sim_ioctl(); fds the simulator does not
+ * own are passed on to the real ioctl().
+ */
+
+extern "C" {
+
+enum alsa_sim_op {
+    ALSA_SIM_PCM_OPEN,
+    ALSA_SIM_PCM_CLOSE,
+    ALSA_SIM_HW_PARAMS,
+    ALSA_SIM_SW_PARAMS,
+    ALSA_SIM_PREPARE,
+    ALSA_SIM_UCM_SET,
+    ALSA_SIM_MIXER_SET,
+    ALSA_SIM_OPS
+};
+
+enum alsa_sim_fault {
+    ALSA_SIM_FAULT_XRUN,        // absorbed in the library by a re-prepare
+    ALSA_SIM_FAULT_EIO,         // the transfer fails, the caller must reopen
+    ALSA_SIM_FAULTS
+};
+
+// Cost of one call: base plus a uniformly distributed extra up to jitter
+struct alsa_sim_latency_t {
+    uint32_t    baseUs;
+    uint32_t    jitterUs;
+};
+
+struct alsa_sim_config_t {
+    int         realtime;               // sleep instead of advancing the clock
+    uint32_t    periodUs;               // period used when none was asked for
+    uint32_t    periodCount;
+    int32_t     driftPpm;               // DAC clock against the system clock
+    uint32_t    wakeJitterUs;           // late wakeups of a blocked transfer
+    uint32_t    xrunEvery;              // inject ALSA_SIM_FAULT_XRUN every N transfers
+    uint32_t    seed;
+    alsa_sim_latency_t latency[ALSA_SIM_OPS];
+};
+
+struct alsa_sim_counters_t {
+    uint32_t    calls[ALSA_SIM_OPS];
+    int64_t     busyNs[ALSA_SIM_OPS];   // modelled time spent in each op
+    uint32_t    transfers;
+    uint32_t    xruns;                  // natural and injected
+    uint32_t    errors;                 // transfers failed with an injected EIO
+    int64_t     blockedNs;              // time transfers waited for the DAC/ADC
+};
+
+// Defaults: 20 ms periods, 4 per buffer, no drift or faults, and call
+// costs in the range measured on an msm8960 reference board
+void        alsa_sim_default_config(struct alsa_sim_config_t *config);
+// Applies to PCMs opened afterwards; also resets the counters
+void        alsa_sim_configure(const struct alsa_sim_config_t *config);
+void        alsa_sim_get_counters(struct alsa_sim_counters_t *counters);
+
+int64_t     alsa_sim_now_ns();
+void        alsa_sim_advance_ns(int64_t ns);
+
+// The next count transfers on any PCM hit the fault
+void        alsa_sim_inject_fault(int fault, int count);
+
+// Current UCM verb and devices, e.g. "HiFi|Speaker", for checking routes
+int         alsa_sim_ucm_state(char *buffer, size_t size);
+
+int         alsa_sim_ioctl(int fd, unsigned long request, ...);
+
+}
+
+#ifdef ALSA_SIM
+#define ioctl alsa_sim_ioctl
+#endif
+
+#endif    // ANDROID_ALSA_SIM_H
@@ -27,6 +27,8 @@
 #include <hardware_legacy/AudioHardwareInterface.h>
 #include <hardware_legacy/AudioSystemLegacy.h>
 
+#include "AudioHardwareALSA.h"
+
 namespace android_audio_legacy {
 
 extern "C" {
@@ -53,6 +55,28 @@ struct qcom_stream_in {
     AudioStreamIn *qcom_in;
 };
 
+/* Wrappers come and go with every stream, keep them off the heap */
+static ALSAObjectPool<sizeof(struct qcom_stream_out), ALSA_STREAM_POOL_SIZE> sOutPool;
+static ALSAObjectPool<sizeof(struct qcom_stream_in), ALSA_STREAM_POOL_SIZE> sInPool;
+
+static struct qcom_stream_out *alloc_stream_out()
+{
+    void *out = sOutPool.alloc(sizeof(struct qcom_stream_out));
+
+    if (out)
+        memset(out, 0, sizeof(struct qcom_stream_out));
+    return (struct qcom_stream_out *)out;
+}
+
+static struct qcom_stream_in *alloc_stream_in()
+{
+    void *in = sInPool.alloc(sizeof(struct qcom_stream_in));
+
+    if (in)
+        memset(in, 0, sizeof(struct qcom_stream_in));
+    return (struct qcom_stream_in *)in;
+}
+
 /** audio_stream_out implementation **/
 static uint32_t out_get_sample_rate(const struct audio_stream *stream)
 {
@@ -416,7 +440,7 @@ static int adev_open_output_session(struct audio_hw_device *dev,
     struct qcom_stream_out *out;
     int ret;
 
-    out = (struct qcom_stream_out *)calloc(1, sizeof(*out));
+    out = alloc_stream_out();
     if (!out)
         return -ENOMEM;
 
@@ -434,7 +458,7 @@ static int adev_open_output_session(struct audio_hw_device *dev,
     return 0;
 
 err_open:
-    free(out);
+    sOutPool.release(out);
     *stream_out = NULL;
     return ret;
 }
@@ -452,7 +476,7 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     struct qcom_stream_out *out;
     int ret;
 
-    out = (struct qcom_stream_out *)calloc(1, sizeof(*out));
+    out = alloc_stream_out();
     if (!out)
         return -ENOMEM;
 
@@ -484,7 +508,7 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     return 0;
 
 err_open:
-    free(out);
+    sOutPool.release(out);
     *stream_out = NULL;
     return ret;
 }
@@ -496,7 +520,7 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
     struct qcom_stream_out *out = reinterpret_cast<struct qcom_stream_out *>(stream);
 
     qadev->hwif->closeOutputStream(out->qcom_out);
-    free(out);
+    sOutPool.release(out);
 }
 
 /** This method creates and opens the audio hardware input stream */
@@ -511,7 +535,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     struct qcom_stream_in *in;
     int ret;
 
-    in = (struct qcom_stream_in *)calloc(1, sizeof(*in));
+    in = alloc_stream_in();
     if (!in)
         return -ENOMEM;
 
@@ -543,7 +567,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     return 0;
 
 err_open:
-    free(in);
+    sInPool.release(in);
     *stream_in = NULL;
     return ret;
 }
@@ -556,7 +580,7 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
         reinterpret_cast<struct qcom_stream_in *>(stream);
 
     qadev->hwif->closeInputStream(in->qcom_in);
-    free(in);
+    sInPool.release(in);
 }
 
 static int adev_dump(const struct audio_hw_device *dev, int fd)
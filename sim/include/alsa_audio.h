@@ -0,0 +1,83 @@
+/* sim/include/alsa_audio.h
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#ifndef __ALSA_AUDIO_H
+#define __ALSA_AUDIO_H
+
+/*
+ * The part of libalsa-intf's alsa_audio.h that this tree uses, for host
+ * builds against alsa_sim.cpp, where mm-audio headers are not exported.
+ * Flag values and struct pcm field names match the device header; the
+ * mixer is opaque, alsa_sim.cpp defines its own.
+ */
+
+#include <stdint.h>
+
+struct pcm {
+    int fd;
+    unsigned rate;
+    unsigned channels;
+    unsigned flags;
+    unsigned format;
+    unsigned running:1;
+    int underruns;
+    unsigned buffer_size;
+    unsigned period_size;
+    unsigned period_cnt;
+};
+
+#define PCM_OUT        0x00000000
+#define PCM_IN         0x10000000
+
+#define PCM_STEREO     0x00000000
+#define PCM_MONO       0x01000000
+#define PCM_QUAD       0x02000000
+#define PCM_5POINT1    0x04000000
+
+#define PCM_NMMAP      0x00000000
+#define PCM_MMAP       0x00100000
+
+struct pcm *pcm_open(unsigned flags, char *device);
+int pcm_close(struct pcm *pcm);
+int pcm_ready(struct pcm *pcm);
+int pcm_prepare(struct pcm *pcm);
+int pcm_write(struct pcm *pcm, void *data, unsigned count);
+int pcm_read(struct pcm *pcm, void *data, unsigned count);
+
+void param_init(struct snd_pcm_hw_params *p);
+void param_set_mask(struct snd_pcm_hw_params *p, int n, unsigned bit);
+void param_set_min(struct snd_pcm_hw_params *p, int n, unsigned val);
+void param_set_max(struct snd_pcm_hw_params *p, int n, unsigned val);
+void param_set_int(struct snd_pcm_hw_params *p, int n, unsigned val);
+void param_dump(struct snd_pcm_hw_params *p);
+int param_set_hw_refine(struct pcm *pcm, struct snd_pcm_hw_params *params);
+int param_set_hw_params(struct pcm *pcm, struct snd_pcm_hw_params *params);
+int param_set_sw_params(struct pcm *pcm, struct snd_pcm_sw_params *sparams);
+long pcm_buffer_size(struct snd_pcm_hw_params *params);
+long pcm_period_size(struct snd_pcm_hw_params *params);
+
+struct mixer;
+struct mixer_ctl;
+
+struct mixer *mixer_open(const char *device);
+void mixer_close(struct mixer *mixer);
+struct mixer_ctl *mixer_get_control(struct mixer *mixer, const char *name, unsigned index);
+int mixer_ctl_set(struct mixer_ctl *ctl, unsigned percent);
+int mixer_ctl_select(struct mixer_ctl *ctl, const char *value);
+void mixer_ctl_get(struct mixer_ctl *ctl, unsigned *value);
+
+#endif
@@ -0,0 +1,90 @@
+/* sim/include/msm8960_use_cases.h
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#ifndef _MSM8960_USE_CASES_H_
+#define _MSM8960_USE_CASES_H_
+
+/*
+ * Use case manager API and the verb, device and modifier names this tree
+ * uses, for host builds against alsa_sim.cpp. The simulator only compares
+ * the names, so they need not match the device UCM files.
+ */
+
+typedef struct snd_use_case_mgr snd_use_case_mgr_t;
+
+int snd_use_case_mgr_open(snd_use_case_mgr_t **uc_mgr, const char *card_name);
+int snd_use_case_mgr_close(snd_use_case_mgr_t *uc_mgr);
+int snd_use_case_get(snd_use_case_mgr_t *uc_mgr, const char *identifier, const char **value);
+int snd_use_case_set(snd_use_case_mgr_t *uc_mgr, const char *identifier, const char *value);
+
+#define SND_USE_CASE_VERB_INACTIVE              "Inactive"
+#define SND_USE_CASE_VERB_HIFI                  "HiFi"
+#define SND_USE_CASE_VERB_HIFI_LOW_POWER        "HiFi Low Power"
+#define SND_USE_CASE_VERB_VOICECALL             "Voice Call"
+#define SND_USE_CASE_VERB_IP_VOICECALL          "Voice Call IP"
+#define SND_USE_CASE_VERB_DIGITAL_RADIO         "FM Digital Radio"
+#define SND_USE_CASE_VERB_HIFI_REC              "HiFi Rec"
+#define SND_USE_CASE_VERB_FM_REC                "FM REC"
+#define SND_USE_CASE_VERB_FM_A2DP_REC           "FM A2DP REC"
+#define SND_USE_CASE_VERB_DL_REC                "DL REC"
+#define SND_USE_CASE_VERB_UL_DL_REC             "UL DL REC"
+
+#define SND_USE_CASE_DEV_NONE                   "None"
+#define SND_USE_CASE_DEV_EARPIECE               "Earpiece"
+#define SND_USE_CASE_DEV_EARPIECE_VOICE         "Voice Earpiece"
+#define SND_USE_CASE_DEV_SPEAKER                "Speaker"
+#define SND_USE_CASE_DEV_SPEAKER_VOICE          "Voice Speaker"
+#define SND_USE_CASE_DEV_LINE                   "Line"
+#define SND_USE_CASE_DEV_LINE_VOICE             "Voice Line"
+#define SND_USE_CASE_DEV_HEADPHONES             "Headphones"
+#define SND_USE_CASE_DEV_HEADSET                "Headset"
+#define SND_USE_CASE_DEV_HANDSET                "Handset"
+#define SND_USE_CASE_DEV_HANDSET_VOICE          "Voice Handset"
+#define SND_USE_CASE_DEV_SPEAKER_HEADSET        "Speaker Headset"
+#define SND_USE_CASE_DEV_ANC_HEADSET            "ANC Headset"
+#define SND_USE_CASE_DEV_SPEAKER_ANC_HEADSET    "Speaker ANC Headset"
+#define SND_USE_CASE_DEV_BTSCO_NB_RX            "BT SCO Rx"
+#define SND_USE_CASE_DEV_BTSCO_NB_TX            "BT SCO Tx"
+#define SND_USE_CASE_DEV_BTSCO_WB_RX            "BT SCO WB Rx"
+#define SND_USE_CASE_DEV_BTSCO_WB_TX            "BT SCO WB Tx"
+#define SND_USE_CASE_DEV_HDMI                   "HDMI"
+#define SND_USE_CASE_DEV_HDMI_TX                "HDMI Tx"
+#define SND_USE_CASE_DEV_FM_TX                  "FM Tx"
+#define SND_USE_CASE_DEV_SPEAKER_FM_TX          "Speaker FM Tx"
+#define SND_USE_CASE_DEV_PROXY_RX               "PROXY Rx"
+#define SND_USE_CASE_DEV_DUAL_MIC_ENDFIRE       "DMIC Endfire"
+#define SND_USE_CASE_DEV_DUAL_MIC_BROADSIDE     "DMIC Broadside"
+#define SND_USE_CASE_DEV_SPEAKER_DUAL_MIC_ENDFIRE   "Speaker DMIC Endfire"
+#define SND_USE_CASE_DEV_SPEAKER_DUAL_MIC_BROADSIDE "Speaker DMIC Broadside"
+#define SND_USE_CASE_DEV_QUAD_MIC               "QMIC"
+#define SND_USE_CASE_DEV_TTY_HEADSET_RX         "TTY Headset Rx"
+#define SND_USE_CASE_DEV_TTY_HEADSET_TX         "TTY Headset Tx"
+#define SND_USE_CASE_DEV_TTY_FULL_RX            "TTY Full Rx"
+#define SND_USE_CASE_DEV_TTY_FULL_TX            "TTY Full Tx"
+
+#define SND_USE_CASE_MOD_PLAY_MUSIC             "Play Music"
+#define SND_USE_CASE_MOD_PLAY_LPA               "Play LPA"
+#define SND_USE_CASE_MOD_PLAY_VOICE             "Play Voice"
+#define SND_USE_CASE_MOD_PLAY_VOIP              "Play VOIP"
+#define SND_USE_CASE_MOD_PLAY_FM                "Play FM"
+#define SND_USE_CASE_MOD_CAPTURE_MUSIC          "Capture Music"
+#define SND_USE_CASE_MOD_CAPTURE_FM             "Capture FM"
+#define SND_USE_CASE_MOD_CAPTURE_A2DP_FM        "Capture A2DP FM"
+#define SND_USE_CASE_MOD_CAPTURE_VOICE_DL       "Capture Voice Downlink"
+#define SND_USE_CASE_MOD_CAPTURE_VOICE_UL_DL    "Capture Voice Uplink Downlink"
+
+#endif